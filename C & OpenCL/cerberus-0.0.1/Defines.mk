@@ -92,3 +92,4 @@ SRC_DIR = src
 LIB_DIR = lib
 INC_DIR = include
 TESTS_DIR = tests
+BENCH_DIR = bench
@@ -0,0 +1,400 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+// Runs the test applications over a sweep of workgroup counts and sizes and
+// reports the median and 95th percentile of every phase. Each run writes a
+// trace (CERBERUS_TRACE) that gives the host phases, the total is the wall
+// time of the whole process. The environment is passed on to the apps, so
+// e.g. CERBERUS_DEVICE_TYPE=cpu benchmarks the CPU device.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_VALUES 32
+#define MAX_PHASES 32
+#define NAME_LENGTH 32
+
+typedef enum
+{
+	INPUT_TEXT = 0,
+	INPUT_BMP,
+	INPUT_POINTS,
+	INPUT_MATRIX,
+	INPUT_DOCS
+} input_t;
+
+typedef struct
+{
+	const char* name;
+	input_t input;
+} app_t;
+
+static const app_t apps[] = {
+	{"histogram", INPUT_BMP},
+	{"linear_regression", INPUT_POINTS},
+	{"matrix_multiply", INPUT_MATRIX},
+	{"similarity_score", INPUT_DOCS},
+	{"string_match", INPUT_TEXT},
+	{"word_count", INPUT_TEXT},
+};
+#define NUM_APPS (sizeof(apps) / sizeof(apps[0]))
+
+// Samples of one phase over the repetitions of a configuration
+typedef struct
+{
+	char name[NAME_LENGTH];
+	long* samples;
+	size_t num;
+} series_t;
+
+// Time of one phase in a single run
+typedef struct
+{
+	char name[NAME_LENGTH];
+	long us;
+} phase_t;
+
+typedef struct
+{
+	const char* tests;			// Directory of the test applications
+	const char* data;			// Directory of the generated inputs
+	const char* format;			// csv or json
+	int reps;
+	int warmup;
+	int groups[MAX_VALUES];
+	int num_groups;
+	int items[MAX_VALUES];
+	int num_items;
+	int matrix_len;
+	int num_docs;
+	int vector_size;
+	char trace[1024];
+} options_t;
+
+static long now_us()
+{
+	struct timeval t;
+
+	gettimeofday(&t, NULL);
+	return t.tv_sec * 1000000L + t.tv_usec;
+}
+
+// Comma separated list of integers
+static int parse_list(const char* list, int* values)
+{
+	int num = 0;
+	char* end;
+
+	while(*list != '\0' && num < MAX_VALUES)
+	{
+		values[num++] = strtol(list, &end, 0);
+		if(*end != ',')
+			break;
+		list = end + 1;
+	}
+	return num;
+}
+
+static series_t* find_series(series_t* series, size_t* num, const char* name)
+{
+	for(size_t i = 0; i < *num; i++)
+	{
+		if(strcmp(series[i].name, name) == 0)
+			return &series[i];
+	}
+	if(*num == MAX_PHASES)
+		return NULL;
+	series_t* s = &series[(*num)++];
+	size_t len = strlen(name);
+	memset(s, 0, sizeof(series_t));
+	memcpy(s->name, name, (len < NAME_LENGTH) ? len : NAME_LENGTH - 1);
+	return s;
+}
+
+static void add_sample(series_t* series, size_t* num, const char* name, long value)
+{
+	series_t* s = find_series(series, num, name);
+
+	if(s == NULL)
+		return;
+	s->samples = realloc(s->samples, sizeof(long) * (s->num + 1));
+	s->samples[s->num++] = value;
+}
+
+// Adds up the host phases of one run. A phase that ran more than once (rounds,
+// devices) counts with its total.
+static size_t read_trace(const char* path, phase_t* phases)
+{
+	char line[1024];
+	size_t num = 0;
+	FILE* in = fopen(path, "r");
+
+	if(in == NULL)
+		return 0;
+	while(fgets(line, sizeof(line), in) != NULL)
+	{
+		char name[NAME_LENGTH];
+		long dur;
+		char* p = strstr(line, "\"name\": \"");
+		char* d = strstr(line, "\"dur\": ");
+		if(p == NULL || d == NULL || strstr(line, "\"cat\": \"host\"") == NULL)
+			continue;
+		if(sscanf(p, "\"name\": \"%31[^\"]\"", name) != 1 || sscanf(d, "\"dur\": %ld", &dur) != 1)
+			continue;
+		size_t i = 0;
+		while(i < num && strcmp(phases[i].name, name) != 0)
+			i++;
+		if(i == num)
+		{
+			if(num == MAX_PHASES)
+				continue;
+			strcpy(phases[num].name, name);
+			phases[num++].us = 0;
+		}
+		phases[i].us += dur;
+	}
+	fclose(in);
+	return num;
+}
+
+// Runs the app once in its directory, returns its wall time or -1
+static long run_app(const options_t* opt, const app_t* app, int groups, int items)
+{
+	char dir[1024];
+	char input[1024];
+	char args[4][32];
+	char* argv[7];
+	int argc = 0;
+
+	snprintf(dir, sizeof(dir), "%s/%s", opt->tests, app->name);
+	argv[argc++] = (char*)app->name;
+	switch(app->input)
+	{
+	case INPUT_TEXT:
+		snprintf(input, sizeof(input), "%s/text.txt", opt->data);
+		argv[argc++] = input;
+		break;
+	case INPUT_BMP:
+		snprintf(input, sizeof(input), "%s/image.bmp", opt->data);
+		argv[argc++] = input;
+		break;
+	case INPUT_POINTS:
+		snprintf(input, sizeof(input), "%s/points.bin", opt->data);
+		argv[argc++] = input;
+		break;
+	case INPUT_MATRIX:
+		snprintf(args[0], sizeof(args[0]), "%d", opt->matrix_len);
+		argv[argc++] = args[0];
+		break;
+	case INPUT_DOCS:
+		snprintf(args[0], sizeof(args[0]), "%d", opt->num_docs);
+		snprintf(args[1], sizeof(args[1]), "%d", opt->vector_size);
+		argv[argc++] = args[0];
+		argv[argc++] = args[1];
+		break;
+	}
+	// Every app takes the workgroup size first and then the number of workgroups
+	snprintf(args[2], sizeof(args[2]), "%d", items);
+	snprintf(args[3], sizeof(args[3]), "%d", groups);
+	argv[argc++] = args[2];
+	argv[argc++] = args[3];
+	argv[argc] = NULL;
+
+	unlink(opt->trace);
+	long begin = now_us();
+	pid_t pid = fork();
+	if(pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if(pid == 0)
+	{
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		setenv("CERBERUS_TRACE", opt->trace, 1);
+		if(chdir(dir) == 0)
+		{
+			char exe[1100];
+			snprintf(exe, sizeof(exe), "./%s", app->name);
+			execv(exe, argv);
+		}
+		_exit(127);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	long wall = now_us() - begin;
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+	return wall;
+}
+
+static int compare_long(const void* a, const void* b)
+{
+	long x = *(const long*)a;
+	long y = *(const long*)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted samples
+static long percentile(const long* sorted, size_t num, int p)
+{
+	size_t rank = (num * p + 99) / 100;
+	return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+static void report(const options_t* opt, const app_t* app, int groups, int items, series_t* series,
+	size_t num, int* first)
+{
+	for(size_t i = 0; i < num; i++)
+	{
+		series_t* s = &series[i];
+		qsort(s->samples, s->num, sizeof(long), compare_long);
+		long median = (s->num % 2) ? s->samples[s->num / 2] :
+			(s->samples[s->num / 2 - 1] + s->samples[s->num / 2]) / 2;
+		long p95 = percentile(s->samples, s->num, 95);
+		if(strcmp(opt->format, "json") == 0)
+		{
+			printf("%s\n  {\"app\": \"%s\", \"workgroups\": %d, \"workitems\": %d, \"phase\": \"%s\", "
+				   "\"runs\": %zu, \"median_us\": %ld, \"p95_us\": %ld}", *first ? "" : ",", app->name,
+				   groups, items, s->name, s->num, median, p95);
+		}
+		else
+		{
+			printf("%s,%d,%d,%s,%zu,%ld,%ld\n", app->name, groups, items, s->name, s->num, median, p95);
+		}
+		*first = 0;
+		free(s->samples);
+	}
+	fflush(stdout);
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "USAGE: %s [-a apps] [-g workgroups] [-i workitems] [-n reps] [-w warmup]\n"
+			"          [-f csv|json] [-d datadir] [-t testsdir] [-m matrix_len] [-s docs,vector]\n"
+			"Lists are comma separated, e.g. -g 4,8,16 -i 64,128,256\n", name);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	options_t opt;
+	const char* selected = NULL;
+	char cwd[512];
+	int c;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.tests = "../tests";
+	opt.data = "data";
+	opt.format = "csv";
+	opt.reps = 5;
+	opt.warmup = 1;
+	opt.num_groups = parse_list("4,8,16", opt.groups);
+	opt.num_items = parse_list("64,128,256", opt.items);
+	opt.matrix_len = 256;
+	opt.num_docs = 1024;
+	opt.vector_size = 128;
+	while((c = getopt(argc, argv, "a:g:i:n:w:f:d:t:m:s:")) != -1)
+	{
+		switch(c)
+		{
+		case 'a': selected = optarg; break;
+		case 'g': opt.num_groups = parse_list(optarg, opt.groups); break;
+		case 'i': opt.num_items = parse_list(optarg, opt.items); break;
+		case 'n': opt.reps = atoi(optarg); break;
+		case 'w': opt.warmup = atoi(optarg); break;
+		case 'f': opt.format = optarg; break;
+		case 'd': opt.data = optarg; break;
+		case 't': opt.tests = optarg; break;
+		case 'm': opt.matrix_len = atoi(optarg); break;
+		case 's':
+			if(sscanf(optarg, "%d,%d", &opt.num_docs, &opt.vector_size) != 2)
+				usage(argv[0]);
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if(opt.reps < 1 || (strcmp(opt.format, "csv") != 0 && strcmp(opt.format, "json") != 0))
+		usage(argv[0]);
+
+	// The apps run in their own directories, so every path has to be absolute
+	if(getcwd(cwd, sizeof(cwd)) == NULL)
+	{
+		perror("getcwd");
+		return 1;
+	}
+	char tests[1024];
+	char data[1024];
+	if(opt.tests[0] != '/')
+	{
+		snprintf(tests, sizeof(tests), "%s/%s", cwd, opt.tests);
+		opt.tests = tests;
+	}
+	if(opt.data[0] != '/')
+	{
+		snprintf(data, sizeof(data), "%s/%s", cwd, opt.data);
+		opt.data = data;
+	}
+	snprintf(opt.trace, sizeof(opt.trace), "%s/bench_trace.json", cwd);
+
+	int first = 1;
+	if(strcmp(opt.format, "json") == 0)
+		printf("[");
+	else
+		printf("app,workgroups,workitems,phase,runs,median_us,p95_us\n");
+	for(size_t a = 0; a < NUM_APPS; a++)
+	{
+		const app_t* app = &apps[a];
+		if(selected != NULL && strstr(selected, app->name) == NULL)
+			continue;
+		for(int g = 0; g < opt.num_groups; g++)
+		{
+			for(int i = 0; i < opt.num_items; i++)
+			{
+				series_t series[MAX_PHASES];
+				size_t num = 0;
+				int failed = 0;
+
+				// Warm up runs fill the kernel cache and the page cache
+				for(int r = 0; r < opt.warmup; r++)
+					run_app(&opt, app, opt.groups[g], opt.items[i]);
+				for(int r = 0; r < opt.reps; r++)
+				{
+					phase_t phases[MAX_PHASES];
+					long wall = run_app(&opt, app, opt.groups[g], opt.items[i]);
+					if(wall < 0)
+					{
+						failed++;
+						continue;
+					}
+					add_sample(series, &num, "total", wall);
+					size_t num_phases = read_trace(opt.trace, phases);
+					for(size_t p = 0; p < num_phases; p++)
+						add_sample(series, &num, phases[p].name, phases[p].us);
+				}
+				if(failed > 0)
+				{
+					fprintf(stderr, "%s with %d workgroups of %d: %d of %d runs failed\n", app->name,
+							opt.groups[g], opt.items[i], failed, opt.reps);
+				}
+				report(&opt, app, opt.groups[g], opt.items[i], series, num, &first);
+			}
+		}
+	}
+	if(strcmp(opt.format, "json") == 0)
+		printf("\n]\n");
+	unlink(opt.trace);
+	return 0;
+}
@@ -0,0 +1,199 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+// Deterministic inputs for the test applications. The same seed and size
+// always give the same bytes, so timings from different runs can be compared.
+//
+//	gen [-s seed] text <bytes> <file>			word_count and string_match corpus
+//	gen [-s seed] bmp <width> <height> <file>	24-bit bitmap for histogram
+//	gen [-s seed] points <count> <file>			char2 points for linear_regression
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define DEFAULT_SEED 0x5eed
+#define VOCABULARY 4096
+#define LINE_LENGTH 72
+
+// Words string_match looks for, mixed into the corpus
+static const char* keys[] = {"Helloworld", "howareyou", "ferrari", "whotheman"};
+static const char* syllables[] = {
+	"ka", "ro", "mi", "te", "su", "na", "lo", "pe", "an", "is", "or", "ul", "ex", "va", "di",
+	"qu", "ze", "bo", "ha", "ly", "ing", "ent", "ion", "ers", "tha", "str"
+};
+
+static uint64_t state;
+
+// xorshift64*, the same on every platform unlike rand()
+static uint64_t next()
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+// Uniform in [0, n)
+static uint32_t uniform(uint32_t n)
+{
+	return (uint32_t)((next() >> 32) % n);
+}
+
+static FILE* create(const char* path)
+{
+	FILE* out = fopen(path, "wb");
+	if(out == NULL)
+	{
+		perror(path);
+		exit(1);
+	}
+	return out;
+}
+
+// Text of about Zipf distributed words in lines of at most LINE_LENGTH characters
+static void gen_text(size_t bytes, const char* path)
+{
+	char words[VOCABULARY][32];
+	double weights[VOCABULARY];
+	double total = 0.0;
+	size_t num_syllables = sizeof(syllables) / sizeof(syllables[0]);
+	FILE* out = create(path);
+
+	for(size_t w = 0; w < VOCABULARY; w++)
+	{
+		if(w < 4 * sizeof(keys) / sizeof(keys[0]) && w % 4 == 3)
+			strcpy(words[w], keys[w / 4]);
+		else
+		{
+			words[w][0] = '\0';
+			for(uint32_t s = 1 + uniform(4); s > 0; s--)
+				strcat(words[w], syllables[uniform(num_syllables)]);
+		}
+		total += 1.0 / (w + 1);
+		weights[w] = total;
+	}
+
+	size_t written = 0;
+	size_t line = 0;
+	while(written < bytes)
+	{
+		// Inverse of the cumulative weights by bisection
+		double r = (next() >> 11) * (1.0 / 9007199254740992.0) * total;
+		size_t lo = 0;
+		size_t hi = VOCABULARY - 1;
+		while(lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if(weights[mid] < r)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		size_t len = strlen(words[lo]);
+		if(line > 0 && line + 1 + len > LINE_LENGTH)
+		{
+			fputc('\n', out);
+			written++;
+			line = 0;
+		}
+		else if(line > 0)
+		{
+			fputc(' ', out);
+			written++;
+			line++;
+		}
+		fwrite(words[lo], 1, len, out);
+		written += len;
+		line += len;
+	}
+	fputc('\n', out);
+	fclose(out);
+}
+
+static void put_le(unsigned char* p, uint32_t value, int bytes)
+{
+	for(int i = 0; i < bytes; i++)
+		p[i] = (value >> (8 * i)) & 0xff;
+}
+
+// Gradients with noise, so every histogram bucket gets some pixels
+static void gen_bmp(uint32_t width, uint32_t height, const char* path)
+{
+	uint32_t row = (width * 3 + 3) & ~3u;
+	unsigned char header[54] = {'B', 'M'};
+	unsigned char* pixels = calloc(row, 1);
+	FILE* out = create(path);
+
+	put_le(header + 2, 54 + row * height, 4);
+	put_le(header + 10, 54, 4);
+	put_le(header + 14, 40, 4);
+	put_le(header + 18, width, 4);
+	put_le(header + 22, height, 4);
+	put_le(header + 26, 1, 2);
+	put_le(header + 28, 24, 2);
+	put_le(header + 34, row * height, 4);
+	fwrite(header, 1, sizeof(header), out);
+	for(uint32_t y = 0; y < height; y++)
+	{
+		for(uint32_t x = 0; x < width; x++)
+		{
+			unsigned char* p = pixels + 3 * x;
+			p[0] = (x * 255 / (width > 1 ? width - 1 : 1) + uniform(32)) & 0xff;
+			p[1] = (y * 255 / (height > 1 ? height - 1 : 1) + uniform(32)) & 0xff;
+			p[2] = uniform(256);
+		}
+		fwrite(pixels, 1, row, out);
+	}
+	free(pixels);
+	fclose(out);
+}
+
+// Points near y = 2x + 3
+static void gen_points(size_t count, const char* path)
+{
+	FILE* out = create(path);
+
+	for(size_t i = 0; i < count; i++)
+	{
+		int x = (int)uniform(60) - 30;
+		int y = 2 * x + 3 + (int)uniform(9) - 4;
+		signed char point[2] = { (signed char)x, (signed char)y };
+		fwrite(point, 1, sizeof(point), out);
+	}
+	fclose(out);
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "USAGE: %s [-s seed] text <bytes> <file>\n"
+			"       %s [-s seed] bmp <width> <height> <file>\n"
+			"       %s [-s seed] points <count> <file>\n", name, name, name);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	int arg = 1;
+
+	state = DEFAULT_SEED;
+	if(argc > 2 && strcmp(argv[1], "-s") == 0)
+	{
+		state = strtoull(argv[2], NULL, 0);
+		if(state == 0)
+			state = DEFAULT_SEED;
+		arg = 3;
+	}
+	if(argc - arg == 3 && strcmp(argv[arg], "text") == 0)
+		gen_text(strtoull(argv[arg + 1], NULL, 0), argv[arg + 2]);
+	else if(argc - arg == 4 && strcmp(argv[arg], "bmp") == 0)
+		gen_bmp(atoi(argv[arg + 1]), atoi(argv[arg + 2]), argv[arg + 3]);
+	else if(argc - arg == 3 && strcmp(argv[arg], "points") == 0)
+		gen_points(strtoull(argv[arg + 1], NULL, 0), argv[arg + 2]);
+	else
+		usage(argv[0]);
+	return 0;
+}
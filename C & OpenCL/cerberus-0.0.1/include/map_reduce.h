@@ -34,6 +34,7 @@
 
 #include "stdbool.h"
 #include "stddef.h"
+#include "stdint.h"
 #include "CL/cl.h"
 #include <sys/time.h>
 
@@ -58,6 +59,139 @@ typedef struct
 typedef void(*splitter_t)(void *);
 typedef void(*partition_t)(void *);
 typedef void(*merger_t)(merger_dat_t*);
+/* Given the start of a round and its maximum length, returns the length that
+   ends on a record boundary (0 keeps the maximum) */
+typedef size_t(*boundary_t)(const void *, size_t);
+/* Restores the task_data a splitter used up, so the job can run again */
+typedef void(*rewind_t)(void *);
+
+/* Device-side shuffle between map and reduce */
+typedef enum
+{
+	MR_SHUFFLE_NONE = 0,	/* Run the partition function */
+	MR_SHUFFLE_INT,			/* Sort by a 32-bit signed integer key */
+	MR_SHUFFLE_BYTES		/* Sort by a key_size byte key, compared like strcmp() */
+} mr_shuffle_t;
+
+/* Device-side hash combiner, groups keyvals whose value is the 32-bit unsigned
+ * integer right after the key */
+typedef enum
+{
+	MR_COMBINE_NONE = 0,	/* Run the partition function and the reduce kernels */
+	MR_COMBINE_SUM,			/* Sum the values of each key */
+	MR_COMBINE_MIN,			/* Smallest value of each key */
+	MR_COMBINE_MAX,			/* Largest value of each key */
+	MR_COMBINE_COUNT		/* Number of keyvals with each key, values are ignored */
+} mr_combine_t;
+
+/* Where map_reduce() runs the job. CERBERUS_BACKEND (opencl, native) overrides it */
+typedef enum
+{
+	MR_BACKEND_OPENCL = 0,	/* Map and reduce kernels on an OpenCL device */
+	MR_BACKEND_NATIVE		/* native_map/native_reduce on a pthread pool, no OpenCL calls */
+} mr_backend_t;
+
+/* Growing array of keyvals written by the native map and reduce functions */
+typedef struct
+{
+	void *data;
+	size_t count;				/* Keyvals written so far */
+	size_t capacity;
+	size_t keyval_size;
+} mr_emitter_t;
+
+/* Host versions of the map and reduce kernels. The map function gets one splitter
+   chunk, the reduce function the keyvals the partitioner gave to one reduce group.
+   Both append their keyvals to out with mr_emit() */
+typedef void(*native_map_t)(const void *input, size_t size, const void *aux, mr_emitter_t *out);
+typedef void(*native_reduce_t)(const void *keyvals, size_t num_keyvals, mr_emitter_t *out);
+
+/* Kind of a profiled OpenCL command */
+typedef enum
+{
+	MR_CMD_WRITE = 0,		/* Host to device transfer */
+	MR_CMD_KERNEL,
+	MR_CMD_COPY,			/* Copy between device buffers */
+	MR_CMD_READ				/* Device to host transfer, or mapping in zero copy mode */
+} mr_command_t;
+
+/* One profiled command. Times are the CL_PROFILING_COMMAND_* counters of the
+ * device, in nanoseconds */
+typedef struct
+{
+	mr_command_t type;
+	const char *name;		/* What the command was for, e.g. "input", "map" or "result" */
+	long group;				/* Workgroup (reduce workgroup after the map phase), -1 for
+							   commands that serve the whole job */
+	cl_uint queue;			/* Queue of the job it ran on, 0 is the main queue */
+	cl_ulong queued;
+	cl_ulong submit;
+	cl_ulong start;
+	cl_ulong end;
+} mr_profile_event_t;
+
+/* Commands of the profiled jobs, in the order they were enqueued */
+typedef struct
+{
+	mr_profile_event_t *events;
+	size_t num_events;
+} mr_profile_t;
+
+/* Host side phases of a job, timed in mr_stats_t. The map and reduce phase totals
+ * include the phases nested in them */
+typedef enum
+{
+	MR_PHASE_INIT = 0,			/* Environment setup */
+	MR_PHASE_SPLITTER,
+	MR_PHASE_MAP_INPUT,			/* Input buffers and uploads */
+	MR_PHASE_MAP_COUNT,
+	MR_PHASE_MAP_OUTPUT,		/* Map output buffers */
+	MR_PHASE_MAP,				/* Map kernels */
+	MR_PHASE_MAP_TOTAL,
+	MR_PHASE_PARTITION,
+	MR_PHASE_REDUCE_COUNT,
+	MR_PHASE_REDUCE,			/* Reduce kernels */
+	MR_PHASE_REDUCE_TOTAL,
+	MR_PHASE_COMBINE,
+	MR_PHASE_SHUFFLE,
+	MR_PHASE_READ_BACK,
+	MR_PHASE_FINALIZE,
+	MR_PHASE_MERGER,
+	MR_NUM_PHASES
+} mr_phase_t;
+
+/* Counters of one job. Rounds and co-executed devices add up, the tuple arrays
+ * list the groups of every round and device in turn. */
+typedef struct
+{
+	size_t input_bytes;			/* data_size of the job */
+	size_t bytes_uploaded;		/* Host to device, buffer initialisation included */
+	size_t bytes_downloaded;
+	size_t *map_tuples;			/* Keyvals emitted by each map workgroup */
+	size_t num_map_groups;
+	size_t *reduce_tuples;		/* Keyvals left by each reduce workgroup */
+	size_t num_reduce_groups;
+	size_t buffer_bytes;		/* Device buffers created, not counting pooled ones reused */
+	size_t peak_device_bytes;	/* Most memory held by the library's buffers at once, idle
+								   pooled ones included, on the busiest device */
+	size_t kernels_built;		/* Programs compiled from source */
+	size_t kernels_loaded;		/* Programs loaded from the binary cache */
+	size_t kernels_reused;		/* Kernels already built by an earlier job */
+	long build_us;				/* Spent compiling and loading programs */
+	size_t kernel_workitems;	/* Smallest CL_KERNEL_WORK_GROUP_SIZE of the job's kernels */
+	long phase_us[MR_NUM_PHASES];	/* Wall time per phase, in microseconds */
+} mr_stats_t;
+
+/* Device selection policy. A zeroed policy picks the first GPU and falls back
+ * to any other OpenCL device (e.g. a CPU runtime such as POCL). The
+ * CERBERUS_DEVICE_TYPE (gpu, cpu, accelerator, all), CERBERUS_PLATFORM and
+ * CERBERUS_DEVICE environment variables override the fields below. */
+typedef struct
+{
+	cl_device_type type;			/* Device type mask, 0 for GPU with fallback */
+	char platform[MAX_FILENAME];	/* Substring of the platform name, empty for any */
+	char device[MAX_FILENAME];		/* Substring of the device name, empty for any */
+} mr_device_policy_t;
 
 /* The arguments to operate the runtime. */
 typedef struct
@@ -82,29 +216,208 @@ typedef struct
 	size_t num_workgroups;
 	size_t num_workitems;
 	size_t tasks_per_reduce;
+	mr_device_policy_t device_policy;	/* Which OpenCL device to run on */
+	char kernel_cache_dir[MAX_FILENAME];	/* Compiled kernel cache, empty to disable.
+										   Overridden by CERBERUS_KERNEL_CACHE */
+	size_t num_streams;			/* Command queues used to overlap input uploads and read backs
+								   with kernels, 0 or 1 disables streaming */
+	bool out_of_core;			/* Process the input in rounds that fit in device memory */
+	size_t round_size;			/* Upper bound on the bytes per round, 0 derives it from
+								   CL_DEVICE_GLOBAL_MEM_SIZE/CL_DEVICE_MAX_MEM_ALLOC_SIZE */
+	boundary_t round_boundary;	/* Optional, trims rounds so no record is cut in half */
+	bool runtime_tasks;			/* Pass TASKS_PER_MAP/TASKS_PER_REDUCE as kernel arguments
+								   instead of build flags, so one build serves all input sizes */
+	bool single_launch;			/* Run every phase as one NDRange over all workgroups. Kernels
+								   must start with MR_GROUP_PROLOGUE, see src/preamble.c */
+	bool fused_map;				/* Run the map kernel once, without map_count. Keyvals go through
+								   MR_EMIT into optimistically sized buffers, workgroups that
+								   run out of room are re-run */
+	mr_shuffle_t shuffle;		/* Sort map output by key on the device instead of calling the
+								   partitioner. Keys must be at the start of the keyval */
+	size_t key_size;			/* Key bytes for MR_SHUFFLE_BYTES, 0 for the whole keyval. The
+								   combiner defaults to everything before the value */
+	size_t fused_outputs_per_task;	/* Expected map outputs per input unit in fused_map mode,
+									   0 makes the output as large as the input */
+	mr_combine_t combine;		/* Group map output by key in a device hash table instead of
+								   partitioning and running the reduce kernels */
+	bool string_keys;			/* Combiner keys end at the first NUL byte */
+	mr_combine_t map_combine;	/* Combine keyvals in __local memory inside each map workgroup
+								   before they reach map_array. The map kernel must emit
+								   through MR_COMBINE_EMIT and end with MR_COMBINE_FLUSH */
+	bool arena_partition;		/* With single_launch and map_count, write the map output of
+								   every reduce group as one contiguous range and hand the
+								   ranges to the reduce kernels instead of copying them */
+	bool zero_copy;				/* On devices that share memory with the host, use the input
+								   in place and map the results instead of copying them.
+								   Ignored on other devices */
+	mr_backend_t backend;
+	native_map_t native_map;	/* Required by the native backend */
+	native_reduce_t native_reduce;	/* Optional, without it the map output goes to the merger */
+	size_t num_threads;			/* Native backend threads, 0 for one per online CPU */
+	size_t native_grain;		/* Units per native map call. Splitter chunks are cut into runs
+								   of this many units that idle threads steal from busy ones,
+								   0 picks about 32 per thread */
+	bool co_execute;			/* Split the input between every device matching device_policy
+								   (of any type when it has none), in proportion to the
+								   throughput each one had in the previous job. Overridden by
+								   CERBERUS_CO_EXECUTE (0 or 1) */
+	bool profiling;				/* Run on profiling queues and add every write, kernel, copy and
+								   read of the job to profile. CERBERUS_PROFILE=1 turns it on */
+	mr_profile_t profile;		/* Appended to by profiled jobs, free profile.events when done */
+	bool shard;					/* Spread the workgroups over every device matching device_policy
+								   on the platform of the first one, in one shared context.
+								   Overridden by CERBERUS_SHARD (0 or 1) */
+	cl_uint sub_devices;		/* With co_execute or shard, split CPU devices into this many
+								   equal sub-devices. Overridden by CERBERUS_SUB_DEVICES */
+	const char *trace_file;		/* Write a Chrome trace (chrome://tracing, Perfetto) of the host
+								   phases and device commands of every job to this file, which
+								   map_reduce_finalize() closes. Overridden by CERBERUS_TRACE */
+	mr_stats_t *stats;			/* Filled by every job when set. Zero it before the first job,
+								   each job frees the tuple arrays of the previous one. Free
+								   map_tuples and reduce_tuples when done */
+	bool autotune;				/* Search num_workgroups, num_workitems and tasks_per_reduce for
+								   jobs that have no entry in tuning_db yet, running the job
+								   once per candidate. Overridden by CERBERUS_AUTOTUNE (0 or 1) */
+	rewind_t splitter_rewind;	/* Called with task_data before every autotuning run. Jobs with
+								   their own splitter are only searched when it is set */
+	char tuning_db[MAX_FILENAME];	/* Tuning database. Its entries set the three fields for the
+									   jobs with their kernels, device and input size. Empty keeps
+									   autotuned entries in memory. Overridden by
+									   CERBERUS_TUNING_DB */
     void *result;       /* Pointer to output data. It is allocated in the merger function */
     size_t *result_len; /* Length of resulting data */
 } map_reduce_args_t;
 
+/* Handle of a job started by map_reduce_submit() */
+typedef struct mr_job mr_job_t;
+
+/* Buffer pool counters, see map_reduce_pool_stats() */
+typedef struct
+{
+	size_t hits;				/* Buffers handed out again */
+	size_t misses;				/* Buffers that had to be created */
+	size_t pooled_bytes;		/* Device memory held by idle buffers */
+} mr_pool_stats_t;
+
 /* Runtime defined functions. */
 
-/* MapReduce initialization function. Called once per process. */
+/* MapReduce initialization function. Called once per process. Sets up the OpenCL
+ * context, command queue and device information reused by every map_reduce() call. */
 int map_reduce_init();
-/* MapReduce finalization function. Called once per process. */
+/* MapReduce finalization function. Called once per process. Releases the state
+ * created by map_reduce_init(). */
 int map_reduce_finalize();
 /* The main MapReduce engine. This is the function called by the application.
  * It is responsible for creating and scheduling all map and reduce tasks, and
  * also organizes and maintains the data which is passed from application to 
  * map tasks, map tasks to reduce tasks, and reduce tasks back to the
  * application. Results are stored in args->result. A return value less than zero
- * represents an error. This function is not thread safe. 
+ * represents an error. Jobs from different threads, and submitted ones, take turns
+ * on the device, the merger runs on the calling thread.
  */   
 int map_reduce(map_reduce_args_t  *args);
+/* Starts the job in the background and returns at once. Jobs run in submission
+ * order. Their splitter, kernels and read back run one job at a time, the merger
+ * of a job overlaps the device work of the next one. args must stay valid until
+ * map_reduce_wait() returns. Returns NULL if the handle can't be allocated. */
+mr_job_t *map_reduce_submit(map_reduce_args_t *args);
+/* 1 if the job is complete (its result is in args->result), 0 if it is still running */
+int map_reduce_poll(mr_job_t *job);
+/* Blocks until the job is complete and frees the handle. Returns what map_reduce()
+ * would have. */
+int map_reduce_wait(mr_job_t *job);
+/* Device buffer pool counters of the runtime created by map_reduce_init(), which
+ * reuses buffers across jobs. Returns -1 if there is no such runtime. */
+int map_reduce_pool_stats(mr_pool_stats_t *stats);
+/* Name of a phase, as it appears in traces */
+const char *map_reduce_phase_name(mr_phase_t phase);
+/* Appends a keyval of out->keyval_size bytes, for native map and reduce functions */
+void mr_emit(mr_emitter_t *out, const void *keyval);
 
 /* Default splitter and partitioners */
 void default_splitter(void*);
 void default_partition(void*);
 
+/* Device properties cached when the runtime is created */
+typedef struct
+{
+	char name[256];
+	char driver_version[128];
+	cl_device_type type;
+	cl_uint num_compute_units;
+	cl_ulong local_mem_size;
+	cl_ulong global_mem_size;
+	cl_ulong max_alloc_size;
+	size_t max_workitems;
+	cl_uint mem_base_align;		/* Sub-buffer origin alignment in bytes */
+	cl_bool host_unified_memory;	/* Device and host share physical memory */
+} mr_device_info_t;
+
+/* Kernel built by the runtime, kept for later jobs */
+typedef struct mr_program_entry
+{
+	uint64_t key;				/* Hash of the source, build flags and device */
+	cl_program program;
+	cl_kernel kernel;
+	struct mr_program_entry *next;
+} mr_program_entry_t;
+
+/* Idle device buffer kept for reuse */
+typedef struct mr_pool_entry
+{
+	cl_mem mem;
+	cl_mem_flags flags;
+	struct mr_pool_entry *next;
+} mr_pool_entry_t;
+
+/* Size classes of the buffer pool, four per power of two from 256 bytes up */
+#define MR_POOL_CLASSES 128
+/* Devices of a co-execution set or a sharded context */
+#define MR_MAX_DEVICES 16
+
+/* Device memory of the buffers created in a context. Buffers can be destroyed after
+ * their runtime is gone, so the runtime and every counted buffer hold a reference. */
+typedef struct
+{
+	size_t created;
+	size_t live;
+	size_t peak;				/* Since the start of the current job */
+	size_t refs;
+} mr_mem_counters_t;
+
+/* Long-lived OpenCL state. Owned by map_reduce_init()/map_reduce_finalize() and 
+ * shared by all jobs, or created per job when they were not called. */
+typedef struct
+{
+	cl_platform_id platform;
+	cl_device_id device;			/* First of devices */
+	cl_device_id devices[MR_MAX_DEVICES];	/* Devices of the context, more than one when sharded */
+	cl_uint num_devices;
+	cl_context context;
+	cl_command_queue queue;
+	cl_command_queue *queues;		/* Main queue followed by the extra streaming queues, queue i
+									   runs on devices[i % num_devices] */
+	cl_uint num_queues;
+	mr_device_info_t info;			/* Smallest limits over all devices */
+	mr_program_entry_t *programs;	/* Kernels built so far, most recently used first */
+	size_t num_programs;
+	mr_pool_entry_t *pool[MR_POOL_CLASSES];	/* Idle buffers by size class */
+	mr_pool_stats_t pool_stats;
+	cl_command_queue *profiling_queues;	/* Created with CL_QUEUE_PROFILING_ENABLE on first use */
+	cl_uint num_profiling_queues;
+	mr_mem_counters_t *mem;			/* Device memory of the buffers created in this context */
+} mr_runtime_t;
+
+/* Devices of co-executed jobs, created by the first one and kept until
+ * map_reduce_finalize(). Each job measures the throughput of every device and
+ * updates the share of the input it gets in the next job. */
+typedef struct
+{
+	mr_runtime_t *runtimes[MR_MAX_DEVICES];
+	double share[MR_MAX_DEVICES];	/* Fractions of the input, they add up to 1 */
+	cl_uint num_devices;
+} mr_device_set_t;
+
 /* Internal map reduce state. */
 typedef struct
 {
@@ -130,8 +443,11 @@ typedef struct
 	size_t map_aux_size;
 	splitter_array_t *splitter_data;
 	/* OpenCL specific */
+	mr_runtime_t *runtime;
 	cl_context device_context;
 	cl_command_queue device_queue;
+	cl_command_queue *queues;	/* Queues the workgroups are spread over */
+	cl_uint num_queues;
 	cl_device_id device;
 	cl_program map_program;
 	cl_program map_count_program;
@@ -144,6 +460,31 @@ typedef struct
 	size_t num_reduce_workitems;
 	cl_uint	num_compute_units;
 	size_t max_workitems;
+	bool zero_copy;				/* args->zero_copy on a device with host unified memory */
+	bool arena;					/* Map output is already partitioned, see arena_partition */
+	bool input_held;			/* Queued map kernels may still read input_array, run_job()
+								   releases it after the read back */
+	cl_mem *retired;			/* Pooled buffers queued commands may still use, handed back
+								   by finish_queues() */
+	size_t num_retired;
+	size_t retired_capacity;
+	cl_mem sorted;				/* Parent of the shuffle slices, handed back by env_fini() */
+	/* Native backend, the device fields above stay empty */
+	size_t num_threads;
+	mr_emitter_t *native_map_out;	/* Map output of every workgroup */
+	mr_emitter_t *native_reduce_in;	/* Keyvals of every reduce group, set by the partitioner */
+	mr_emitter_t *native_reduce_out;
+	/* Commands waiting for profile_collect() */
+	bool profiling;
+	bool tracing;				/* Profiled for the trace only, profile stays untouched */
+	cl_event *profile_events;
+	mr_profile_event_t *profile_pending;
+	cl_ulong *profile_host;		/* Host time of each enqueue in microseconds */
+	/* Counters handed to args->stats by env_fini() */
+	mr_stats_t stats;
+	size_t mem_created;			/* runtime->mem->created when the job started */
+	size_t num_profile_pending;
+	size_t profile_capacity;
 } mr_env_t;
 
 #endif // MAP_REDUCE_H_
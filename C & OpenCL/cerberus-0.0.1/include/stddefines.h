@@ -74,4 +74,13 @@ static inline void get_time(struct timeval *t)
     gettimeofday(t, NULL);
 }
 
+/* True when the environment variable is set to anything but 0. The test apps
+   keep their baseline setup and switch optional modes on this way */
+static inline int env_flag(const char *name)
+{
+    const char *env = getenv(name);
+
+    return env != NULL && env[0] != '\0' && !(env[0] == '0' && env[1] == '\0');
+}
+
 #endif // STDDEFINES_H_
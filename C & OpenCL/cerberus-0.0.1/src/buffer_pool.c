@@ -0,0 +1,120 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include "stddefines.h"
+#include "utils.h"
+#include "buffer_pool.h"
+#include "stats.h"
+
+//==========================================//
+//											//
+// Device buffer pool						//
+//											//
+//==========================================//
+
+// Smallest size class, in bits. Every power of two is split into four classes, class c
+// holds buffers of (4 + c % 4) * 2^(c / 4 + POOL_MIN_BITS - 2) bytes
+#define POOL_MIN_BITS 8
+// Flags a pooled buffer may have, anything with a host pointer is not reusable
+#define POOL_FLAGS (CL_MEM_READ_WRITE | CL_MEM_READ_ONLY | CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR)
+
+static size_t class_bytes(size_t c)
+{
+	return (4 + c % 4) * ((size_t)1 << (c / 4 + POOL_MIN_BITS - 2));
+}
+
+// Size class of a buffer of at least size bytes, MR_POOL_CLASSES if there is none
+static size_t size_class(size_t size)
+{
+	size_t c = 0;
+	while(c < MR_POOL_CLASSES && class_bytes(c) < size)
+		c++;
+	return c;
+}
+
+// Returns a buffer of at least size bytes. It may be up to POOL_ROUNDING times larger
+// and its contents are undefined. Recycled buffers come from pool_release() and are
+// idle. Sizes whose class is past CL_DEVICE_MAX_MEM_ALLOC_SIZE are allocated exactly
+// and never pooled.
+cl_mem pool_acquire(mr_runtime_t* runtime, cl_mem_flags flags, size_t size)
+{
+	cl_int error;
+	size_t c = size_class(size);
+
+	if(c < MR_POOL_CLASSES && (flags & ~POOL_FLAGS) == 0 && class_bytes(c) <= runtime->info.max_alloc_size)
+	{
+		mr_pool_entry_t** link = &runtime->pool[c];
+		for(mr_pool_entry_t* entry = *link; entry != NULL; link = &entry->next, entry = entry->next)
+		{
+			if(entry->flags != flags)
+				continue;
+			cl_mem mem = entry->mem;
+			*link = entry->next;
+			free(entry);
+			runtime->pool_stats.hits++;
+			runtime->pool_stats.pooled_bytes -= class_bytes(c);
+			return mem;
+		}
+		size = class_bytes(c);
+	}
+	runtime->pool_stats.misses++;
+	cl_mem mem = clCreateBuffer(runtime->context, flags, size, NULL, &error);
+	CL_ASSERT(error);
+	stats_buffer(runtime, mem);
+	return mem;
+}
+
+// Hands a buffer back. Buffers that can be reused are kept, as long as the pool
+// stays under a quarter of the device memory, everything else is released. The
+// caller must be done with the buffer, including commands still in the queues.
+void pool_release(mr_runtime_t* runtime, cl_mem mem)
+{
+	cl_int error;
+	cl_mem_flags flags;
+	size_t size;
+	cl_mem parent;
+
+	error = clGetMemObjectInfo(mem, CL_MEM_FLAGS, sizeof(flags), &flags, NULL);
+	error |= clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size), &size, NULL);
+	error |= clGetMemObjectInfo(mem, CL_MEM_ASSOCIATED_MEMOBJECT, sizeof(parent), &parent, NULL);
+	CL_ASSERT(error);
+
+	size_t c = size_class(size);
+	bool reusable = parent == NULL && (flags & ~POOL_FLAGS) == 0 && c < MR_POOL_CLASSES &&
+		size == class_bytes(c);
+	if(!reusable || runtime->pool_stats.pooled_bytes + size > runtime->info.global_mem_size / 4)
+	{
+		error = clReleaseMemObject(mem);
+		CL_ASSERT(error);
+		return;
+	}
+	mr_pool_entry_t* entry = (mr_pool_entry_t*)malloc(sizeof(mr_pool_entry_t));
+	entry->mem = mem;
+	entry->flags = flags;
+	entry->next = runtime->pool[c];
+	runtime->pool[c] = entry;
+	runtime->pool_stats.pooled_bytes += size;
+}
+
+// Releases every pooled buffer
+void pool_clear(mr_runtime_t* runtime)
+{
+	cl_int error;
+
+	for(size_t c = 0; c < MR_POOL_CLASSES; c++)
+	{
+		mr_pool_entry_t* entry = runtime->pool[c];
+		while(entry != NULL)
+		{
+			mr_pool_entry_t* next = entry->next;
+			error = clReleaseMemObject(entry->mem);
+			CL_ASSERT(error);
+			free(entry);
+			entry = next;
+		}
+		runtime->pool[c] = NULL;
+	}
+	runtime->pool_stats.pooled_bytes = 0;
+}
@@ -0,0 +1,18 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_BUFFER_POOL_H_
+#define MAP_BUFFER_POOL_H_
+
+#include "map_reduce.h"
+
+// Most a pooled buffer is larger than the size asked for
+#define POOL_ROUNDING 1.25
+
+cl_mem pool_acquire(mr_runtime_t* runtime, cl_mem_flags flags, size_t size);
+void pool_release(mr_runtime_t* runtime, cl_mem mem);
+void pool_clear(mr_runtime_t* runtime);
+
+#endif
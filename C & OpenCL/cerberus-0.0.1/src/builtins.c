@@ -0,0 +1,315 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include "builtins.h"
+
+/* Kernels used by the runtime itself */
+
+/* Exclusive scan of the per-group keyval counts into byte offsets of the map
+ * output buffer. Groups are laid out in runs of span groups, each run is padded
+ * the way create_packed() pads a slice, so the host can turn runs into
+ * sub-buffers. With span 1 every group gets its own slice, larger spans put the
+ * groups of a reduce group back to back. offsets[num_groups] gets the total
+ * size. Runs as a single workgroup, each workitem scans a chunk of runs.
+ */
+const char* scan_counts_source =
+	"uint mr_run(__global const uint* counts, uint first, uint last, uint elem_size, uint align)\n"
+	"{\n"
+	"	uint bytes = 0;\n"
+	"	for(uint i = first; i < last; i++)\n"
+	"		bytes += counts[i] * elem_size;\n"
+	"	if(bytes == 0)\n"
+	"		bytes = elem_size;\n"
+	"	return (bytes + align - 1) / align * align;\n"
+	"}\n"
+	"\n"
+	"__kernel void mr_scan_counts(__global const uint* counts, __global uint* offsets, uint num_groups,\n"
+	"	uint elem_size, uint align, uint span, __local uint* partial)\n"
+	"{\n"
+	"	uint idx = get_local_id(0);\n"
+	"	uint items = get_local_size(0);\n"
+	"	uint num_runs = (num_groups + span - 1) / span;\n"
+	"	uint chunk = (num_runs + items - 1) / items;\n"
+	"	uint first = min(idx * chunk, num_runs);\n"
+	"	uint last = min(first + chunk, num_runs);\n"
+	"	uint sum = 0;\n"
+	"\n"
+	"	for(uint r = first; r < last; r++)\n"
+	"		sum += mr_run(counts, r * span, min(r * span + span, num_groups), elem_size, align);\n"
+	"	partial[idx] = sum;\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	// Inclusive scan of the chunk sums\n"
+	"	for(uint d = 1; d < items; d <<= 1)\n"
+	"	{\n"
+	"		uint add = (idx >= d) ? partial[idx - d] : 0;\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"		partial[idx] += add;\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	}\n"
+	"	uint offset = partial[idx] - sum;\n"
+	"	for(uint r = first; r < last; r++)\n"
+	"	{\n"
+	"		uint end = min(r * span + span, num_groups);\n"
+	"		uint group_offset = offset;\n"
+	"		for(uint i = r * span; i < end; i++)\n"
+	"		{\n"
+	"			offsets[i] = group_offset;\n"
+	"			group_offset += counts[i] * elem_size;\n"
+	"		}\n"
+	"		offset += mr_run(counts, r * span, end, elem_size, align);\n"
+	"	}\n"
+	"	if(idx == items - 1)\n"
+	"		offsets[num_groups] = partial[idx];\n"
+	"}\n";
+
+/* LSD radix sort of keyvals by key, one byte digit per pass. Built with
+ * MR_KEYVAL_SIZE, MR_KEY_SIZE, MR_SORT_ITEMS (workgroup size), MR_SORT_TILE
+ * (records per workgroup) and either MR_SORT_INT for a 32-bit signed key or
+ * nothing for a fixed-width byte key compared like strcmp(). The key is at the
+ * start of the keyval. Every pass runs mr_sort_histogram, mr_sort_scan and
+ * mr_sort_scatter. Histograms are stored digit-major, so the scan gives every
+ * tile the position of its first record of each digit.
+ */
+const char* sort_source =
+	"uint mr_digit(__global const uchar* rec, uint pass)\n"
+	"{\n"
+	"#ifdef MR_SORT_INT\n"
+	"	// Little endian, with the sign bit flipped so negative keys go first\n"
+	"	return (pass == 3) ? rec[3] ^ 0x80 : rec[pass];\n"
+	"#else\n"
+	"	// Most significant byte first, bytes after a NUL count as 0\n"
+	"	uint pos = MR_KEY_SIZE - 1 - pass;\n"
+	"	for(uint i = 0; i < pos; i++)\n"
+	"		if(rec[i] == 0)\n"
+	"			return 0;\n"
+	"	return rec[pos];\n"
+	"#endif\n"
+	"}\n"
+	"\n"
+	"__kernel void mr_sort_histogram(__global const uchar* keyvals, __global uint* hist, uint num,\n"
+	"	uint pass)\n"
+	"{\n"
+	"	__local uint bins[256];\n"
+	"	uint idx = get_local_id(0);\n"
+	"	uint tile = get_group_id(0);\n"
+	"	uint tiles = get_num_groups(0);\n"
+	"	uint first = tile * MR_SORT_TILE;\n"
+	"	uint last = min(first + MR_SORT_TILE, num);\n"
+	"\n"
+	"	for(uint b = idx; b < 256; b += MR_SORT_ITEMS)\n"
+	"		bins[b] = 0;\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	for(uint r = first + idx; r < last; r += MR_SORT_ITEMS)\n"
+	"		atomic_inc(&bins[mr_digit(keyvals + r * MR_KEYVAL_SIZE, pass)]);\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	for(uint b = idx; b < 256; b += MR_SORT_ITEMS)\n"
+	"		hist[b * tiles + tile] = bins[b];\n"
+	"}\n"
+	"\n"
+	"// In-place exclusive scan, single workgroup\n"
+	"__kernel void mr_sort_scan(__global uint* data, uint num)\n"
+	"{\n"
+	"	__local uint partial[MR_SORT_ITEMS];\n"
+	"	uint idx = get_local_id(0);\n"
+	"	uint chunk = (num + MR_SORT_ITEMS - 1) / MR_SORT_ITEMS;\n"
+	"	uint first = min(idx * chunk, num);\n"
+	"	uint last = min(first + chunk, num);\n"
+	"	uint sum = 0;\n"
+	"\n"
+	"	for(uint i = first; i < last; i++)\n"
+	"		sum += data[i];\n"
+	"	partial[idx] = sum;\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	for(uint d = 1; d < MR_SORT_ITEMS; d <<= 1)\n"
+	"	{\n"
+	"		uint add = (idx >= d) ? partial[idx - d] : 0;\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"		partial[idx] += add;\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	}\n"
+	"	uint offset = partial[idx] - sum;\n"
+	"	for(uint i = first; i < last; i++)\n"
+	"	{\n"
+	"		uint count = data[i];\n"
+	"		data[i] = offset;\n"
+	"		offset += count;\n"
+	"	}\n"
+	"}\n"
+	"\n"
+	"// Stable scatter. Records go through in batches of MR_SORT_ITEMS, each one is\n"
+	"// ranked against the records with the same digit earlier in its batch\n"
+	"__kernel void mr_sort_scatter(__global const uchar* src, __global uchar* dst,\n"
+	"	__global const uint* offsets, uint num, uint pass)\n"
+	"{\n"
+	"	__local uint base[256];\n"
+	"	__local uint digits[MR_SORT_ITEMS];\n"
+	"	uint idx = get_local_id(0);\n"
+	"	uint tile = get_group_id(0);\n"
+	"	uint tiles = get_num_groups(0);\n"
+	"	uint first = tile * MR_SORT_TILE;\n"
+	"	uint last = min(first + MR_SORT_TILE, num);\n"
+	"\n"
+	"	for(uint b = idx; b < 256; b += MR_SORT_ITEMS)\n"
+	"		base[b] = offsets[b * tiles + tile];\n"
+	"	for(uint start = first; start < last; start += MR_SORT_ITEMS)\n"
+	"	{\n"
+	"		uint r = start + idx;\n"
+	"		uint digit = (r < last) ? mr_digit(src + r * MR_KEYVAL_SIZE, pass) : 256;\n"
+	"		digits[idx] = digit;\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"		if(r < last)\n"
+	"		{\n"
+	"			uint pos = base[digit];\n"
+	"			for(uint j = 0; j < idx; j++)\n"
+	"				pos += (digits[j] == digit);\n"
+	"			for(uint k = 0; k < MR_KEYVAL_SIZE; k++)\n"
+	"				dst[pos * MR_KEYVAL_SIZE + k] = src[r * MR_KEYVAL_SIZE + k];\n"
+	"		}\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"		if(r < last)\n"
+	"			atomic_inc(&base[digit]);\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	}\n"
+	"}\n";
+
+/* Hash aggregation of keyvals whose value is the 32-bit uint right after the
+ * key. Built with MR_KEYVAL_SIZE, MR_KEY_SIZE, MR_LOCAL_SLOTS (power of two),
+ * MR_LOCAL_PROBES, MR_IDENTITY, one of MR_COMBINE_SUM/MIN/MAX/COUNT and
+ * MR_STRING_KEY for NUL-terminated keys. The global table is open addressed
+ * with linear probing, a slot holds the index + 1 of the first record seen with
+ * its key and keys are compared against that record. Each workgroup combines
+ * into a __local table first and only goes to global memory on a local miss
+ * and when flushing.
+ */
+const char* combine_source =
+	"#if defined(MR_COMBINE_MIN)\n"
+	"#define MR_COMBINE(p, v) atomic_min(p, v)\n"
+	"#elif defined(MR_COMBINE_MAX)\n"
+	"#define MR_COMBINE(p, v) atomic_max(p, v)\n"
+	"#else\n"
+	"#define MR_COMBINE(p, v) atomic_add(p, v)\n"
+	"#endif\n"
+	"\n"
+	"// FNV-1a over the key\n"
+	"uint mr_hash(__global const uchar* rec)\n"
+	"{\n"
+	"	uint h = 2166136261u;\n"
+	"	for(uint i = 0; i < MR_KEY_SIZE; i++)\n"
+	"	{\n"
+	"#ifdef MR_STRING_KEY\n"
+	"		if(rec[i] == 0)\n"
+	"			break;\n"
+	"#endif\n"
+	"		h = (h ^ rec[i]) * 16777619u;\n"
+	"	}\n"
+	"	return h;\n"
+	"}\n"
+	"\n"
+	"bool mr_same_key(__global const uchar* a, __global const uchar* b)\n"
+	"{\n"
+	"	for(uint i = 0; i < MR_KEY_SIZE; i++)\n"
+	"	{\n"
+	"		if(a[i] != b[i])\n"
+	"			return false;\n"
+	"#ifdef MR_STRING_KEY\n"
+	"		if(a[i] == 0)\n"
+	"			return true;\n"
+	"#endif\n"
+	"	}\n"
+	"	return true;\n"
+	"}\n"
+	"\n"
+	"uint mr_value(__global const uchar* rec)\n"
+	"{\n"
+	"#ifdef MR_COMBINE_COUNT\n"
+	"	return 1;\n"
+	"#else\n"
+	"	// Little endian, read bytewise as the value need not be aligned\n"
+	"	return rec[MR_KEY_SIZE] | (rec[MR_KEY_SIZE + 1] << 8) | (rec[MR_KEY_SIZE + 2] << 16) |\n"
+	"		((uint)rec[MR_KEY_SIZE + 3] << 24);\n"
+	"#endif\n"
+	"}\n"
+	"\n"
+	"// Combines value into the slot of record r's key, claiming a slot if the key is new\n"
+	"void mr_insert(__global uint* slots, __global uint* values, uint mask,\n"
+	"	__global const uchar* keyvals, uint r, uint value)\n"
+	"{\n"
+	"	__global const uchar* rec = keyvals + r * MR_KEYVAL_SIZE;\n"
+	"	uint h = mr_hash(rec) & mask;\n"
+	"\n"
+	"	// The table has more slots than records, so this ends\n"
+	"	while(true)\n"
+	"	{\n"
+	"		uint owner = slots[h];\n"
+	"		if(owner == 0)\n"
+	"			owner = atomic_cmpxchg(&slots[h], 0, r + 1);\n"
+	"		if(owner == 0 || mr_same_key(keyvals + (owner - 1) * MR_KEYVAL_SIZE, rec))\n"
+	"		{\n"
+	"			MR_COMBINE(&values[h], value);\n"
+	"			return;\n"
+	"		}\n"
+	"		h = (h + 1) & mask;\n"
+	"	}\n"
+	"}\n"
+	"\n"
+	"__kernel void mr_combine_insert(__global const uchar* keyvals, uint num, __global uint* slots,\n"
+	"	__global uint* values, uint mask)\n"
+	"{\n"
+	"	__local uint local_owner[MR_LOCAL_SLOTS];\n"
+	"	__local uint local_value[MR_LOCAL_SLOTS];\n"
+	"	uint idx = get_local_id(0);\n"
+	"	uint items = get_local_size(0);\n"
+	"\n"
+	"	for(uint j = idx; j < MR_LOCAL_SLOTS; j += items)\n"
+	"	{\n"
+	"		local_owner[j] = 0;\n"
+	"		local_value[j] = MR_IDENTITY;\n"
+	"	}\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	for(uint r = get_global_id(0); r < num; r += get_global_size(0))\n"
+	"	{\n"
+	"		__global const uchar* rec = keyvals + r * MR_KEYVAL_SIZE;\n"
+	"		uint value = mr_value(rec);\n"
+	"		uint h = mr_hash(rec);\n"
+	"		bool done = false;\n"
+	"\n"
+	"		for(uint probe = 0; probe < MR_LOCAL_PROBES && !done; probe++)\n"
+	"		{\n"
+	"			uint j = (h + probe) & (MR_LOCAL_SLOTS - 1);\n"
+	"			uint owner = atomic_cmpxchg(&local_owner[j], 0, r + 1);\n"
+	"			if(owner == 0 || mr_same_key(keyvals + (owner - 1) * MR_KEYVAL_SIZE, rec))\n"
+	"			{\n"
+	"				MR_COMBINE(&local_value[j], value);\n"
+	"				done = true;\n"
+	"			}\n"
+	"		}\n"
+	"		// The local table is too crowded around this key\n"
+	"		if(!done)\n"
+	"			mr_insert(slots, values, mask, keyvals, r, value);\n"
+	"	}\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	for(uint j = idx; j < MR_LOCAL_SLOTS; j += items)\n"
+	"		if(local_owner[j] != 0)\n"
+	"			mr_insert(slots, values, mask, keyvals, local_owner[j] - 1, local_value[j]);\n"
+	"}\n"
+	"\n"
+	"// Writes one keyval per used slot, in no particular order\n"
+	"__kernel void mr_combine_compact(__global const uchar* keyvals, __global const uint* slots,\n"
+	"	__global const uint* values, uint size, __global uchar* output, __global uint* count)\n"
+	"{\n"
+	"	for(uint h = get_global_id(0); h < size; h += get_global_size(0))\n"
+	"	{\n"
+	"		uint owner = slots[h];\n"
+	"		if(owner == 0)\n"
+	"			continue;\n"
+	"		__global const uchar* rec = keyvals + (owner - 1) * MR_KEYVAL_SIZE;\n"
+	"		__global uchar* out = output + atomic_inc(count) * MR_KEYVAL_SIZE;\n"
+	"		uint value = values[h];\n"
+	"		for(uint k = 0; k < MR_KEYVAL_SIZE; k++)\n"
+	"			out[k] = rec[k];\n"
+	"		for(uint k = 0; k < 4; k++)\n"
+	"			out[MR_KEY_SIZE + k] = (value >> (8 * k)) & 0xff;\n"
+	"	}\n"
+	"}\n";
@@ -0,0 +1,14 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_BUILTINS_H_
+#define MAP_BUILTINS_H_
+
+// Sources of the runtime's own kernels, built with create_kernel_from_source()
+extern const char* scan_counts_source;
+extern const char* sort_source;
+extern const char* combine_source;
+
+#endif
@@ -0,0 +1,134 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include "stddefines.h"
+#include "utils.h"
+#include "builtins.h"
+#include "shuffle.h"
+#include "combine.h"
+#include "profile.h"
+#include "buffer_pool.h"
+
+//==========================================//
+//											//
+// Device-side hash combiner				//
+//											//
+//==========================================//
+
+// Per-workgroup __local table and how far a key may land from its home slot in it
+#define LOCAL_SLOTS 1024
+#define LOCAL_PROBES 8
+
+// Key bytes of the combiner, the value is the uint right after the key
+size_t combine_key_size(map_reduce_args_t* args)
+{
+	return (args->key_size > 0) ? args->key_size : args->keyval_size - sizeof(cl_uint);
+}
+
+// Checks that the keyvals of a combining job have room for the value after the key
+bool combine_check(map_reduce_args_t* args)
+{
+	if(args->combine == MR_COMBINE_NONE && args->map_combine == MR_COMBINE_NONE)
+		return true;
+	if(args->keyval_size >= sizeof(cl_uint) && combine_key_size(args) + sizeof(cl_uint) <= args->keyval_size)
+		return true;
+	fprintf(stderr, "combiner: no room for the value after the key in a %zu byte keyval\n",
+			args->keyval_size);
+	return false;
+}
+
+// Build options describing the keyval layout and the operation, shared by the
+// combiner kernels and map kernels that combine locally
+void combine_flags(map_reduce_args_t* args, mr_combine_t op, char* flags, size_t len)
+{
+	const char* ops[] = { "", "MR_COMBINE_SUM", "MR_COMBINE_MIN", "MR_COMBINE_MAX", "MR_COMBINE_COUNT" };
+	cl_uint identity = (op == MR_COMBINE_MIN) ? 0xffffffff : 0;
+
+	snprintf(flags, len, "-D MR_KEYVAL_SIZE=%zu -D MR_KEY_SIZE=%zu -D MR_IDENTITY=%uu -D %s %s",
+			 args->keyval_size, combine_key_size(args), identity, ops[op],
+			 args->string_keys ? "-D MR_STRING_KEY" : "");
+}
+
+// Replaces the partitioner and the reduce kernels when args->combine is set.
+// Groups all map output by key in a hash table and leaves one keyval per key,
+// unsorted, in reduce_array[0].
+void combine_keyvals(mr_env_t* env)
+{
+	cl_int error;
+	char layout[192];
+	char flags[256];
+	cl_program program;
+	cl_kernel insert;
+	cl_kernel compact;
+	size_t keyval_size = env->args->keyval_size;
+	mr_combine_t op = env->args->combine;
+	cl_uint identity = (op == MR_COMBINE_MIN) ? 0xffffffff : 0;
+	size_t num;
+
+	combine_flags(env->args, op, layout, sizeof(layout));
+	cl_mem keyvals = gather_keyvals(env, &num);
+
+	// At least twice as many slots as records keeps probe sequences short
+	size_t size = 2;
+	while(size < 2 * num)
+		size <<= 1;
+	cl_uint zero = 0;
+	cl_mem values = pool_acquire(env->runtime, CL_MEM_READ_WRITE, sizeof(cl_uint) * size);
+	cl_mem slots = pool_acquire(env->runtime, CL_MEM_READ_WRITE, sizeof(cl_uint) * size);
+	cl_mem count = pool_acquire(env->runtime, CL_MEM_READ_WRITE, sizeof(cl_uint));
+	cl_mem output = pool_acquire(env->runtime, CL_MEM_READ_WRITE,
+								 (num > 0) ? num * keyval_size : keyval_size);
+	// Pooled buffers come back dirty
+	error = clEnqueueFillBuffer(env->device_queue, values, &identity, sizeof(identity), 0,
+								sizeof(cl_uint) * size, 0, NULL,
+								profile_event(env, env->device_queue, MR_CMD_WRITE, "combine_values", -1));
+	error |= clEnqueueFillBuffer(env->device_queue, slots, &zero, sizeof(zero), 0, sizeof(cl_uint) * size,
+								 0, NULL, profile_event(env, env->device_queue, MR_CMD_WRITE, "combine_slots", -1));
+	error |= clEnqueueFillBuffer(env->device_queue, count, &zero, sizeof(zero), 0, sizeof(cl_uint), 0,
+								 NULL, profile_event(env, env->device_queue, MR_CMD_WRITE, "combine_counter", -1));
+	CL_ASSERT(error);
+
+	snprintf(flags, sizeof(flags), "-D MR_LOCAL_SLOTS=%d -D MR_LOCAL_PROBES=%d %s", LOCAL_SLOTS,
+			 LOCAL_PROBES, layout);
+	create_kernel_from_source(env, "mr_combine_insert", combine_source, strlen(combine_source),
+							  &program, &insert, flags);
+	create_kernel_from_source(env, "mr_combine_compact", combine_source, strlen(combine_source),
+							  &program, &compact, flags);
+
+	cl_uint records = num;
+	cl_uint mask = size - 1;
+	cl_uint table_size = size;
+	size_t items = env->num_workitems;
+	size_t global = env->num_workgroups * items;
+	error = clSetKernelArg(insert, 0, sizeof(keyvals), (void*)&keyvals);
+	error |= clSetKernelArg(insert, 1, sizeof(records), (void*)&records);
+	error |= clSetKernelArg(insert, 2, sizeof(slots), (void*)&slots);
+	error |= clSetKernelArg(insert, 3, sizeof(values), (void*)&values);
+	error |= clSetKernelArg(insert, 4, sizeof(mask), (void*)&mask);
+	error |= clSetKernelArg(compact, 0, sizeof(keyvals), (void*)&keyvals);
+	error |= clSetKernelArg(compact, 1, sizeof(slots), (void*)&slots);
+	error |= clSetKernelArg(compact, 2, sizeof(values), (void*)&values);
+	error |= clSetKernelArg(compact, 3, sizeof(table_size), (void*)&table_size);
+	error |= clSetKernelArg(compact, 4, sizeof(output), (void*)&output);
+	error |= clSetKernelArg(compact, 5, sizeof(count), (void*)&count);
+	CL_ASSERT(error);
+	error = clEnqueueNDRangeKernel(env->device_queue, insert, 1, NULL, &global, &items, 0, NULL,
+		profile_event(env, env->device_queue, MR_CMD_KERNEL, "combine_insert", -1));
+	error |= clEnqueueNDRangeKernel(env->device_queue, compact, 1, NULL, &global, &items, 0, NULL,
+		profile_event(env, env->device_queue, MR_CMD_KERNEL, "combine_compact", -1));
+	CL_ASSERT(error);
+	error = clEnqueueReadBuffer(env->device_queue, count, CL_TRUE, 0, sizeof(cl_uint),
+								&env->reduce_array_size[0], 0, NULL,
+								profile_event(env, env->device_queue, MR_CMD_READ, "combine_count", -1));
+	CL_ASSERT(error);
+	env->stats.bytes_downloaded += sizeof(cl_uint);
+
+	pool_release(env->runtime, keyvals);
+	pool_release(env->runtime, slots);
+	pool_release(env->runtime, values);
+	pool_release(env->runtime, count);
+	env->num_reduce_workgroups = 1;
+	env->reduce_array[0] = output;
+}
@@ -0,0 +1,16 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_COMBINE_H_
+#define MAP_COMBINE_H_
+
+#include "map_reduce.h"
+
+size_t combine_key_size(map_reduce_args_t* args);
+bool combine_check(map_reduce_args_t* args);
+void combine_flags(map_reduce_args_t* args, mr_combine_t op, char* flags, size_t len);
+void combine_keyvals(mr_env_t* env);
+
+#endif
@@ -29,42 +29,125 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */ 
 
+#include <pthread.h>
 #include "map_reduce.h"
 #include "stddefines.h"
 #include "utils.h"
+#include "runtime.h"
+#include "builtins.h"
+#include "shuffle.h"
+#include "combine.h"
+#include "buffer_pool.h"
+#include "native.h"
+#include "profile.h"
+#include "trace.h"
+#include "stats.h"
+#include "tune.h"
 
 #if !defined(_LINUX_) && !defined(_SOLARIS_)
 #error OS not supported
 #endif
-#define TIMING
 #define VERBOSE 
 /* Debug printf */
 #ifdef dprintf
 #undef dprintf
 #define dprintf(...) //printf(__VA_ARGS__)
 #endif
+/* Size of the __local table of combining map kernels and how far from its home
+   slot a key may land in it */
+#define MAP_COMBINE_SLOTS 256
+#define MAP_COMBINE_PROBES 8
+/* Smallest share of a co-executed job a device gets, so its throughput keeps
+   being measured */
+#define CO_MIN_SHARE 0.02
 
-static mr_env_t* env_init(map_reduce_args_t *);
+static mr_env_t* env_init(map_reduce_args_t *, mr_runtime_t *);
 static void env_fini(mr_env_t *env);
+static cl_command_queue group_queue(mr_env_t *env, size_t group);
+static void finish_queues(mr_env_t *env);
 void map(mr_env_t *env);
+static void release_input(mr_env_t *env);
 void reduce(mr_env_t *env);
 
+/* OpenCL state shared by all jobs between map_reduce_init() and map_reduce_finalize() */
+static mr_runtime_t *default_runtime = NULL;
+/* Devices of co-executed jobs */
+static mr_device_set_t *co_devices = NULL;
+/* Context over all devices for sharded jobs */
+static mr_runtime_t *shard_runtime = NULL;
+
+/* A job of map_reduce_submit() */
+struct mr_job
+{
+    map_reduce_args_t *args;
+    void *keyvals;
+    size_t num_keyvals;
+    int ret;
+    bool done;              /* Merged, or failed */
+    struct mr_job *next;
+};
+
+/* Submitted jobs go through two workers. One runs everything up to the read back,
+   the other the mergers, so the host merges a job while the device runs the next. */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     /* Any job moved on */
+    mr_job_t *stage_head;       /* Jobs waiting for the stage worker */
+    mr_job_t *stage_tail;
+    mr_job_t *merge_head;       /* Jobs waiting for the merge worker */
+    mr_job_t *merge_tail;
+    pthread_t stage_thread;
+    pthread_t merge_thread;
+    bool running;
+    bool stopping;
+    bool stages_done;
+} mr_pipeline_t;
+
+static mr_pipeline_t pipeline = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+/* Held while a job runs its stages, the runtimes and their caches aren't thread safe */
+static pthread_mutex_t stage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Part of a co-executed job run by one device */
+typedef struct
+{
+    map_reduce_args_t args;
+    mr_runtime_t *runtime;
+    size_t bytes;           /* Input bytes, the splitter may consume args.data_size */
+    void *keyvals;
+    size_t num_keyvals;
+    long time;
+    int ret;
+} co_slice_t;
+
 int map_reduce_init()
 {
+    mr_device_policy_t policy;
+
+    if(default_runtime != NULL)
+        return 0;
+    /* Native jobs never touch OpenCL, there may be no driver at all */
+    if(native_backend(MR_BACKEND_OPENCL) == MR_BACKEND_NATIVE)
+        return 0;
+    memset(&policy, 0, sizeof(policy));
+    default_runtime = runtime_create(&policy);
+    if(default_runtime == NULL)
+        return -1;
     return 0;
 }
 
-int map_reduce(map_reduce_args_t * args)
+/* Runs map and reduce for one piece of input on the device and appends the
+   resulting keyvals to the host array. */
+static int run_job(map_reduce_args_t *args, mr_runtime_t *runtime, void **keyvals, size_t *num_keyvals)
 {
     struct timeval begin;
     struct timeval end;
     mr_env_t* env;
     cl_int error;
-    assert(args != NULL);
 
     get_time(&begin);
     /* Initialize environment. */
-    env = env_init(args);
+    env = env_init(args, runtime);
     if(env == NULL) 
     {
        return -1;
@@ -73,6 +156,7 @@ int map_reduce(map_reduce_args_t * args)
 #ifdef TIMING
     fprintf(stderr, "library init: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(args, MR_PHASE_INIT, &begin, &end);
 
     /* Run map tasks and get intermediate values. */
     get_time(&begin);
@@ -81,9 +165,21 @@ int map_reduce(map_reduce_args_t * args)
 #ifdef TIMING
     fprintf(stderr, "map phase: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(args, MR_PHASE_MAP_TOTAL, &begin, &end);
 
+    if(env->args->combine != MR_COMBINE_NONE)
+    {
+        /* The combiner groups the keys, no partitioner or reduce kernels */
+        get_time(&begin);
+        combine_keyvals(env);
+        get_time(&end);
+#ifdef TIMING
+        fprintf(stderr, "combine: %ld ms\n", time_diff(&end, &begin));
+#endif
+        stats_phase(args, MR_PHASE_COMBINE, &begin, &end);
+    }
     /* See if we have a valid reduce kernel */
-    if(env->args->reduce[0] != '\0')
+    else if(env->args->reduce[0] != '\0')
     {
         /* Run reduce tasks and get final values. */
         get_time(&begin);
@@ -92,6 +188,23 @@ int map_reduce(map_reduce_args_t * args)
 #ifdef TIMING
         fprintf(stderr, "reduce phase: %ld ms\n", time_diff(&end, &begin));
 #endif
+        stats_phase(args, MR_PHASE_REDUCE_TOTAL, &begin, &end);
+    }
+    else if(env->args->shuffle != MR_SHUFFLE_NONE)
+    {
+        /* No reduce phase, hand back the sorted slices */
+        get_time(&begin);
+        sort_partition(env);
+        get_time(&end);
+#ifdef TIMING
+        fprintf(stderr, "shuffle: %ld ms\n", time_diff(&end, &begin));
+#endif
+        stats_phase(args, MR_PHASE_SHUFFLE, &begin, &end);
+        for(int i = 0; i < env->num_reduce_workgroups; i++)
+        {
+            env->reduce_array[i] = env->merged_map_array[i];
+            env->reduce_array_size[i] = env->reduce_data_size[i] / env->args->keyval_size;
+        }
     }
     else
     {
@@ -104,243 +217,1202 @@ int map_reduce(map_reduce_args_t * args)
         }
     }
 
-    /* Allocate 1D array for all results combined */
+    /* Grow the 1D array holding all results combined */
     size_t keypair_num = 0;
     for(int i = 0; i < env->num_reduce_workgroups; i++)
     {
         keypair_num += env->reduce_array_size[i];
     }
-    void *keyval_array = malloc(env->args->keyval_size * keypair_num);
-    void *keyval_ptr = keyval_array;
+    *keyvals = realloc(*keyvals, env->args->keyval_size * (*num_keyvals + keypair_num));
+    void *keyval_ptr = *keyvals + env->args->keyval_size * *num_keyvals;
+    *num_keyvals += keypair_num;
 
     /* Read back */
     get_time(&begin);
     for(int i = 0; i < env->num_reduce_workgroups; i++)
     {
-        error = clEnqueueReadBuffer(env->device_queue, env->reduce_array[i], CL_FALSE, 0,
-            env->reduce_array_size[i] * env->args->keyval_size, keyval_ptr, 0, NULL, NULL);
-        keyval_ptr += env->reduce_array_size[i] * env->args->keyval_size;
+        size_t bytes = env->reduce_array_size[i] * env->args->keyval_size;
+        if(bytes == 0)
+            continue;
+        if(env->zero_copy)
+        {
+            /* The results already are in host memory, map them instead of a transfer */
+            void *mapped = clEnqueueMapBuffer(group_queue(env, i), env->reduce_array[i], CL_TRUE,
+                CL_MAP_READ, 0, bytes, 0, NULL,
+                profile_event(env, group_queue(env, i), MR_CMD_READ, "result", i), &error);
+            CL_ASSERT(error);
+            memcpy(keyval_ptr, mapped, bytes);
+            error = clEnqueueUnmapMemObject(group_queue(env, i), env->reduce_array[i], mapped, 0,
+                NULL, NULL);
+            CL_ASSERT(error);
+        }
+        else
+        {
+            error = clEnqueueReadBuffer(group_queue(env, i), env->reduce_array[i], CL_FALSE, 0,
+                bytes, keyval_ptr, 0, NULL,
+                profile_event(env, group_queue(env, i), MR_CMD_READ, "result", i));
+            CL_ASSERT(error);
+            env->stats.bytes_downloaded += bytes;
+        }
+        keyval_ptr += bytes;
     }
-    clFinish(env->device_queue);
+    finish_queues(env);
+    if(env->input_held)
+        release_input(env);
     get_time(&end);
 #ifdef TIMING
     fprintf(stderr, "fetching back from GPU memory: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(args, MR_PHASE_READ_BACK, &begin, &end);
 
-    /* Merge the data  */
-    merger_dat_t* merg_dat = malloc(sizeof(merger_dat_t));
-    merg_dat->keyvals = keyval_array;
-    merg_dat->size = keypair_num;
+    /* Cleanup. */
     get_time(&begin);
-    env->args->merger(merg_dat);
+    env_fini(env);
+#ifdef VERBOSE
+    fprintf(stderr, "buffer pool: %zu hits, %zu misses, %zu bytes idle\n", runtime->pool_stats.hits,
+        runtime->pool_stats.misses, runtime->pool_stats.pooled_bytes);
+#endif
     get_time(&end);
-    /* Get the length of resulting data */
-    *env->args->result_len = merg_dat->output_size;
-    env->args->result = merg_dat->output;
 #ifdef TIMING
-    fprintf(stderr, "merging in CPU: %ld ms\n", time_diff(&end, &begin));
+    fprintf(stderr, "library finalize: %ld ms\n", time_diff(&end, &begin));
+#endif
+    stats_phase(args, MR_PHASE_FINALIZE, &begin, &end);
+
+    return 0;
+}
+
+/* Runs the job on the native backend's threads and appends the resulting keyvals
+   to the host array. The whole input is processed at once, it already is in host memory. */
+static int run_native_job(map_reduce_args_t *args, void **keyvals, size_t *num_keyvals)
+{
+    struct timeval begin;
+    struct timeval end;
+    mr_env_t* env;
+
+    if(args->native_map == NULL)
+    {
+        fprintf(stderr, "Native backend needs a native_map function\n");
+        return -1;
+    }
+    env = native_env_init(args);
+    if(env == NULL)
+    {
+       return -1;
+    }
+#ifdef VERBOSE
+    fprintf(stderr, "Native backend: %zu threads, %zu workgroups\n", env->num_threads,
+        env->num_workgroups);
 #endif
 
-    /* Cleanup. */
     get_time(&begin);
-    env_fini(env);
+    native_map(env);
     get_time(&end);
 #ifdef TIMING
-    fprintf(stderr, "library finalize: %ld ms\n", time_diff(&end, &begin));
+    fprintf(stderr, "map phase: %ld ms\n", time_diff(&end, &begin));
+#endif
+    stats_phase(args, MR_PHASE_MAP_TOTAL, &begin, &end);
+
+    if(args->native_reduce != NULL)
+    {
+        get_time(&begin);
+        native_reduce(env);
+        get_time(&end);
+#ifdef TIMING
+        fprintf(stderr, "reduce phase: %ld ms\n", time_diff(&end, &begin));
 #endif
+        stats_phase(args, MR_PHASE_REDUCE_TOTAL, &begin, &end);
+    }
 
+    native_collect(env, keyvals, num_keyvals);
+    native_env_fini(env);
+    return 0;
+}
+
+/* Input bytes processed per round in out-of-core mode. Each round has to fit
+   its input, the map output and the partitioner's merged copy of it in global
+   memory, and every workgroup buffer has to fit in a single allocation. */
+static size_t round_bytes(map_reduce_args_t *args, mr_runtime_t *runtime)
+{
+    mr_device_info_t *info = &runtime->info;
+    size_t num_workgroups = (args->num_workgroups > 0) ? args->num_workgroups : info->num_compute_units;
+    /* Map output bytes per input byte. Count kernels give no static bound, 
+       assume the output is as large as the input. */
+    double expansion = 1.0;
+    if(args->num_output_per_map_task > 0)
+        expansion = (double)(args->num_output_per_map_task * args->keyval_size) / args->unit_size;
+
+    /* Leave a quarter of the device for the aux argument, reduce output and the driver,
+       and leave out what idle pooled buffers hold. Pooled buffers are also rounded up. */
+    double budget = (double)info->global_mem_size * 0.75 - (double)runtime->pool_stats.pooled_bytes;
+    if(budget < 0.0)
+        budget = 0.0;
+    size_t bytes = (size_t)(budget / (POOL_ROUNDING * (1.0 + 2.0 * expansion)));
+    size_t max_group = (size_t)((double)info->max_alloc_size / ((expansion > 1.0) ? expansion : 1.0));
+    /* A single launch puts all workgroups in one allocation */
+    if(args->single_launch)
+        num_workgroups = 1;
+    if(bytes / num_workgroups > max_group)
+        bytes = max_group * num_workgroups;
+
+    if(args->round_size > 0 && args->round_size < bytes)
+        bytes = args->round_size;
+    bytes -= bytes % args->unit_size;
+    if(bytes < args->unit_size)
+        bytes = args->unit_size;
+    return bytes;
+}
+
+/* Out-of-core mode. Runs the job over consecutive slices of the input and 
+   spills each round's keyvals to host memory, the merger then combines them. */
+static int run_rounds(map_reduce_args_t *args, mr_runtime_t *runtime, void **keyvals, size_t *num_keyvals)
+{
+    size_t max_round = round_bytes(args, runtime);
+    size_t offset = 0;
+    int round = 0;
+
+#ifdef VERBOSE
+    fprintf(stderr, "Out-of-core round size: %zu bytes\n", max_round);
+#endif
+    while(offset < args->data_size)
+    {
+        map_reduce_args_t round_args = *args;
+        size_t len = args->data_size - offset;
+        if(len > max_round)
+        {
+            len = max_round;
+            /* Let the application move the cut to a record boundary */
+            if(args->round_boundary != NULL)
+            {
+                size_t trimmed = args->round_boundary(args->task_data + offset, len);
+                if(trimmed > 0)
+                    len = trimmed;
+            }
+        }
+        round_args.task_data = args->task_data + offset;
+        round_args.data_size = len;
+#ifdef VERBOSE
+        fprintf(stderr, "Round %d: %zu bytes at offset %zu\n", round, len, offset);
+#endif
+        int ret = run_job(&round_args, runtime, keyvals, num_keyvals);
+        /* The round may have grown the profile */
+        args->profile = round_args.profile;
+        if(ret < 0)
+            return -1;
+        offset += len;
+        round++;
+    }
+    return 0;
+}
+
+/* Runs the job on one runtime, in rounds when it is out of core */
+static int run_device(map_reduce_args_t *args, mr_runtime_t *runtime, void **keyvals, size_t *num_keyvals)
+{
+    if(args->out_of_core)
+        return run_rounds(args, runtime, keyvals, num_keyvals);
+    return run_job(args, runtime, keyvals, num_keyvals);
+}
+
+/* args->co_execute, or CERBERUS_CO_EXECUTE set to anything but 0 */
+static bool co_execute(map_reduce_args_t *args)
+{
+    const char *env = getenv("CERBERUS_CO_EXECUTE");
+
+    if(env != NULL && env[0] != '\0')
+        return strcmp(env, "0") != 0;
+    return args->co_execute;
+}
+
+/* args->shard, or CERBERUS_SHARD set to anything but 0 */
+static bool shard(map_reduce_args_t *args)
+{
+    const char *env = getenv("CERBERUS_SHARD");
+
+    if(env != NULL && env[0] != '\0')
+        return strcmp(env, "0") != 0;
+    return args->shard;
+}
+
+/* Sub-devices per CPU device, args->sub_devices unless CERBERUS_SUB_DEVICES is set */
+static cl_uint sub_devices(map_reduce_args_t *args)
+{
+    const char *env = getenv("CERBERUS_SUB_DEVICES");
+
+    if(env != NULL && env[0] != '\0')
+        return atoi(env);
+    return args->sub_devices;
+}
+
+/* Opens every device for co-execution. The first job measures them all on equal shares. */
+static mr_device_set_t *device_set_create(map_reduce_args_t *args)
+{
+    mr_device_set_t *set;
+
+    set = calloc(1, sizeof(mr_device_set_t));
+    set->num_devices = runtime_create_all(&args->device_policy, sub_devices(args), set->runtimes,
+        MR_MAX_DEVICES);
+    if(set->num_devices == 0)
+    {
+        fprintf(stderr, "No OpenCL device for co-execution\n");
+        free(set);
+        return NULL;
+    }
+    for(cl_uint i = 0; i < set->num_devices; i++)
+    {
+        set->share[i] = 1.0 / set->num_devices;
+    }
+    return set;
+}
+
+static void device_set_release(mr_device_set_t *set)
+{
+    if(set == NULL)
+        return;
+    for(cl_uint i = 0; i < set->num_devices; i++)
+    {
+        runtime_release(set->runtimes[i]);
+    }
+    free(set);
+}
+
+static void *run_slice(void *arg)
+{
+    co_slice_t *slice = (co_slice_t*)arg;
+    struct timeval begin;
+    struct timeval end;
+
+    get_time(&begin);
+    if(slice->bytes == 0)
+        slice->ret = 0;
+    else if(slice->args.out_of_core)
+        slice->ret = run_rounds(&slice->args, slice->runtime, &slice->keyvals, &slice->num_keyvals);
+    else
+        slice->ret = run_job(&slice->args, slice->runtime, &slice->keyvals, &slice->num_keyvals);
+    get_time(&end);
+    slice->time = time_diff(&end, &begin);
+    return NULL;
+}
+
+/* Moves the shares towards the throughput each device had in this job. Averaging
+   with the old shares keeps one noisy job from swinging the split. */
+static void update_shares(mr_device_set_t *set, const co_slice_t *slices)
+{
+    double rate[MR_MAX_DEVICES];
+    double total = 0.0;
+
+    for(cl_uint i = 0; i < set->num_devices; i++)
+    {
+        /* Can't measure a device that had nothing to do */
+        if(slices[i].bytes == 0)
+            return;
+        rate[i] = (double)slices[i].bytes / ((slices[i].time > 0) ? slices[i].time : 1);
+        total += rate[i];
+    }
+    double sum = 0.0;
+    for(cl_uint i = 0; i < set->num_devices; i++)
+    {
+        set->share[i] = 0.5 * set->share[i] + 0.5 * rate[i] / total;
+        if(set->share[i] < CO_MIN_SHARE)
+            set->share[i] = CO_MIN_SHARE;
+        sum += set->share[i];
+    }
+    for(cl_uint i = 0; i < set->num_devices; i++)
+    {
+        set->share[i] /= sum;
+    }
+}
+
+/* Co-execution. Cuts the input into one slice per device according to the shares,
+   runs the slices concurrently and hands all keyvals to the merger. */
+static int run_co_execution(map_reduce_args_t *args, void **keyvals, size_t *num_keyvals)
+{
+    if(co_devices == NULL && (co_devices = device_set_create(args)) == NULL)
+        return -1;
+    cl_uint num = co_devices->num_devices;
+    co_slice_t *slices = calloc(num, sizeof(co_slice_t));
+    pthread_t *threads = malloc(sizeof(pthread_t) * num);
+    size_t offset = 0;
+    int ret = 0;
+
+    for(cl_uint i = 0; i < num; i++)
+    {
+        size_t len = args->data_size - offset;
+        if(i + 1 < num)
+        {
+            size_t want = (size_t)(args->data_size * co_devices->share[i]);
+            want -= want % args->unit_size;
+            if(want < len)
+            {
+                len = want;
+                /* Let the application move the cut to a record boundary */
+                if(len > 0 && args->round_boundary != NULL)
+                {
+                    size_t trimmed = args->round_boundary(args->task_data + offset, len);
+                    if(trimmed > 0)
+                        len = trimmed;
+                }
+            }
+        }
+        slices[i].args = *args;
+        memset(&slices[i].args.profile, 0, sizeof(mr_profile_t));
+        slices[i].args.task_data = args->task_data + offset;
+        slices[i].args.data_size = len;
+        slices[i].bytes = len;
+        slices[i].runtime = co_devices->runtimes[i];
+#ifdef VERBOSE
+        fprintf(stderr, "Device %u (%s): %zu bytes, share %.3f\n", i, slices[i].runtime->info.name, len,
+            co_devices->share[i]);
+#endif
+        offset += len;
+    }
+    for(cl_uint i = 0; i < num; i++)
+    {
+        CHECK_ERROR(pthread_create(&threads[i], NULL, run_slice, &slices[i]) != 0);
+    }
+    for(cl_uint i = 0; i < num; i++)
+    {
+        pthread_join(threads[i], NULL);
+#ifdef TIMING
+        fprintf(stderr, "device %u: %ld ms\n", i, slices[i].time);
+#endif
+        if(slices[i].ret < 0)
+            ret = -1;
+    }
+    update_shares(co_devices, slices);
+
+    /* Keyvals go to the merger in device order */
+    for(cl_uint i = 0; i < num; i++)
+    {
+        size_t bytes = slices[i].num_keyvals * args->keyval_size;
+        *keyvals = realloc(*keyvals, *num_keyvals * args->keyval_size + bytes);
+        memcpy(*keyvals + *num_keyvals * args->keyval_size, slices[i].keyvals, bytes);
+        *num_keyvals += slices[i].num_keyvals;
+        free(slices[i].keyvals);
+        profile_append(&args->profile, &slices[i].args.profile);
+        free(slices[i].args.profile.events);
+    }
+    free(slices);
+    free(threads);
+    return ret;
+}
+
+/* Everything up to the merger: splitter, map, partition, reduce and read back.
+   Appends the resulting keyvals to the host array. */
+static int run_stages(map_reduce_args_t *args, void **keyvals, size_t *num_keyvals)
+{
+    mr_runtime_t *runtime;
+    int ret;
+
+    stats_begin(args);
+    if(native_backend(args->backend) == MR_BACKEND_NATIVE)
+        return run_native_job(args, keyvals, num_keyvals);
+    if(co_execute(args))
+        return run_co_execution(args, keyvals, num_keyvals);
+
+    /* Sharded jobs share one context over all devices, created by the first one */
+    if(shard(args))
+    {
+        if(shard_runtime == NULL)
+            shard_runtime = runtime_create_sharded(&args->device_policy, sub_devices(args));
+        if(shard_runtime == NULL)
+            return -1;
+        runtime = shard_runtime;
+    }
+    /* Reuse the process-wide context if it runs on the requested device */
+    else if(default_runtime != NULL && runtime_matches(default_runtime, &args->device_policy))
+    {
+        runtime = default_runtime;
+    }
+    else
+    {
+        runtime = runtime_create(&args->device_policy);
+        if(runtime == NULL)
+            return -1;
+    }
+
+    /* Stored or autotuned workgroup parameters, see src/tune.c */
+    if(tune_enabled(args))
+        ret = tune_run(args, runtime, run_device, keyvals, num_keyvals);
+    else
+        ret = run_device(args, runtime, keyvals, num_keyvals);
+
+    if(runtime != default_runtime && runtime != shard_runtime)
+        runtime_release(runtime);
+    return ret;
+}
+
+/* Hands the keyvals to the application's merger and stores its result in args */
+static void run_merger(map_reduce_args_t *args, void *keyvals, size_t num_keyvals)
+{
+    struct timeval begin;
+    struct timeval end;
+
+    /* Merge the data  */
+    merger_dat_t* merg_dat = malloc(sizeof(merger_dat_t));
+    merg_dat->keyvals = keyvals;
+    merg_dat->size = num_keyvals;
+    get_time(&begin);
+    args->merger(merg_dat);
+    get_time(&end);
+    /* Get the length of resulting data */
+    *args->result_len = merg_dat->output_size;
+    args->result = merg_dat->output;
+#ifdef TIMING
+    fprintf(stderr, "merging in CPU: %ld ms\n", time_diff(&end, &begin));
+#endif
+    stats_phase(args, MR_PHASE_MERGER, &begin, &end);
+}
+
+int map_reduce(map_reduce_args_t * args)
+{
+    void *keyval_array = NULL;
+    size_t keypair_num = 0;
+    int ret;
+    assert(args != NULL);
+
+    /* Submitted jobs may be using the runtime at the same time */
+    pthread_mutex_lock(&stage_lock);
+    ret = run_stages(args, &keyval_array, &keypair_num);
+    pthread_mutex_unlock(&stage_lock);
+    if(ret < 0)
+    {
+        free(keyval_array);
+        return ret;
+    }
+    run_merger(args, keyval_array, keypair_num);
+
+    return 0;
+}
+
+/* Runs the stages of submitted jobs one at a time, in submission order */
+static void *stage_worker(void *arg)
+{
+    pthread_mutex_lock(&pipeline.lock);
+    for(;;)
+    {
+        while(pipeline.stage_head == NULL && !pipeline.stopping)
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        mr_job_t *job = pipeline.stage_head;
+        if(job == NULL)
+            break;
+        pipeline.stage_head = job->next;
+        pthread_mutex_unlock(&pipeline.lock);
+
+        pthread_mutex_lock(&stage_lock);
+        job->ret = run_stages(job->args, &job->keyvals, &job->num_keyvals);
+        pthread_mutex_unlock(&stage_lock);
+
+        /* On to the merger, the next job's stages can start */
+        pthread_mutex_lock(&pipeline.lock);
+        job->next = NULL;
+        if(pipeline.merge_head == NULL)
+            pipeline.merge_head = job;
+        else
+            pipeline.merge_tail->next = job;
+        pipeline.merge_tail = job;
+        pthread_cond_broadcast(&pipeline.changed);
+    }
+    pipeline.stages_done = true;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+    return NULL;
+}
+
+/* Runs the mergers of submitted jobs while the stage worker moves on */
+static void *merge_worker(void *arg)
+{
+    pthread_mutex_lock(&pipeline.lock);
+    for(;;)
+    {
+        while(pipeline.merge_head == NULL && !pipeline.stages_done)
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        mr_job_t *job = pipeline.merge_head;
+        if(job == NULL)
+            break;
+        pipeline.merge_head = job->next;
+        pthread_mutex_unlock(&pipeline.lock);
+
+        if(job->ret < 0)
+            free(job->keyvals);
+        else
+            run_merger(job->args, job->keyvals, job->num_keyvals);
+
+        pthread_mutex_lock(&pipeline.lock);
+        job->done = true;
+        pthread_cond_broadcast(&pipeline.changed);
+    }
+    pthread_mutex_unlock(&pipeline.lock);
+    return NULL;
+}
+
+mr_job_t *map_reduce_submit(map_reduce_args_t *args)
+{
+    mr_job_t *job;
+    assert(args != NULL);
+
+    job = calloc(1, sizeof(mr_job_t));
+    if(job == NULL)
+        return NULL;
+    job->args = args;
+
+    pthread_mutex_lock(&pipeline.lock);
+    if(!pipeline.running)
+    {
+        pipeline.stopping = false;
+        pipeline.stages_done = false;
+        CHECK_ERROR(pthread_create(&pipeline.stage_thread, NULL, stage_worker, NULL) != 0);
+        CHECK_ERROR(pthread_create(&pipeline.merge_thread, NULL, merge_worker, NULL) != 0);
+        pipeline.running = true;
+    }
+    if(pipeline.stage_head == NULL)
+        pipeline.stage_head = job;
+    else
+        pipeline.stage_tail->next = job;
+    pipeline.stage_tail = job;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+    return job;
+}
+
+int map_reduce_poll(mr_job_t *job)
+{
+    bool done;
+
+    pthread_mutex_lock(&pipeline.lock);
+    done = job->done;
+    pthread_mutex_unlock(&pipeline.lock);
+    return done ? 1 : 0;
+}
+
+int map_reduce_wait(mr_job_t *job)
+{
+    int ret;
+
+    pthread_mutex_lock(&pipeline.lock);
+    while(!job->done)
+        pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+    pthread_mutex_unlock(&pipeline.lock);
+    ret = job->ret;
+    free(job);
+    return (ret < 0) ? ret : 0;
+}
+
+/* Lets the workers finish the submitted jobs and stops them */
+static void pipeline_stop()
+{
+    pthread_mutex_lock(&pipeline.lock);
+    if(!pipeline.running)
+    {
+        pthread_mutex_unlock(&pipeline.lock);
+        return;
+    }
+    pipeline.stopping = true;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+    pthread_join(pipeline.stage_thread, NULL);
+    pthread_join(pipeline.merge_thread, NULL);
+    pipeline.running = false;
+}
+
+int map_reduce_pool_stats(mr_pool_stats_t *stats)
+{
+    if(default_runtime == NULL)
+        return -1;
+    *stats = default_runtime->pool_stats;
     return 0;
 }
 
 int map_reduce_finalize()
 {
+    pipeline_stop();
+    runtime_release(default_runtime);
+    default_runtime = NULL;
+    device_set_release(co_devices);
+    co_devices = NULL;
+    runtime_release(shard_runtime);
+    shard_runtime = NULL;
+    trace_close();
     return 0;
 }
 
-/* Setup global state. */
-static mr_env_t* env_init(map_reduce_args_t *args) 
+/* Setup global state. */
+static mr_env_t* env_init(map_reduce_args_t *args, mr_runtime_t *runtime) 
+{
+    mr_env_t    *env;
+    if(!combine_check(args))
+        return NULL;
+    env = malloc(sizeof(mr_env_t));
+    if(env == NULL) 
+    {
+       return NULL;
+    }
+    memset(env, 0, sizeof(mr_env_t));
+    env->args = args;
+    env->buildLogging = false;
+
+    ////////////////////////////////
+    /* 1. Init OpenCL enviroment. */
+    ////////////////////////////////
+
+    env->runtime = runtime;
+    env->device = env->runtime->device;
+    env->device_context = env->runtime->context;
+    /* Streaming mode spreads the workgroups over several in-order queues, a sharded
+       runtime needs at least one per device */
+    env->num_queues = (args->num_streams > 1) ? args->num_streams : 1;
+    env->num_queues = div_round_up(env->num_queues, runtime->num_devices) * runtime->num_devices;
+    /* Profiled and traced jobs have their own queues, the first one stands in for the
+       main queue */
+    env->profiling = profile_enabled(args);
+    env->tracing = trace_enabled(args);
+    if(env->profiling || env->tracing)
+        env->queues = runtime_profiling_queues(env->runtime, env->num_queues);
+    else
+        env->queues = runtime_queues(env->runtime, env->num_queues);
+    env->device_queue = env->queues[0];
+    stats_start(env);
+    env->num_compute_units = env->runtime->info.num_compute_units;
+    env->max_workitems = env->runtime->info.max_workitems;
+    /* Only worth it when the device works on host memory anyway */
+    env->zero_copy = args->zero_copy && env->runtime->info.host_unified_memory;
+
+    /////////////////////////////////////
+    /* 2. Determine system parameters. */
+    /////////////////////////////////////
+
+    if(env->args->num_workgroups > 0)
+        env->num_workgroups = env->args->num_workgroups;
+    else
+        env->num_workgroups = env->num_compute_units;
+    if(env->args->num_workitems > 0)
+        env->num_workitems = env->args->num_workitems;
+    else
+        env->num_workitems = env->max_workitems;
+    if(env->args->tasks_per_reduce < 1)
+        env->args->tasks_per_reduce = 2;
+    env->num_reduce_workgroups = env->num_workgroups;
+    env->num_reduce_workitems = env->num_workitems / env->args->tasks_per_reduce;
+
+    /* No reduce phase, set single task in reduce phase */
+    if(env->args->reduce[0] == '\0')
+    {
+        env->args->tasks_per_reduce = 1;
+    }
+
+#ifdef VERBOSE
+    fprintf(stderr, "Number of map workitems: %zu\n", env->num_workitems);
+    fprintf(stderr, "Number of map workgroups: %zu\n", env->num_workgroups);
+    fprintf(stderr, "Number of reduce workitems: %zu\n", env->num_reduce_workitems);
+    fprintf(stderr, "Number of reduce  workgroups: %zu\n", env->num_reduce_workgroups);
+#endif 
+
+    ////////////////////////////////////
+    /* 3. Initialize data structures. */
+    ////////////////////////////////////
+
+    env->input_array = (cl_mem*)malloc(sizeof(cl_mem) * env->num_workgroups);
+    env->map_array = (cl_mem*)malloc(sizeof(cl_mem) * env->num_workgroups);
+    env->map_array_size = (cl_uint*)malloc(sizeof(cl_uint) * env->num_workgroups);
+    env->map_aux_arg = (cl_mem*)malloc(sizeof(cl_mem));
+    env->merged_map_array = (cl_mem*)malloc(sizeof(cl_mem) * env->num_reduce_workgroups);
+    env->reduce_array = (cl_mem*)malloc(sizeof(cl_mem) * env->num_reduce_workgroups);
+    env->reduce_array_size = (cl_uint*)malloc(sizeof(cl_uint) * env->num_reduce_workgroups);
+    env->map_data_size = (cl_uint*)malloc(sizeof(cl_uint) * env->num_workgroups);
+    env->reduce_data_size = (cl_uint*)malloc(sizeof(cl_uint) * env->num_reduce_workgroups);
+    if(env->args->splitter == NULL)
+        env->args->splitter = default_splitter;
+    if(env->args->partition == NULL)
+        env->args->partition = default_partition;
+
+    return env;
+}
+
+
+
+/**
+ * Frees memory used by map reduce environment once map reduce has completed.
+ * Frees environment pointer.
+ */
+static void env_fini(mr_env_t* env)
+{
+    /* Every command has finished by now */
+    profile_collect(env);
+    stats_collect(env);
+    free(env->profile_events);
+    free(env->profile_pending);
+    free(env->profile_host);
+    /* Kernel and program objects stay in the runtime's program cache */
+    /* Hand back memory objects (note map and merged_map arrays are already gone) */
+    for(int i = 0; i < env->num_reduce_workgroups; i++)
+    {    
+        pool_release(env->runtime, env->reduce_array[i]);
+    }
+    for(size_t i = 0; i < env->num_retired; i++)
+    {
+        pool_release(env->runtime, env->retired[i]);
+    }
+    /* Only after the slices, the pool must not hand it out while they live */
+    if(env->sorted != NULL)
+        pool_release(env->runtime, env->sorted);
+    /* Command queues and context belong to the runtime */
+
+    /* Get rid of all dynamic stuff */
+    free(env->input_array);
+    free(env->map_array);
+    free(env->merged_map_array);
+    free(env->reduce_array);
+    free(env->map_array_size);
+    free(env->reduce_array_size);
+    free(env->map_data_size);
+    free(env->reduce_data_size);
+    free(env->retired);
+    free(env);
+}
+
+/* Queue serving a given workgroup */
+static cl_command_queue group_queue(mr_env_t *env, size_t group)
+{
+    return env->queues[group % env->num_queues];
+}
+
+/* Wait for every queue used by the job */
+static void finish_queues(mr_env_t *env)
+{
+    for(cl_uint i = 0; i < env->num_queues; i++)
+    {
+        clFinish(env->queues[i]);
+    }
+    /* Nothing uses the retired buffers any more */
+    for(size_t i = 0; i < env->num_retired; i++)
+    {
+        pool_release(env->runtime, env->retired[i]);
+    }
+    env->num_retired = 0;
+}
+
+/* Hands a pooled buffer back once the queued commands using it are done */
+static void retire_buffer(mr_env_t *env, cl_mem mem)
+{
+    if(env->num_retired == env->retired_capacity)
+    {
+        env->retired_capacity = (env->retired_capacity > 0) ? env->retired_capacity * 2 : 16;
+        env->retired = realloc(env->retired, sizeof(cl_mem) * env->retired_capacity);
+    }
+    env->retired[env->num_retired++] = mem;
+}
+
+/* Extra flags for buffers the host fills or reads back. In zero copy mode they
+   are allocated in host visible memory, so mapping them needs no transfer */
+static cl_mem_flags host_flags(mr_env_t *env)
+{
+    return env->zero_copy ? CL_MEM_ALLOC_HOST_PTR : 0;
+}
+
+/* Streaming mode upload of a single workgroup's input */
+static void upload_input(mr_env_t *env, size_t group)
+{
+    cl_int error;
+
+    /* Zero copy buffers already wrap the input */
+    if(env->zero_copy)
+        return;
+
+    error = clEnqueueWriteBuffer(group_queue(env, group), env->input_array[group], CL_FALSE, 0,
+        env->splitter_data[group].length, env->splitter_data[group].pointer, 0, NULL,
+        profile_event(env, group_queue(env, group), MR_CMD_WRITE, "input", group));
+    CL_ASSERT(error);
+    env->stats.bytes_uploaded += env->splitter_data[group].length;
+}
+
+/* Build options for a phase kernel. The task count is either baked into the
+   program or, in runtime_tasks mode, left to a kernel argument so the same
+   binary serves every input size. MR_PACKED selects the single launch
+   parameters of the preamble. */
+static void build_flags(mr_env_t *env, char *flags, size_t len, const char *name, cl_uint tasks,
+    const char *user_args)
+{
+    const char *packed = env->args->single_launch ? "-D MR_PACKED " : "";
+
+    if(env->args->runtime_tasks)
+        snprintf(flags, len, "%s-D MR_RUNTIME_TASKS %s", packed, user_args);
+    else
+        snprintf(flags, len, "%s-D %s=%u %s", packed, name, tasks, user_args);
+}
+
+/* Splits an allocation into per-group sub-buffers and drops the reference to the
+   allocation itself, the sub-buffers keep it alive */
+static void split_packed(cl_mem parent, const cl_buffer_region *regions, size_t count, cl_mem *buffers)
+{
+    cl_int error;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        buffers[i] = clCreateSubBuffer(parent, 0, CL_BUFFER_CREATE_TYPE_REGION, &regions[i], &error);
+        CL_ASSERT(error);
+    }
+    clReleaseMemObject(parent);
+}
+
+/* Single launch mode. Lays the workgroup buffers out back to back in one
+   allocation and hands them out as sub-buffers, so splitters, partitioners and
+   the read back keep working on per-group handles. Offsets are aligned for
+   sub-buffer origins and to the element size the kernels index with. */
+static void create_packed(mr_env_t *env, const size_t *sizes, size_t count, size_t elem_size,
+    cl_mem_flags flags, cl_mem *buffers)
+{
+    cl_int error;
+    size_t align = lcm(env->runtime->info.mem_base_align, elem_size);
+    cl_buffer_region *regions = malloc(sizeof(cl_buffer_region) * count);
+    size_t total = 0;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        /* Sub-buffers can't be empty */
+        regions[i].origin = total;
+        regions[i].size = (sizes[i] > 0) ? sizes[i] : elem_size;
+        total += (regions[i].size + align - 1) / align * align;
+    }
+    cl_mem parent = clCreateBuffer(env->device_context, flags, total, NULL, &error);
+    CL_ASSERT(error);
+    stats_buffer(env->runtime, parent);
+    split_packed(parent, regions, count, buffers);
+    free(regions);
+}
+
+/* Returns the allocation shared by all the buffers and their byte offsets in it,
+   or NULL if they don't come from a single create_packed() call */
+static cl_mem packed_parent(const cl_mem *buffers, size_t count, cl_uint *offsets)
 {
-    mr_env_t    *env;
-    cl_int error = 0;
-    cl_platform_id platform;
-    env = malloc(sizeof(mr_env_t));
-    if(env == NULL) 
+    cl_mem parent = NULL;
+
+    for(size_t i = 0; i < count; i++)
     {
-       return NULL;
+        cl_mem owner = NULL;
+        size_t offset = 0;
+        cl_int error = clGetMemObjectInfo(buffers[i], CL_MEM_ASSOCIATED_MEMOBJECT, sizeof(owner),
+            &owner, NULL);
+        error |= clGetMemObjectInfo(buffers[i], CL_MEM_OFFSET, sizeof(offset), &offset, NULL);
+        CL_ASSERT(error);
+        if(owner == NULL || (parent != NULL && owner != parent))
+            return NULL;
+        parent = owner;
+        offsets[i] = (cl_uint)offset;
     }
-    memset(env, 0, sizeof(mr_env_t));
-    env->args = args;
-    env->buildLogging = false;
+    return parent;
+}
 
-    ////////////////////////////////
-    /* 1. Init OpenCL enviroment. */
-    ////////////////////////////////
+/* Profile name of one of the job's kernels */
+static const char *kernel_phase(mr_env_t *env, cl_kernel kernel)
+{
+    if(kernel == env->map)
+        return "map";
+    if(kernel == env->map_count)
+        return "map_count";
+    if(kernel == env->reduce_count)
+        return "reduce_count";
+    return "reduce";
+}
+
+/* Sets the input, output and group table arguments and enqueues a single NDRange
+   of num_groups workgroups. out_table, if not NULL, is a device buffer used in place
+   of the output offsets in tables. */
+static void enqueue_tables(mr_env_t *env, cl_kernel kernel, cl_uint table_arg, cl_mem input,
+    cl_mem output, cl_uint *tables, cl_mem out_table, size_t num_groups, size_t num_workitems)
+{
+    cl_int error;
+    cl_uint data_size = 0;
+    cl_mem table_buf[3];
+    size_t global = num_groups * num_workitems;
 
-    /* Platform */
-    error = oclGetPlatformID(&platform);
-    if(error) 
+    error = clSetKernelArg(kernel, 0, sizeof(input), (void*)&input);
+    error |= clSetKernelArg(kernel, 1, sizeof(output), (void*)&output);
+    /* Overwritten by MR_GROUP_PROLOGUE */
+    error |= clSetKernelArg(kernel, 2, sizeof(data_size), (void*)&data_size);
+    for(int t = 0; t < 3; t++)
     {
-        printf("Error getting platform id");
-        exit(error);
+        if(t == 2 && out_table != NULL)
+        {
+            table_buf[t] = out_table;
+        }
+        else
+        {
+            /* Blocking, the callers free the tables right away */
+            table_buf[t] = pool_acquire(env->runtime, CL_MEM_READ_ONLY, sizeof(cl_uint) * num_groups);
+            error = clEnqueueWriteBuffer(env->device_queue, table_buf[t], CL_TRUE, 0,
+                sizeof(cl_uint) * num_groups, tables + t * num_groups, 0, NULL,
+                profile_event(env, env->device_queue, MR_CMD_WRITE, "tables", -1));
+            CL_ASSERT(error);
+            env->stats.bytes_uploaded += sizeof(cl_uint) * num_groups;
+        }
+        error = clSetKernelArg(kernel, table_arg + t, sizeof(table_buf[t]), (void*)&table_buf[t]);
+        CL_ASSERT(error);
     }
-    /* Device */
-    error = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &env->device, NULL);
-    if(error) 
+    error = clEnqueueNDRangeKernel(env->device_queue, kernel, 1, NULL, &global, &num_workitems,
+        0, NULL, profile_event(env, env->device_queue, MR_CMD_KERNEL, kernel_phase(env, kernel), -1));
+    CL_ASSERT(error);
+    /* Back to the pool once the kernel is done with them */
+    for(int t = 0; t < 3; t++)
     {
-        printf("Error getting device ids");
-        exit(error);
+        if(table_buf[t] != out_table)
+            retire_buffer(env, table_buf[t]);
     }
-    /* Number of compute units */
-    clGetDeviceInfo(env->device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(env->num_compute_units),
-        &env->num_compute_units, NULL);
-    if(error) 
+}
+
+/* Single launch mode. Runs a phase kernel over every workgroup with one
+   clEnqueueNDRangeKernel. Arguments other than input, output, data size and the
+   group tables must already be set. Groups whose buffers don't share one
+   allocation (e.g. made by a custom partitioner) are launched one by one. */
+static void launch_packed(mr_env_t *env, cl_kernel kernel, cl_uint table_arg, const cl_mem *inputs,
+    const cl_uint *sizes, const cl_mem *outputs, size_t num_groups, size_t num_workitems)
+{
+    /* Input offsets, input sizes and output offsets, num_groups entries each */
+    cl_uint *tables = malloc(sizeof(cl_uint) * 3 * num_groups);
+    memcpy(tables + num_groups, sizes, sizeof(cl_uint) * num_groups);
+    cl_mem input = packed_parent(inputs, num_groups, tables);
+    cl_mem output = packed_parent(outputs, num_groups, tables + 2 * num_groups);
+
+    if(input != NULL && output != NULL)
     {
-        printf("Error getting device info %d", error);
-        exit(error);
+        enqueue_tables(env, kernel, table_arg, input, output, tables, NULL, num_groups, num_workitems);
     }
-    fprintf(stderr, "Max compute units: %u\n", env->num_compute_units);
-    /* Local memory size */
-    cl_ulong mem_size;
-    clGetDeviceInfo(env->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(mem_size), &mem_size, NULL);
-    if(error) 
+    else
     {
-        printf("Error getting device info %d", error);
-        exit(error);
+        for(size_t i = 0; i < num_groups; i++)
+        {
+            cl_uint group_tables[3] = { 0, sizes[i], 0 };
+            enqueue_tables(env, kernel, table_arg, inputs[i], outputs[i], group_tables, NULL, 1,
+                num_workitems);
+        }
     }
-    fprintf(stderr, "Local mem size: %lu\n", mem_size);
-    /* Maximum workgroup size */
-    clGetDeviceInfo(env->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(env->max_workitems),
-        &env->max_workitems, NULL);
-    if(error) 
+    free(tables);
+}
+
+/* Sets the map kernel arguments that are the same for every workgroup */
+static void set_map_args(mr_env_t *env, cl_kernel kernel, cl_uint tasks_arg, cl_uint tasks_per_map)
+{
+    cl_int error = CL_SUCCESS;
+
+    if(env->args->map_aux_arg != NULL && env->args->map_aux_size > 0)
+        error |= clSetKernelArg(kernel, 3, sizeof(env->map_aux_arg), (void*)&env->map_aux_arg);
+    if(env->args->runtime_tasks)
+        error |= clSetKernelArg(kernel, tasks_arg, sizeof(tasks_per_map), (void*)&tasks_per_map);
+    CL_ASSERT(error);
+}
+
+/* Single launch with a count kernel. The counts are scanned into output offsets
+   on the device and the map kernel takes its offsets from there, so the host
+   only waits for the total output size. The per-group counts and offsets are
+   read back behind the map kernel and turned into sub-buffers once it is done.
+   In arena mode the groups of each reduce group are written back to back and
+   the sub-buffers are the reduce inputs, so there is nothing left to partition. */
+static void map_counted(mr_env_t *env, cl_uint count_table_arg, cl_uint table_arg)
+{
+    cl_int error;
+    size_t num_groups = env->num_workgroups;
+    /* Input offsets, input sizes and counter offsets, num_groups entries each */
+    cl_uint *tables = malloc(sizeof(cl_uint) * 3 * num_groups);
+    cl_uint *offsets = malloc(sizeof(cl_uint) * (num_groups + 1));
+    cl_uint *zeros = calloc(num_groups, sizeof(cl_uint));
+    cl_program scan_program;
+    cl_kernel scan;
+
+    memcpy(tables + num_groups, env->map_data_size, sizeof(cl_uint) * num_groups);
+    cl_mem input = packed_parent(env->input_array, num_groups, tables);
+    for(size_t i = 0; i < num_groups; i++)
     {
-        printf("Error getting device info %d", error);
-        exit(error);
+        tables[2 * num_groups + i] = i * sizeof(cl_uint);
     }
-    fprintf(stderr, "Max workgroup size: %zu\n", env->max_workitems);
-    /* Context */
-    env->device_context = clCreateContext(NULL , 1, &env->device, NULL, NULL, &error);
-    if(error) 
+    cl_mem counts = pool_acquire(env->runtime, CL_MEM_READ_WRITE, sizeof(cl_uint) * num_groups);
+    cl_mem dev_offsets = pool_acquire(env->runtime, CL_MEM_READ_WRITE,
+        sizeof(cl_uint) * (num_groups + 1));
+    error = clEnqueueWriteBuffer(env->device_queue, counts, CL_FALSE, 0, sizeof(cl_uint) * num_groups,
+        zeros, 0, NULL, profile_event(env, env->device_queue, MR_CMD_WRITE, "counts", -1));
+    CL_ASSERT(error);
+    env->stats.bytes_uploaded += sizeof(cl_uint) * num_groups;
+
+    enqueue_tables(env, env->map_count, count_table_arg, input, counts, tables, NULL, num_groups,
+        env->num_workitems);
+
+    /* Exclusive scan of the counts */
+    create_kernel_from_source(env, "mr_scan_counts", scan_counts_source, strlen(scan_counts_source),
+        &scan_program, &scan, "");
+    cl_uint groups = num_groups;
+    cl_uint elem_size = env->args->keyval_size;
+    cl_uint align = lcm(env->runtime->info.mem_base_align, env->args->keyval_size);
+    cl_uint span = env->arena ? env->args->tasks_per_reduce : 1;
+    error = clSetKernelArg(scan, 0, sizeof(counts), (void*)&counts);
+    error |= clSetKernelArg(scan, 1, sizeof(dev_offsets), (void*)&dev_offsets);
+    error |= clSetKernelArg(scan, 2, sizeof(groups), (void*)&groups);
+    error |= clSetKernelArg(scan, 3, sizeof(elem_size), (void*)&elem_size);
+    error |= clSetKernelArg(scan, 4, sizeof(align), (void*)&align);
+    error |= clSetKernelArg(scan, 5, sizeof(span), (void*)&span);
+    error |= clSetKernelArg(scan, 6, sizeof(cl_uint) * env->num_workitems, NULL);
+    CL_ASSERT(error);
+    error = clEnqueueNDRangeKernel(env->device_queue, scan, 1, NULL, &env->num_workitems,
+        &env->num_workitems, 0, NULL,
+        profile_event(env, env->device_queue, MR_CMD_KERNEL, "scan_counts", -1));
+    CL_ASSERT(error);
+
+    /* The only value the host waits for */
+    error = clEnqueueReadBuffer(env->device_queue, dev_offsets, CL_TRUE, sizeof(cl_uint) * num_groups,
+        sizeof(cl_uint), &offsets[num_groups], 0, NULL,
+        profile_event(env, env->device_queue, MR_CMD_READ, "offsets", -1));
+    CL_ASSERT(error);
+
+    cl_mem output = clCreateBuffer(env->device_context, CL_MEM_READ_WRITE | host_flags(env),
+        offsets[num_groups], NULL, &error);
+    CL_ASSERT(error);
+    stats_buffer(env->runtime, output);
+    enqueue_tables(env, env->map, table_arg, input, output, tables, dev_offsets, num_groups,
+        env->num_workitems);
+    error = clEnqueueReadBuffer(env->device_queue, counts, CL_FALSE, 0, sizeof(cl_uint) * num_groups,
+        env->map_array_size, 0, NULL, profile_event(env, env->device_queue, MR_CMD_READ, "counts", -1));
+    error |= clEnqueueReadBuffer(env->device_queue, dev_offsets, CL_FALSE, 0,
+        sizeof(cl_uint) * num_groups, offsets, 0, NULL,
+        profile_event(env, env->device_queue, MR_CMD_READ, "offsets", -1));
+    CL_ASSERT(error);
+    clFinish(env->device_queue);
+    env->stats.bytes_downloaded += sizeof(cl_uint) * (3 * num_groups + 1);
+
+    size_t num_runs = div_round_up(num_groups, span);
+    cl_buffer_region *regions = malloc(sizeof(cl_buffer_region) * num_runs);
+    for(size_t r = 0; r < num_runs; r++)
     {
-        printf("Error creating context %d", error);
-        exit(error);
+        size_t bytes = 0;
+        for(size_t i = r * span; i < (r + 1) * span && i < num_groups; i++)
+        {
+            bytes += env->map_array_size[i] * env->args->keyval_size;
+        }
+        regions[r].origin = offsets[r * span];
+        regions[r].size = (bytes > 0) ? bytes : env->args->keyval_size;
+        if(env->arena)
+            env->reduce_data_size[r] = bytes;
     }
-    /* Command-queue */
-    env->device_queue = clCreateCommandQueue(env->device_context, env->device, 0, &error);
-    if(error) 
+    if(env->arena)
     {
-        printf("Error creating command queue");
-        exit(error);
+        env->num_reduce_workgroups = num_runs;
+        split_packed(output, regions, num_runs, env->merged_map_array);
+        /* The per-group slices are not sub-buffer aligned, only the runs are */
+        for(size_t i = 0; i < num_groups; i++)
+        {
+            env->map_array[i] = NULL;
+        }
     }
-
-    /////////////////////////////////////
-    /* 2. Determine system parameters. */
-    /////////////////////////////////////
-
-    if(env->args->num_workgroups > 0)
-        env->num_workgroups = env->args->num_workgroups;
-    else
-        env->num_workgroups = env->num_compute_units;
-    if(env->args->num_workitems > 0)
-        env->num_workitems = env->args->num_workitems;
     else
-        env->num_workitems = env->max_workitems;
-    if(env->args->tasks_per_reduce < 1)
-        env->args->tasks_per_reduce = 2;
-    env->num_reduce_workgroups = env->num_workgroups;
-    env->num_reduce_workitems = env->num_workitems / env->args->tasks_per_reduce;
-
-    /* No reduce phase, set single task in reduce phase */
-    if(env->args->reduce[0] == '\0')
     {
-        env->args->tasks_per_reduce = 1;
+        split_packed(output, regions, num_groups, env->map_array);
     }
 
-#ifdef VERBOSE
-    fprintf(stderr, "Number of map workitems: %zu\n", env->num_workitems);
-    fprintf(stderr, "Number of map workgroups: %zu\n", env->num_workgroups);
-    fprintf(stderr, "Number of reduce workitems: %zu\n", env->num_reduce_workitems);
-    fprintf(stderr, "Number of reduce  workgroups: %zu\n", env->num_reduce_workgroups);
-#endif 
-
-    ////////////////////////////////////
-    /* 3. Initialize data structures. */
-    ////////////////////////////////////
-
-    env->input_array = (cl_mem*)malloc(sizeof(cl_mem) * env->num_workgroups);
-    env->map_array = (cl_mem*)malloc(sizeof(cl_mem) * env->num_workgroups);
-    env->map_array_size = (cl_uint*)malloc(sizeof(cl_uint) * env->num_workgroups);
-    env->map_aux_arg = (cl_mem*)malloc(sizeof(cl_mem));
-    env->merged_map_array = (cl_mem*)malloc(sizeof(cl_mem) * env->num_reduce_workgroups);
-    env->reduce_array = (cl_mem*)malloc(sizeof(cl_mem) * env->num_reduce_workgroups);
-    env->reduce_array_size = (cl_uint*)malloc(sizeof(cl_uint) * env->num_reduce_workgroups);
-    env->map_data_size = (cl_uint*)malloc(sizeof(cl_uint) * env->num_workgroups);
-    env->reduce_data_size = (cl_uint*)malloc(sizeof(cl_uint) * env->num_reduce_workgroups);
-    if(env->args->splitter == NULL)
-        env->args->splitter = default_splitter;
-    if(env->args->partition == NULL)
-        env->args->partition = default_partition;
-
-    return env;
+    pool_release(env->runtime, counts);
+    pool_release(env->runtime, dev_offsets);
+    free(regions);
+    free(zeros);
+    free(offsets);
+    free(tables);
 }
 
+/* Emit cursor arguments of a fused or combining map kernel */
+static void set_emit_args(cl_kernel kernel, cl_uint emit_arg, cl_mem cursors, cl_uint capacity,
+    cl_uint group)
+{
+    cl_int error;
 
+    error = clSetKernelArg(kernel, emit_arg, sizeof(cursors), (void*)&cursors);
+    error |= clSetKernelArg(kernel, emit_arg + 1, sizeof(capacity), (void*)&capacity);
+    error |= clSetKernelArg(kernel, emit_arg + 2, sizeof(group), (void*)&group);
+    CL_ASSERT(error);
+}
 
-/**
- * Frees memory used by map reduce environment once map reduce has completed.
- * Frees environment pointer.
- */
-static void env_fini(mr_env_t* env)
+/* fused_map mode. The emit cursors hold the number of keyvals every group
+   produced. Groups that ran out of room are run again on their own, with an
+   output buffer of the exact size. A combining kernel can emit more keyvals on
+   the second run, so a group is re-run until its output fits. */
+static void map_overflow(mr_env_t *env, cl_mem cursors, cl_uint capacity, cl_uint emit_arg,
+    cl_uint table_arg)
 {
     cl_int error;
+    static const cl_uint zero = 0;
+    size_t retried = 0;
 
-    /* Release kernel and program objects */
-    error = clReleaseKernel(env->map);
-    CL_ASSERT(error);
-    error = clReleaseProgram(env->map_program);
+    error = clEnqueueReadBuffer(env->device_queue, cursors, CL_TRUE, 0,
+        sizeof(cl_uint) * env->num_workgroups, env->map_array_size, 0, NULL,
+        profile_event(env, env->device_queue, MR_CMD_READ, "cursors", -1));
     CL_ASSERT(error);
-    if(env->args->map_count[0] != '\0')
-    {
-        error = clReleaseKernel(env->map_count);
-        CL_ASSERT(error);
-        error = clReleaseProgram(env->map_count_program);
-        CL_ASSERT(error);
-    }
-    if(env->args->reduce[0] != '\0')
+    env->stats.bytes_downloaded += sizeof(cl_uint) * env->num_workgroups;
+    for(size_t i = 0; i < env->num_workgroups; i++)
     {
-        error = clReleaseKernel(env->reduce);
-        CL_ASSERT(error);
-        error = clReleaseProgram(env->reduce_program);
-        CL_ASSERT(error);
-        if(env->args->reduce_count[0] != '\0')
+        cl_uint room = capacity;
+        while(env->map_array_size[i] > room)
         {
-            error = clReleaseKernel(env->reduce_count);
+            room = env->map_array_size[i];
+            pool_release(env->runtime, env->map_array[i]);
+            env->map_array[i] = pool_acquire(env->runtime, CL_MEM_READ_WRITE | host_flags(env),
+                room * env->args->keyval_size);
+            error = clEnqueueWriteBuffer(env->device_queue, cursors, CL_FALSE, sizeof(cl_uint) * i,
+                sizeof(cl_uint), &zero, 0, NULL,
+                profile_event(env, env->device_queue, MR_CMD_WRITE, "cursors", i));
             CL_ASSERT(error);
-            error = clReleaseProgram(env->reduce_count_program);
+            env->stats.bytes_uploaded += sizeof(cl_uint);
+            set_emit_args(env->map, emit_arg, cursors, room, i);
+            if(env->args->single_launch)
+            {
+                cl_uint tables[3] = { 0, env->map_data_size[i], 0 };
+                enqueue_tables(env, env->map, table_arg, env->input_array[i], env->map_array[i],
+                    tables, NULL, 1, env->num_workitems);
+            }
+            else
+            {
+                error = clSetKernelArg(env->map, 0, sizeof(env->input_array[i]),
+                    (void*)&env->input_array[i]);
+                error |= clSetKernelArg(env->map, 1, sizeof(env->map_array[i]), (void*)&env->map_array[i]);
+                error |= clSetKernelArg(env->map, 2, sizeof(env->map_data_size[i]),
+                    (void*)&env->map_data_size[i]);
+                CL_ASSERT(error);
+                error = clEnqueueNDRangeKernel(env->device_queue, env->map, 1, NULL,
+                    &env->num_workitems, &env->num_workitems, 0, NULL,
+                    profile_event(env, env->device_queue, MR_CMD_KERNEL, "map_rerun", i));
+                CL_ASSERT(error);
+            }
+            error = clEnqueueReadBuffer(env->device_queue, cursors, CL_TRUE, sizeof(cl_uint) * i,
+                sizeof(cl_uint), &env->map_array_size[i], 0, NULL,
+                profile_event(env, env->device_queue, MR_CMD_READ, "cursors", i));
+            env->stats.bytes_downloaded += sizeof(cl_uint);
             CL_ASSERT(error);
+            retried++;
         }
     }
-    /* Release memory objects (note map and merged_map arrays are already gone) */
-    for(int i = 0; i < env->num_reduce_workgroups; i++)
-    {    
-        error = clReleaseMemObject(env->reduce_array[i]);
+#ifdef VERBOSE
+    if(retried > 0)
+        fprintf(stderr, "map output overflowed, re-ran workgroups %zu times\n", retried);
+#endif
+}
+
+/* Per-group counters of the count kernels */
+static void create_counters(mr_env_t *env, size_t count, cl_mem *counters)
+{
+    cl_int error;
+    static const cl_uint zero = 0;
+
+    if(env->args->single_launch)
+    {
+        size_t *sizes = malloc(sizeof(size_t) * count);
+        for(size_t i = 0; i < count; i++)
+        {
+            sizes[i] = sizeof(cl_uint);
+        }
+        create_packed(env, sizes, count, sizeof(cl_uint), CL_MEM_READ_WRITE, counters);
+        free(sizes);
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        if(!env->args->single_launch)
+            counters[i] = pool_acquire(env->runtime, CL_MEM_READ_WRITE, sizeof(cl_uint));
+        error = clEnqueueWriteBuffer(env->device_queue, counters[i], CL_FALSE, 0, sizeof(cl_uint),
+            &zero, 0, NULL, profile_event(env, env->device_queue, MR_CMD_WRITE, "counters", i));
         CL_ASSERT(error);
+        env->stats.bytes_uploaded += sizeof(cl_uint);
     }
-    /* Release command queue and context last */
-    error = clReleaseCommandQueue(env->device_queue);
-    CL_ASSERT(error);
-    error = clReleaseContext(env->device_context);
-    CL_ASSERT(error);
-
-    /* Get rid of all dynamic stuff */
-    free(env->input_array);
-    free(env->map_array);
-    free(env->merged_map_array);
-    free(env->reduce_array);
-    free(env->map_array_size);
-    free(env->reduce_array_size);
-    free(env->map_data_size);
-    free(env->reduce_data_size);
-    free(env);
+    /* The count kernels may run on other queues */
+    clFinish(env->device_queue);
 }
 
 /* Default splitter. Takes the input data and divides it uniformly based on number of tasks */
@@ -387,7 +1459,6 @@ void default_splitter(void* input)
 void map(mr_env_t *env)
 {
     cl_int error;
-    cl_uint temp = 0;
     struct timeval begin;
     struct timeval end;
 
@@ -402,6 +1473,7 @@ void map(mr_env_t *env)
 #ifdef TIMING
     fprintf(stderr, "splitter: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(env->args, MR_PHASE_SPLITTER, &begin, &end);
 
     /* Perform map task. */
 #ifdef VERBOSE
@@ -415,17 +1487,80 @@ void map(mr_env_t *env)
         num_all_tasks += env->splitter_data[i].length / env->args->unit_size;
     }
     cl_uint tasks_per_map = div_round_up(num_all_tasks, env->num_workgroups * env->num_workitems);
-    char args[64];
-    sprintf(args, "-D TASKS_PER_MAP=%d %s", tasks_per_map, env->args->map_args);
+    bool fused = env->args->fused_map;
+    bool combining = env->args->map_combine != MR_COMBINE_NONE;
+    /* Fused and combining map kernels count their output on emit cursors */
+    bool emitting = fused || combining;
+    char combine_args[288] = "";
+    char map_args[576];
+    char args[640];
+    char count_args[384];
+    if(combining)
+    {
+        char layout[192];
+        combine_flags(env->args, env->args->map_combine, layout, sizeof(layout));
+        snprintf(combine_args, sizeof(combine_args),
+            "-D MR_MAP_COMBINE -D MR_COMBINE_SLOTS=%d -D MR_COMBINE_PROBES=%d %s ",
+            MAP_COMBINE_SLOTS, MAP_COMBINE_PROBES, layout);
+    }
+    snprintf(map_args, sizeof(map_args), "%s%s%s", fused ? "-D MR_FUSED " : "", combine_args,
+        env->args->map_args);
+    build_flags(env, args, sizeof(args), "TASKS_PER_MAP", tasks_per_map, map_args);
+    build_flags(env, count_args, sizeof(count_args), "TASKS_PER_MAP", tasks_per_map,
+        env->args->map_args);
+    /* Task count goes after the aux argument in runtime_tasks mode */
+    cl_uint tasks_arg = (env->args->map_aux_arg != NULL && env->args->map_aux_size > 0) ? 4 : 3;
+    /* Followed by the emit cursor arguments of the map kernel and the group tables
+       in single launch mode */
+    cl_uint emit_arg = env->args->runtime_tasks ? tasks_arg + 1 : tasks_arg;
+    cl_uint table_arg = emitting ? emit_arg + 3 : emit_arg;
+    bool packed = env->args->single_launch;
 
-    /* Load splitter data to OpenCL buffers */
+    /* Load splitter data to OpenCL buffers. When streaming, the buffers are filled
+       later, right before the first kernel that reads them. A single launch has
+       nothing to overlap the uploads with, so it doesn't stream */
+    bool streaming = env->num_queues > 1 && !packed;
     get_time(&begin);
+    if(packed)
+    {
+        size_t *sizes = malloc(sizeof(size_t) * env->num_workgroups);
+        for(size_t i = 0; i < env->num_workgroups; i++)
+        {
+            sizes[i] = env->splitter_data[i].length;
+        }
+        create_packed(env, sizes, env->num_workgroups, env->args->unit_size,
+            CL_MEM_READ_ONLY | host_flags(env), env->input_array);
+        free(sizes);
+    }
     for(size_t i = 0; i < env->num_workgroups; i++)
     {
         void *inp_ptr = env->splitter_data[i].pointer;
         size_t dat_size = env->splitter_data[i].length;
-        env->input_array[i] = clCreateBuffer(env->device_context, 
-            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, dat_size, inp_ptr, &error);
+        if(packed)
+        {
+            error = clEnqueueWriteBuffer(env->device_queue, env->input_array[i], CL_FALSE, 0,
+                dat_size, inp_ptr, 0, NULL,
+                profile_event(env, env->device_queue, MR_CMD_WRITE, "input", i));
+            env->stats.bytes_uploaded += dat_size;
+        }
+        else if(env->zero_copy)
+        {
+            /* The kernels read the splitter's (usually mmap'd) data in place */
+            env->input_array[i] = clCreateBuffer(env->device_context,
+                CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, dat_size, inp_ptr, &error);
+        }
+        else if(streaming)
+        {
+            env->input_array[i] = pool_acquire(env->runtime, CL_MEM_READ_ONLY, dat_size);
+        }
+        else
+        {
+            env->input_array[i] = pool_acquire(env->runtime, CL_MEM_READ_ONLY, dat_size);
+            error = clEnqueueWriteBuffer(group_queue(env, i), env->input_array[i], CL_FALSE, 0,
+                dat_size, inp_ptr, 0, NULL,
+                profile_event(env, group_queue(env, i), MR_CMD_WRITE, "input", i));
+            env->stats.bytes_uploaded += dat_size;
+        }
         CL_ASSERT(error);
         env->map_data_size[i] = (cl_uint)env->splitter_data[i].length;
     }
@@ -436,28 +1571,45 @@ void map(mr_env_t *env)
             CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, env->args->map_aux_size,
             env->args->map_aux_arg, &error);
         CL_ASSERT(error);
+        stats_buffer(env->runtime, env->map_aux_arg);
+        env->stats.bytes_uploaded += env->args->map_aux_size;
     }    
     get_time(&end);
 #ifdef TIMING
     fprintf(stderr, "Map input buffers init: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(env->args, MR_PHASE_MAP_INPUT, &begin, &end);
 
-    if(env->args->map_count[0] != '\0')
+    /* A single launch with a count kernel sizes the map output on the device */
+    cl_mem cursors = NULL;
+    cl_uint fused_capacity = 0;
+    bool counted = packed && !fused && env->args->map_count[0] != '\0';
+    /* Only the counted layout is known before the map kernel writes it */
+    env->arena = env->args->arena_partition && counted && !combining && env->args->reduce[0] != '\0' &&
+        env->args->shuffle == MR_SHUFFLE_NONE && env->args->combine == MR_COMBINE_NONE;
+#ifdef VERBOSE
+    if(env->args->arena_partition && !env->arena)
+        fprintf(stderr, "arena partition needs single_launch and map_count, copying instead\n");
+#endif
+    if(counted)
     {
-        create_kernel(env, env->args->map_count, &env->map_count_program, &env->map_count, args);
+        create_kernel(env, env->args->map_count, &env->map_count_program, &env->map_count, count_args);
+        set_map_args(env, env->map_count, tasks_arg, tasks_per_map);
+    }
+    else if(env->args->map_count[0] != '\0' && !fused)
+    {
+        create_kernel(env, env->args->map_count, &env->map_count_program, &env->map_count,
+            count_args);
         /* Calculate number of work-groups */
         cl_mem* output_cnt = malloc(sizeof(cl_mem) * env->num_workgroups);
 
         /* Run map count kernel */
         get_time(&begin);
+        create_counters(env, env->num_workgroups, output_cnt);
         for(size_t i = 0; i < env->num_workgroups; i++)
         {
-            output_cnt[i] =  clCreateBuffer(env->device_context, 
-                CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint), &temp, &error);
-            CL_ASSERT(error);
-        }
-        for(size_t i = 0; i < env->num_workgroups; i++)
-        {
+            if(streaming)
+                upload_input(env, i);
             /* Set kernel arguments */
             error = clSetKernelArg(env->map_count, 0, sizeof(env->input_array[i]),
                 (void*)&env->input_array[i]);
@@ -469,34 +1621,43 @@ void map(mr_env_t *env)
                 error |= clSetKernelArg(env->map_count, 3, sizeof(env->map_aux_arg),
                     (void*)&env->map_aux_arg);
             }
+            if(env->args->runtime_tasks)
+            {
+                error |= clSetKernelArg(env->map_count, tasks_arg, sizeof(tasks_per_map),
+                    (void*)&tasks_per_map);
+            }
             CL_ASSERT(error);
             /* Enqueue the kernel on the GPU */
-            error = clEnqueueNDRangeKernel(env->device_queue, env->map_count, 1, NULL,
-                &env->num_workitems, &env->num_workitems, 0, NULL, NULL);
+            error = clEnqueueNDRangeKernel(group_queue(env, i), env->map_count, 1, NULL,
+                &env->num_workitems, &env->num_workitems, 0, NULL,
+                profile_event(env, group_queue(env, i), MR_CMD_KERNEL, "map_count", i));
             CL_ASSERT(error);
         }
-        clFinish(env->device_queue);
+        finish_queues(env);
         get_time(&end);
 #ifdef TIMING
         fprintf(stderr, "map count kernel: %ld ms\n", time_diff(&end, &begin));
 #endif
+        stats_phase(env->args, MR_PHASE_MAP_COUNT, &begin, &end);
 
         /////////////////////////////////////////////////////////////
         /*           Atomic dynamic memory allocation              */
         /////////////////////////////////////////////////////////////
         for(size_t i = 0; i < env->num_workgroups; i++)
         {
-            error = clEnqueueReadBuffer(env->device_queue, output_cnt[i], CL_FALSE, 0,
-                sizeof(cl_uint), &env->map_array_size[i], 0, NULL, NULL);
+            error = clEnqueueReadBuffer(group_queue(env, i), output_cnt[i], CL_FALSE, 0,
+                sizeof(cl_uint), &env->map_array_size[i], 0, NULL,
+                profile_event(env, group_queue(env, i), MR_CMD_READ, "map_count_size", i));
             CL_ASSERT(error);
+            env->stats.bytes_downloaded += sizeof(cl_uint);
         }
-        clFinish(env->device_queue);
+        finish_queues(env);
         for(size_t i = 0; i < env->num_workgroups; i++)
         {
             /* Get rid of the key number counter */
-            clReleaseMemObject(output_cnt[i]);
-            CL_ASSERT(error);
+            pool_release(env->runtime, output_cnt[i]);
         }
+        free(output_cnt);
     }
     else
     {
@@ -510,14 +1671,44 @@ void map(mr_env_t *env)
             env->map_array_size[i] = num_tasks * env->args->num_output_per_map_task;
         }
     }
+    if(fused)
+    {
+        /* Same room for every group, the kernel only gets one capacity */
+        fused_capacity = 0;
+        for(size_t i = 0; i < env->num_workgroups; i++)
+        {
+            cl_uint num_tasks = env->splitter_data[i].length / env->args->unit_size;
+            cl_uint capacity = num_tasks * env->args->fused_outputs_per_task;
+            if(capacity == 0)
+                capacity = div_round_up(env->splitter_data[i].length, env->args->keyval_size);
+            if(capacity > fused_capacity)
+                fused_capacity = capacity;
+        }
+        for(size_t i = 0; i < env->num_workgroups; i++)
+        {
+            env->map_array_size[i] = fused_capacity;
+        }
+    }
+    if(emitting)
+    {
+        cl_uint *zeros = calloc(env->num_workgroups, sizeof(cl_uint));
+        cursors = pool_acquire(env->runtime, CL_MEM_READ_WRITE, sizeof(cl_uint) * env->num_workgroups);
+        error = clEnqueueWriteBuffer(env->device_queue, cursors, CL_TRUE, 0,
+            sizeof(cl_uint) * env->num_workgroups, zeros, 0, NULL,
+            profile_event(env, env->device_queue, MR_CMD_WRITE, "cursors", -1));
+        CL_ASSERT(error);
+        env->stats.bytes_uploaded += sizeof(cl_uint) * env->num_workgroups;
+        free(zeros);
+    }
 
     cl_uint num_all_tuples = 0;
-    for(size_t i = 0; i < env->num_workgroups; i++)
+    for(size_t i = 0; i < env->num_workgroups && !counted; i++)
     {
         num_all_tuples += env->map_array_size[i];
     }
 #ifdef VERBOSE
-    fprintf(stderr, "num of output map tuples: %u\n", num_all_tuples);
+    if(!counted)
+        fprintf(stderr, "num of output map tuples: %u\n", num_all_tuples);
 #endif
 
     /* Init the buffer for read mapper 
@@ -526,7 +1717,18 @@ void map(mr_env_t *env)
        Allow mapreduce arguments to determine size of this buffer */
     cl_uint keyval_buffer_size;
     get_time(&begin);
-    for(size_t i = 0; i < env->num_workgroups; i++)
+    if(packed && !counted)
+    {
+        size_t *sizes = malloc(sizeof(size_t) * env->num_workgroups);
+        for(size_t i = 0; i < env->num_workgroups; i++)
+        {
+            sizes[i] = env->map_array_size[i] * env->args->keyval_size;
+        }
+        create_packed(env, sizes, env->num_workgroups, env->args->keyval_size,
+            CL_MEM_READ_WRITE | host_flags(env), env->map_array);
+        free(sizes);
+    }
+    for(size_t i = 0; i < env->num_workgroups && !packed; i++)
     {
         keyval_buffer_size = env->map_array_size[i] * env->args->keyval_size;
         /* If this buffer is empty, at least put a single keyval into it */
@@ -540,21 +1742,41 @@ void map(mr_env_t *env)
         memset(temp_buff, 0, env->map_array_size[i] * env->args->keyval_size);
         free(temp_buff); */
 
-        env->map_array[i] = clCreateBuffer(env->device_context, CL_MEM_READ_WRITE,
-            keyval_buffer_size, NULL, &error);
-        CL_ASSERT(error);
+        env->map_array[i] = pool_acquire(env->runtime, CL_MEM_READ_WRITE | host_flags(env),
+            keyval_buffer_size);
     }
     get_time(&end);
 #ifdef TIMING
     fprintf(stderr, "Map output buffers init: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(env->args, MR_PHASE_MAP_OUTPUT, &begin, &end);
     
     /* Build the kernel */
     create_kernel(env, env->args->map, &env->map_program, &env->map, args);
 
     get_time(&begin);
-    for(size_t i = 0; i < env->num_workgroups; i++)
+    if(counted)
+    {
+        /* Runs the count kernel too */
+        set_map_args(env, env->map, tasks_arg, tasks_per_map);
+        if(combining)
+            set_emit_args(env->map, emit_arg, cursors, 0, 0);
+        map_counted(env, emit_arg, table_arg);
+    }
+    else if(packed)
     {
+        set_map_args(env, env->map, tasks_arg, tasks_per_map);
+        if(emitting)
+            set_emit_args(env->map, emit_arg, cursors, fused_capacity, 0);
+        launch_packed(env, env->map, table_arg, env->input_array, env->map_data_size, env->map_array,
+            env->num_workgroups, env->num_workitems);
+    }
+    for(size_t i = 0; i < env->num_workgroups && !packed; i++)
+    {
+        /* Each group is uploaded on its own queue, so the copy of group N+1
+           overlaps with the kernel of group N */
+        if(streaming && (env->args->map_count[0] == '\0' || fused))
+            upload_input(env, i);
         error = clSetKernelArg(env->map, 0, sizeof(env->input_array[i]),
             (void*)&env->input_array[i]);
         error |= clSetKernelArg(env->map, 1, sizeof(env->map_array[i]), (void*)&env->map_array[i]);
@@ -562,31 +1784,69 @@ void map(mr_env_t *env)
             (void*)&env->map_data_size[i]);
         if(env->args->map_aux_arg != NULL && env->args->map_aux_size > 0)
             error |= clSetKernelArg(env->map, 3, sizeof(env->map_aux_arg),(void*)&env->map_aux_arg);
+        if(env->args->runtime_tasks)
+            error |= clSetKernelArg(env->map, tasks_arg, sizeof(tasks_per_map), (void*)&tasks_per_map);
+        CL_ASSERT(error);
+        if(emitting)
+            set_emit_args(env->map, emit_arg, cursors, fused_capacity, i);
         /* Launch the Kernel on the GPU */
-        error = clEnqueueNDRangeKernel(env->device_queue, env->map, 1, NULL, &env->num_workitems,
-            &env->num_workitems, 0, NULL, NULL);
+        error = clEnqueueNDRangeKernel(group_queue(env, i), env->map, 1, NULL, &env->num_workitems,
+            &env->num_workitems, 0, NULL, profile_event(env, group_queue(env, i), MR_CMD_KERNEL, "map", i));
         CL_ASSERT(error);
     }
-    clFinish(env->device_queue);
+    /* Without a reduce phase the read back is queued behind each group's kernel,
+       so the queues are drained only after it */
+    bool drained = !streaming || env->args->reduce[0] != '\0' || emitting ||
+        env->args->shuffle != MR_SHUFFLE_NONE || env->args->combine != MR_COMBINE_NONE;
+    if(drained)
+        finish_queues(env);
+    if(fused)
+    {
+        map_overflow(env, cursors, fused_capacity, emit_arg, table_arg);
+    }
+    else if(combining)
+    {
+        /* Combined keyvals fill only the start of each group's buffer */
+        error = clEnqueueReadBuffer(env->device_queue, cursors, CL_TRUE, 0,
+            sizeof(cl_uint) * env->num_workgroups, env->map_array_size, 0, NULL,
+            profile_event(env, env->device_queue, MR_CMD_READ, "cursors", -1));
+        CL_ASSERT(error);
+        env->stats.bytes_downloaded += sizeof(cl_uint) * env->num_workgroups;
+    }
+    if(emitting)
+        pool_release(env->runtime, cursors);
     get_time(&end);
 
 #ifdef TIMING
     fprintf(stderr, "map kernel: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(env->args, MR_PHASE_MAP, &begin, &end);
 #ifdef VERBOSE
     fprintf(stderr, "calculated map\n");
 #endif
-    /* Release unneeded memory objects */
+    /* Release unneeded memory objects. The pool may only get them back once no
+       queued kernel reads them */
+    if(drained)
+        release_input(env);
+    else
+        env->input_held = true;
+}
+
+/**
+ * Hand the map input back, the map kernels must have finished
+ */
+static void release_input(mr_env_t *env)
+{
     for(size_t i = 0; i < env->num_workgroups; i++)
     {
-        error = clReleaseMemObject(env->input_array[i]);
-        CL_ASSERT(error);
+        pool_release(env->runtime, env->input_array[i]);
     }
     if(env->args->map_aux_size > 0)
     {
-        error = clReleaseMemObject(env->map_aux_arg);
+        cl_int error = clReleaseMemObject(env->map_aux_arg);
         CL_ASSERT(error);
     }
+    env->input_held = false;
 }
 
 /**
@@ -596,46 +1856,66 @@ void map(mr_env_t *env)
 void default_partition(void* input)
 {
     mr_env_t *env = (mr_env_t*)input;
-    env->num_reduce_workgroups = env->num_workgroups;
-    cl_int error;
+    size_t tasks_per_reduce = env->args->tasks_per_reduce;
+    /* Each reduce workgroup merges tasks_per_reduce map outputs. There is one reduce workgroup
+       per map workgroup, those past the last map output get no input. Single launch packs
+       only the ones that get input */
+    if(env->args->single_launch)
+        env->num_reduce_workgroups = div_round_up(env->num_workgroups, tasks_per_reduce);
+    else
+        env->num_reduce_workgroups = env->num_workgroups;
+    cl_int error = CL_SUCCESS;
+    size_t *merged_bytes = malloc(sizeof(size_t) * env->num_reduce_workgroups);
+
     for(int i = 0; i < env->num_reduce_workgroups; i++)
     {
-        env->merged_map_array[i] = env->map_array[i];
-        env->reduce_data_size[i] = env->map_data_size[i];
+        merged_bytes[i] = 0;
+        for(size_t j = i * tasks_per_reduce; j < (i + 1) * tasks_per_reduce && j < env->num_workgroups; j++)
+        {
+            merged_bytes[i] += env->args->keyval_size * env->map_array_size[j];
+        }
+    }
+    if(env->args->single_launch)
+    {
+        create_packed(env, merged_bytes, env->num_reduce_workgroups, env->args->keyval_size,
+            CL_MEM_READ_WRITE, env->merged_map_array);
     }
 
     /* Two-workgroup merged partitoner. We need to merge proper input for this task */
     for(int i = 0; i < env->num_reduce_workgroups; i++)
     {
-        cl_uint merged_size = 0;
-        for(int j = 0; j < env->args->tasks_per_reduce; j++)
+        cl_uint merged_size = merged_bytes[i] / env->args->keyval_size;
+        if(!env->args->single_launch)
         {
-            merged_size += env->map_array_size[i * env->args->tasks_per_reduce + j];
+            env->merged_map_array[i] = pool_acquire(env->runtime, CL_MEM_READ_WRITE,
+                (merged_size > 0) ? merged_bytes[i] : env->args->keyval_size);
         }
-        env->merged_map_array[i] = clCreateBuffer(env->device_context, CL_MEM_READ_WRITE, 
-            env->args->keyval_size * merged_size , NULL, &error);
         cl_uint wr_keyvals = 0;
-        for(int j = 0; j < env->args->tasks_per_reduce; j++)
+        for(size_t j = 0; j < tasks_per_reduce && i * tasks_per_reduce + j < env->num_workgroups; j++)
         {
-            clEnqueueCopyBuffer(env->device_queue, env->map_array[i*env->args->tasks_per_reduce + j],
+            size_t group = i * tasks_per_reduce + j;
+            if(env->map_array_size[group] == 0)
+                continue;
+            error = clEnqueueCopyBuffer(env->device_queue, env->map_array[group],
                 env->merged_map_array[i], 0, wr_keyvals, env->args->keyval_size * 
-                env->map_array_size[i*env->args->tasks_per_reduce + j], 0, NULL, NULL);
+                env->map_array_size[group], 0, NULL,
+                profile_event(env, env->device_queue, MR_CMD_COPY, "partition", i));
+            CL_ASSERT(error);
 
-            wr_keyvals += env->args->keyval_size * env->map_array_size[i*env->args->tasks_per_reduce + j];
+            wr_keyvals += env->args->keyval_size * env->map_array_size[group];
         }
         /* See if this is the last piece and it encounters the last index to avoid memory corruption */
         merged_size *= env->args->keyval_size;
         env->reduce_data_size[i] = merged_size;
-        CL_ASSERT(error);
     }
+    free(merged_bytes);
     /* Wait for buffers to be properly copied */
     clFinish(env->device_queue);
 
     /* Get rid of old buffers */
     for(size_t i = 0; i < env->num_workgroups; i++)
     {
-        clReleaseMemObject(env->map_array[i]);
-        CL_ASSERT(error);
+        pool_release(env->runtime, env->map_array[i]);
     }
     /* Wait for buffers to be properly released */
     clFinish(env->device_queue);
@@ -644,7 +1924,6 @@ void default_partition(void* input)
 void reduce(mr_env_t *env)
 {
     cl_int error;
-    cl_uint temp = 0;
     struct timeval begin;
     struct timeval end;
     
@@ -653,61 +1932,82 @@ void reduce(mr_env_t *env)
     fprintf(stderr, "Running partitioner\n");
 #endif
     get_time(&begin);
-    env->args->partition(env);
+    if(env->args->shuffle != MR_SHUFFLE_NONE)
+        sort_partition(env);
+    else if(!env->arena)
+        env->args->partition(env);
     get_time(&end);
 #ifdef TIMING
     fprintf(stderr, "partitioner: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(env->args, MR_PHASE_PARTITION, &begin, &end);
 
 #ifdef VERBOSE
     fprintf(stderr, "init reduce phase\n");
 #endif
     cl_uint tasks_per_reduce = div_round_up(env->map_array_size[0], env->num_reduce_workitems);
-    char args[64];
-    sprintf(args, "-D TASKS_PER_REDUCE=%d %s", tasks_per_reduce, env->args->reduce_args);
+    char args[384];
+    build_flags(env, args, sizeof(args), "TASKS_PER_REDUCE", tasks_per_reduce, env->args->reduce_args);
+    bool packed = env->args->single_launch;
+    /* Group tables follow the task count in single launch mode */
+    cl_uint table_arg = env->args->runtime_tasks ? 4 : 3;
     /* Calculate number of work-groups */
     cl_mem* output_cnt = malloc(sizeof(cl_mem) * env->num_reduce_workgroups);
     /* Build the reduce count kernel */
     create_kernel(env, env->args->reduce_count, &env->reduce_count_program, &env->reduce_count, args);
 
     get_time(&begin);
-    for(int i = 0; i < env->num_reduce_workgroups; i++)
+    create_counters(env, env->num_reduce_workgroups, output_cnt);
+    if(packed)
+    {
+        if(env->args->runtime_tasks)
+        {
+            error = clSetKernelArg(env->reduce_count, 3, sizeof(tasks_per_reduce), (void*)&tasks_per_reduce);
+            CL_ASSERT(error);
+        }
+        launch_packed(env, env->reduce_count, table_arg, env->merged_map_array, env->reduce_data_size,
+            output_cnt, env->num_reduce_workgroups, env->num_reduce_workitems);
+    }
+    for(int i = 0; i < env->num_reduce_workgroups && !packed; i++)
     {
-        output_cnt[i] =  clCreateBuffer(env->device_context, 
-            CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint), &temp, &error);
-        CL_ASSERT(error);
         error = clSetKernelArg(env->reduce_count, 0, sizeof(env->merged_map_array[i]),
             (void*)&env->merged_map_array[i]);
         error |= clSetKernelArg(env->reduce_count, 1, sizeof(output_cnt[i]),(void*)&output_cnt[i]);
         error |= clSetKernelArg(env->reduce_count, 2, sizeof(env->reduce_data_size[i]),
             (void*)&env->reduce_data_size[i]);
+        if(env->args->runtime_tasks)
+            error |= clSetKernelArg(env->reduce_count, 3, sizeof(tasks_per_reduce), (void*)&tasks_per_reduce);
         CL_ASSERT(error);
 
         /* Launch the Kernel on the GPU */
-        error = clEnqueueNDRangeKernel(env->device_queue, env->reduce_count, 1, NULL,
-            &env->num_reduce_workitems, &env->num_reduce_workitems, 0, NULL, NULL);
+        error = clEnqueueNDRangeKernel(group_queue(env, i), env->reduce_count, 1, NULL,
+            &env->num_reduce_workitems, &env->num_reduce_workitems, 0, NULL,
+            profile_event(env, group_queue(env, i), MR_CMD_KERNEL, "reduce_count", i));
         CL_ASSERT(error);
     }
-    clFinish(env->device_queue);
+    finish_queues(env);
     get_time(&end);
 #ifdef TIMING
     fprintf(stderr, "reduce count kernel: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(env->args, MR_PHASE_REDUCE_COUNT, &begin, &end);
     
     for(int i = 0; i < env->num_reduce_workgroups; i++)
     {
-        error = clEnqueueReadBuffer(env->device_queue, output_cnt[i], CL_FALSE, 0, sizeof(cl_uint),
-            &env->reduce_array_size[i], 0, NULL, NULL);
+        error = clEnqueueReadBuffer(group_queue(env, i), output_cnt[i], CL_FALSE, 0, sizeof(cl_uint),
+            &env->reduce_array_size[i], 0, NULL,
+            profile_event(env, group_queue(env, i), MR_CMD_READ, "reduce_count_size", i));
         CL_ASSERT(error);
+        env->stats.bytes_downloaded += sizeof(cl_uint);
     }
-    clFinish(env->device_queue);
+    finish_queues(env);
 
     /* Get rid of the key number counters */
-    for(size_t i = 0; i < env->num_workgroups; i++)
+    for(size_t i = 0; i < env->num_reduce_workgroups; i++)
     {
-        clReleaseMemObject(output_cnt[i]);
-        CL_ASSERT(error);
+        pool_release(env->runtime, output_cnt[i]);
     }
+    free(output_cnt);
 
     cl_uint num_all_tuples = 0;
     for(int i = 0; i < env->num_reduce_workgroups; i++)
@@ -719,7 +2019,18 @@ void reduce(mr_env_t *env)
 #endif
 
     cl_uint keyval_buffer_size;
-    for(int i = 0; i < env->num_reduce_workgroups; i++)
+    if(packed)
+    {
+        size_t *sizes = malloc(sizeof(size_t) * env->num_reduce_workgroups);
+        for(int i = 0; i < env->num_reduce_workgroups; i++)
+        {
+            sizes[i] = env->reduce_array_size[i] * env->args->keyval_size;
+        }
+        create_packed(env, sizes, env->num_reduce_workgroups, env->args->keyval_size,
+            CL_MEM_READ_WRITE | host_flags(env), env->reduce_array);
+        free(sizes);
+    }
+    for(int i = 0; i < env->num_reduce_workgroups && !packed; i++)
     {
         keyval_buffer_size = env->reduce_array_size[i] * env->args->keyval_size;
         if(keyval_buffer_size == 0)
@@ -730,17 +2041,26 @@ void reduce(mr_env_t *env)
         memset(temp_buff, 0, env->reduce_array_size[i] * env->args->keyval_size);
         free(temp_buff);*/
         
-        env->reduce_array[i] = clCreateBuffer(env->device_context, CL_MEM_READ_WRITE, 
-            keyval_buffer_size, NULL, &error);
-        CL_ASSERT(error);
+        env->reduce_array[i] = pool_acquire(env->runtime, CL_MEM_READ_WRITE | host_flags(env),
+            keyval_buffer_size);
     }
 
     /* Build the reduce kernel */
     create_kernel(env, env->args->reduce, &env->reduce_program, &env->reduce, args);
 
     get_time(&begin);
+    if(packed)
+    {
+        if(env->args->runtime_tasks)
+        {
+            error = clSetKernelArg(env->reduce, 3, sizeof(tasks_per_reduce), (void*)&tasks_per_reduce);
+            CL_ASSERT(error);
+        }
+        launch_packed(env, env->reduce, table_arg, env->merged_map_array, env->reduce_data_size,
+            env->reduce_array, env->num_reduce_workgroups, env->num_reduce_workitems);
+    }
     /* Set kernel arguments */
-    for(int i = 0; i < env->num_reduce_workgroups; i++)
+    for(int i = 0; i < env->num_reduce_workgroups && !packed; i++)
     {
         error = clSetKernelArg(env->reduce, 0, sizeof(env->merged_map_array[i]),
             (void*)&env->merged_map_array[i]);
@@ -748,18 +2068,22 @@ void reduce(mr_env_t *env)
             (void*)&env->reduce_array[i]);
         error |= clSetKernelArg(env->reduce, 2, sizeof(env->reduce_data_size[i]),
             (void*)&env->reduce_data_size[i]);
+        if(env->args->runtime_tasks)
+            error |= clSetKernelArg(env->reduce, 3, sizeof(tasks_per_reduce), (void*)&tasks_per_reduce);
         CL_ASSERT(error);
 
         /* Launch the Kernel on the GPU */
-        error = clEnqueueNDRangeKernel(env->device_queue, env->reduce, 1, NULL, 
-            &env->num_reduce_workitems, &env->num_reduce_workitems, 0, NULL, NULL);
+        error = clEnqueueNDRangeKernel(group_queue(env, i), env->reduce, 1, NULL, 
+            &env->num_reduce_workitems, &env->num_reduce_workitems, 0, NULL,
+            profile_event(env, group_queue(env, i), MR_CMD_KERNEL, "reduce", i));
         CL_ASSERT(error);
     }
-    clFinish(env->device_queue);
+    finish_queues(env);
     get_time(&end);
 #ifdef TIMING
     fprintf(stderr, "reduce kernel: %ld ms\n", time_diff(&end, &begin));
 #endif
+    stats_phase(env->args, MR_PHASE_REDUCE, &begin, &end);
 #ifdef VERBOSE
     fprintf(stderr, "calculated reduce\n");
 #endif
@@ -767,7 +2091,7 @@ void reduce(mr_env_t *env)
     /* Release memory object */
     for(int i = 0; i < env->num_reduce_workgroups; i++)
     {
-        clReleaseMemObject(env->merged_map_array[i]);
+        pool_release(env->runtime, env->merged_map_array[i]);
         CL_ASSERT(error);
     }
 }
@@ -0,0 +1,430 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <strings.h>
+#include "stddefines.h"
+#include "utils.h"
+#include "native.h"
+#include "stats.h"
+
+//==========================================//
+//											//
+// Native pthread backend					//
+//											//
+//==========================================//
+
+// Keyvals an empty emitter makes room for on the first mr_emit()
+#define EMIT_INITIAL 64
+// Map tasks per thread when native_grain is 0, enough for stealing to even out skew
+#define TASKS_PER_THREAD 32
+
+// Groups of one phase, handed out to the threads one at a time
+typedef struct
+{
+	mr_env_t* env;
+	void (*run)(mr_env_t*, size_t);
+	size_t num_groups;
+	size_t next;
+	pthread_mutex_t lock;
+} native_phase_t;
+
+// A run of whole units of one splitter chunk, the unit of work of the map phase
+typedef struct
+{
+	size_t group;
+	size_t offset;
+	size_t size;
+} map_task_t;
+
+// Map tasks a worker has not started, [begin, end) of the task table. The owner
+// takes them from the front, thieves take the back half
+typedef struct
+{
+	size_t begin;
+	size_t end;
+	pthread_mutex_t lock;
+} task_deque_t;
+
+// Work-stealing map phase
+typedef struct
+{
+	mr_env_t* env;
+	map_task_t* tasks;
+	mr_emitter_t* out;			// Output of every task
+	task_deque_t* deques;		// One per worker
+	size_t num_workers;
+} map_phase_t;
+
+typedef struct
+{
+	map_phase_t* phase;
+	size_t id;
+} map_worker_t;
+
+void mr_emit(mr_emitter_t* out, const void* keyval)
+{
+	if(out->count == out->capacity)
+	{
+		out->capacity = (out->capacity > 0) ? out->capacity * 2 : EMIT_INITIAL;
+		out->data = realloc(out->data, out->capacity * out->keyval_size);
+		CHECK_ERROR(out->data == NULL);
+	}
+	memcpy((char*)out->data + out->count * out->keyval_size, keyval, out->keyval_size);
+	out->count++;
+}
+
+// Backend of a job, CERBERUS_BACKEND wins over the requested one
+mr_backend_t native_backend(mr_backend_t requested)
+{
+	const char* env = getenv("CERBERUS_BACKEND");
+
+	if(env == NULL || env[0] == '\0')
+		return requested;
+	if(strcasecmp(env, "native") == 0)
+		return MR_BACKEND_NATIVE;
+	if(strcasecmp(env, "opencl") == 0)
+		return MR_BACKEND_OPENCL;
+	fprintf(stderr, "Unknown CERBERUS_BACKEND %s, ignored\n", env);
+	return requested;
+}
+
+static void* phase_worker(void* arg)
+{
+	native_phase_t* phase = (native_phase_t*)arg;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&phase->lock);
+		size_t group = phase->next++;
+		pthread_mutex_unlock(&phase->lock);
+		if(group >= phase->num_groups)
+			break;
+		phase->run(phase->env, group);
+	}
+	return NULL;
+}
+
+// Runs run(env, group) for every group on the job's threads, the caller being one of them
+static void run_phase(mr_env_t* env, size_t num_groups, void (*run)(mr_env_t*, size_t))
+{
+	native_phase_t phase;
+	size_t num_threads = (env->num_threads < num_groups) ? env->num_threads : num_groups;
+	pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+
+	phase.env = env;
+	phase.run = run;
+	phase.num_groups = num_groups;
+	phase.next = 0;
+	pthread_mutex_init(&phase.lock, NULL);
+	for(size_t i = 1; i < num_threads; i++)
+		CHECK_ERROR(pthread_create(&threads[i], NULL, phase_worker, &phase) != 0);
+	phase_worker(&phase);
+	for(size_t i = 1; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&phase.lock);
+	free(threads);
+}
+
+static mr_emitter_t* create_emitters(mr_env_t* env, size_t count)
+{
+	mr_emitter_t* out = calloc(count, sizeof(mr_emitter_t));
+
+	for(size_t i = 0; i < count; i++)
+		out[i].keyval_size = env->args->keyval_size;
+	return out;
+}
+
+static void free_emitters(mr_emitter_t* out, size_t count)
+{
+	if(out == NULL)
+		return;
+	for(size_t i = 0; i < count; i++)
+		free(out[i].data);
+	free(out);
+}
+
+mr_env_t* native_env_init(map_reduce_args_t* args)
+{
+	mr_env_t* env = calloc(1, sizeof(mr_env_t));
+
+	if(env == NULL)
+		return NULL;
+	env->args = args;
+	if(args->num_threads > 0)
+		env->num_threads = args->num_threads;
+	else
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		env->num_threads = (cpus > 0) ? cpus : 1;
+	}
+	// A workgroup is one task of the pool, the splitter still cuts num_workgroups chunks
+	env->num_workgroups = (args->num_workgroups > 0) ? args->num_workgroups : env->num_threads;
+	env->num_workitems = 1;
+	if(args->tasks_per_reduce < 1)
+		args->tasks_per_reduce = 2;
+	env->num_reduce_workgroups = env->num_workgroups;
+	env->map_aux_arg = args->map_aux_arg;
+	env->map_aux_size = args->map_aux_size;
+	env->native_map_out = create_emitters(env, env->num_workgroups);
+	if(args->splitter == NULL)
+		args->splitter = default_splitter;
+	return env;
+}
+
+void native_env_fini(mr_env_t* env)
+{
+	stats_collect(env);
+	free_emitters(env->native_map_out, env->num_workgroups);
+	free_emitters(env->native_reduce_in, env->num_reduce_workgroups);
+	free_emitters(env->native_reduce_out, env->num_reduce_workgroups);
+	free(env->splitter_data);
+	free(env);
+}
+
+// Units per map task, splitter chunks are cut into runs of this many units
+static size_t map_grain(mr_env_t* env)
+{
+	size_t units = 0;
+
+	if(env->args->native_grain > 0)
+		return env->args->native_grain;
+	for(size_t i = 0; i < env->num_workgroups; i++)
+		units += env->splitter_data[i].length / env->args->unit_size;
+	units /= env->num_threads * TASKS_PER_THREAD;
+	return (units > 0) ? units : 1;
+}
+
+// Cuts every splitter chunk into tasks, the tasks of a group are consecutive and
+// first[group] is the first one
+static map_task_t* create_tasks(mr_env_t* env, size_t* first, size_t* num_tasks)
+{
+	size_t step = map_grain(env) * env->args->unit_size;
+	size_t count = 0;
+
+	for(size_t i = 0; i < env->num_workgroups; i++)
+	{
+		first[i] = count;
+		size_t length = env->splitter_data[i].length;
+		count += (length > step) ? (length + step - 1) / step : 1;
+	}
+	first[env->num_workgroups] = count;
+	map_task_t* tasks = malloc(sizeof(map_task_t) * count);
+	for(size_t i = 0; i < env->num_workgroups; i++)
+	{
+		size_t length = env->splitter_data[i].length;
+		for(size_t t = first[i]; t < first[i + 1]; t++)
+		{
+			size_t offset = (t - first[i]) * step;
+			tasks[t].group = i;
+			tasks[t].offset = offset;
+			tasks[t].size = (t + 1 < first[i + 1]) ? step : length - offset;
+		}
+	}
+	*num_tasks = count;
+	return tasks;
+}
+
+static bool pop_task(task_deque_t* deque, size_t* task)
+{
+	bool found;
+
+	pthread_mutex_lock(&deque->lock);
+	found = deque->begin < deque->end;
+	if(found)
+		*task = deque->begin++;
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+// Moves the back half of another worker's tasks to the thief's deque. Tasks are
+// never created during the phase, so when no deque has any left the thief is done.
+static bool steal_tasks(map_phase_t* phase, size_t thief)
+{
+	for(size_t i = 1; i < phase->num_workers; i++)
+	{
+		task_deque_t* victim = &phase->deques[(thief + i) % phase->num_workers];
+		size_t begin;
+		size_t end;
+
+		pthread_mutex_lock(&victim->lock);
+		end = victim->end;
+		begin = end - (end - victim->begin + 1) / 2;
+		victim->end = begin;
+		pthread_mutex_unlock(&victim->lock);
+		if(begin < end)
+		{
+			task_deque_t* own = &phase->deques[thief];
+			pthread_mutex_lock(&own->lock);
+			own->begin = begin;
+			own->end = end;
+			pthread_mutex_unlock(&own->lock);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void* map_worker(void* arg)
+{
+	map_worker_t* worker = (map_worker_t*)arg;
+	map_phase_t* phase = worker->phase;
+	map_reduce_args_t* args = phase->env->args;
+	size_t task;
+
+	do
+	{
+		while(pop_task(&phase->deques[worker->id], &task))
+		{
+			map_task_t* t = &phase->tasks[task];
+			args->native_map((const char*)phase->env->splitter_data[t->group].pointer + t->offset, t->size,
+							 phase->env->map_aux_arg, &phase->out[task]);
+		}
+	} while(steal_tasks(phase, worker->id));
+	return NULL;
+}
+
+// Concatenates the output of a group's tasks into its map output
+static void gather_group(mr_env_t* env, mr_emitter_t* out, size_t first, size_t last, mr_emitter_t* group)
+{
+	size_t keyval_size = env->args->keyval_size;
+
+	if(last - first == 1)
+	{
+		*group = out[first];
+		return;
+	}
+	for(size_t t = first; t < last; t++)
+		group->capacity += out[t].count;
+	group->data = malloc((group->capacity > 0) ? group->capacity * keyval_size : keyval_size);
+	for(size_t t = first; t < last; t++)
+	{
+		memcpy((char*)group->data + group->count * keyval_size, out[t].data, out[t].count * keyval_size);
+		group->count += out[t].count;
+		free(out[t].data);
+	}
+}
+
+void native_map(mr_env_t* env)
+{
+	map_phase_t phase;
+	size_t num_tasks;
+	size_t* first = malloc(sizeof(size_t) * (env->num_workgroups + 1));
+
+	env->args->splitter(env);
+	phase.env = env;
+	phase.tasks = create_tasks(env, first, &num_tasks);
+	phase.out = create_emitters(env, num_tasks);
+	phase.num_workers = (env->num_threads < num_tasks) ? env->num_threads : num_tasks;
+	phase.deques = malloc(sizeof(task_deque_t) * phase.num_workers);
+	map_worker_t* workers = malloc(sizeof(map_worker_t) * phase.num_workers);
+	pthread_t* threads = malloc(sizeof(pthread_t) * phase.num_workers);
+
+	// Workers start on equal, contiguous shares of the tasks
+	for(size_t i = 0; i < phase.num_workers; i++)
+	{
+		phase.deques[i].begin = num_tasks * i / phase.num_workers;
+		phase.deques[i].end = num_tasks * (i + 1) / phase.num_workers;
+		pthread_mutex_init(&phase.deques[i].lock, NULL);
+		workers[i].phase = &phase;
+		workers[i].id = i;
+	}
+	for(size_t i = 1; i < phase.num_workers; i++)
+		CHECK_ERROR(pthread_create(&threads[i], NULL, map_worker, &workers[i]) != 0);
+	map_worker(&workers[0]);
+	for(size_t i = 1; i < phase.num_workers; i++)
+		pthread_join(threads[i], NULL);
+
+	for(size_t i = 0; i < env->num_workgroups; i++)
+		gather_group(env, phase.out, first[i], first[i + 1], &env->native_map_out[i]);
+	stats_map_tuples(env);
+	for(size_t i = 0; i < phase.num_workers; i++)
+		pthread_mutex_destroy(&phase.deques[i].lock);
+	free(phase.out);
+	free(phase.tasks);
+	free(phase.deques);
+	free(workers);
+	free(threads);
+	free(first);
+}
+
+// Counterpart of default_partition(), each reduce group gets the map output of
+// tasks_per_reduce consecutive workgroups
+void native_partition(void* input)
+{
+	mr_env_t* env = (mr_env_t*)input;
+	size_t tasks_per_reduce = env->args->tasks_per_reduce;
+	size_t keyval_size = env->args->keyval_size;
+
+	env->num_reduce_workgroups = div_round_up(env->num_workgroups, tasks_per_reduce);
+	env->native_reduce_in = create_emitters(env, env->num_reduce_workgroups);
+	for(size_t i = 0; i < env->num_reduce_workgroups; i++)
+	{
+		mr_emitter_t* merged = &env->native_reduce_in[i];
+		size_t first = i * tasks_per_reduce;
+		size_t last = (first + tasks_per_reduce < env->num_workgroups) ? first + tasks_per_reduce :
+			env->num_workgroups;
+
+		// A single map output is handed over as it is
+		if(last - first == 1)
+		{
+			*merged = env->native_map_out[first];
+			memset(&env->native_map_out[first], 0, sizeof(mr_emitter_t));
+			continue;
+		}
+		for(size_t j = first; j < last; j++)
+			merged->capacity += env->native_map_out[j].count;
+		merged->data = malloc((merged->capacity > 0) ? merged->capacity * keyval_size : keyval_size);
+		for(size_t j = first; j < last; j++)
+		{
+			memcpy((char*)merged->data + merged->count * keyval_size, env->native_map_out[j].data,
+				   env->native_map_out[j].count * keyval_size);
+			merged->count += env->native_map_out[j].count;
+		}
+	}
+}
+
+static void reduce_group(mr_env_t* env, size_t group)
+{
+	env->args->native_reduce(env->native_reduce_in[group].data, env->native_reduce_in[group].count,
+							 &env->native_reduce_out[group]);
+}
+
+void native_reduce(mr_env_t* env)
+{
+	// A custom partitioner fills native_reduce_in itself
+	if(env->args->partition == NULL || env->args->partition == default_partition)
+		native_partition(env);
+	else
+		env->args->partition(env);
+	env->native_reduce_out = create_emitters(env, env->num_reduce_workgroups);
+	run_phase(env, env->num_reduce_workgroups, reduce_group);
+}
+
+// Appends the job's results to the host array, like the read back of the device path
+void native_collect(mr_env_t* env, void** keyvals, size_t* num_keyvals)
+{
+	size_t keyval_size = env->args->keyval_size;
+	mr_emitter_t* results = env->native_map_out;
+	size_t count = env->num_workgroups;
+	size_t num = 0;
+
+	if(env->native_reduce_out != NULL)
+	{
+		results = env->native_reduce_out;
+		count = env->num_reduce_workgroups;
+	}
+	for(size_t i = 0; i < count; i++)
+		num += results[i].count;
+	*keyvals = realloc(*keyvals, keyval_size * (*num_keyvals + num));
+	char* keyval_ptr = (char*)*keyvals + keyval_size * *num_keyvals;
+	for(size_t i = 0; i < count; i++)
+	{
+		memcpy(keyval_ptr, results[i].data, results[i].count * keyval_size);
+		keyval_ptr += results[i].count * keyval_size;
+	}
+	*num_keyvals += num;
+}
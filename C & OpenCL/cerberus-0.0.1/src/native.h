@@ -0,0 +1,19 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_NATIVE_H_
+#define MAP_NATIVE_H_
+
+#include "map_reduce.h"
+
+mr_backend_t native_backend(mr_backend_t requested);
+mr_env_t* native_env_init(map_reduce_args_t* args);
+void native_env_fini(mr_env_t* env);
+void native_map(mr_env_t* env);
+void native_partition(void* input);
+void native_reduce(mr_env_t* env);
+void native_collect(mr_env_t* env, void** keyvals, size_t* num_keyvals);
+
+#endif
@@ -0,0 +1,185 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include "utils.h"
+
+/* Source prepended to every user kernel. It hides the differences between the
+ * launch modes of the runtime behind a few macros:
+ *
+ * MR_MAP_PARAMS / MR_REDUCE_PARAMS  - go last in the kernel parameter list, after
+ *                                     the aux argument if there is one
+ * TASKS_PER_MAP / TASKS_PER_REDUCE  - compile time constants, or kernel arguments
+ *                                     when the job sets runtime_tasks
+ * MR_GROUP_PROLOGUE(in, out, size)  - first statement of every kernel. With
+ *                                     single_launch all workgroups share one
+ *                                     NDRange and one buffer per argument, the
+ *                                     prologue moves the pointers and data size
+ *                                     to the workgroup's slice. Count kernels get
+ *                                     their counter the same way.
+ * MR_EMIT(out, counter, keyval)     - appends a keyval to the workgroup's map output.
+ *                                     counter is a __local uint the kernel zeroes.
+ *                                     With fused_map the slot comes from a global
+ *                                     cursor instead, keyvals past the capacity are
+ *                                     dropped and the runtime re-runs the workgroup
+ *                                     with room for all of them.
+ * MR_COMBINE_INIT()                 - with map_combine, declares the workgroup's
+ * MR_COMBINE_EMIT(out, counter, kv)   __local table of keys. MR_COMBINE_EMIT folds
+ * MR_COMBINE_FLUSH(out, counter)      the keyval into the table and only calls
+ *                                     MR_EMIT when the key finds no room there.
+ *                                     MR_COMBINE_FLUSH emits the table. INIT goes
+ *                                     at kernel scope and every workitem has to
+ *                                     reach INIT and FLUSH. Without map_combine
+ *                                     MR_COMBINE_EMIT is MR_EMIT.
+ */
+const char* kernel_preamble =
+	"#ifdef MR_RUNTIME_TASKS\n"
+	"#define TASKS_PER_MAP mr_tasks_per_map\n"
+	"#define TASKS_PER_REDUCE mr_tasks_per_reduce\n"
+	"#define MR_TASKS_MAP_PARAM , uint mr_tasks_per_map\n"
+	"#define MR_TASKS_REDUCE_PARAM , uint mr_tasks_per_reduce\n"
+	"#else\n"
+	"#define MR_TASKS_MAP_PARAM\n"
+	"#define MR_TASKS_REDUCE_PARAM\n"
+	"#endif\n"
+	"#if defined(MR_FUSED) || defined(MR_MAP_COMBINE)\n"
+	"#define MR_EMIT_PARAMS , __global uint* mr_cursor, uint mr_capacity, uint mr_group\n"
+	"#else\n"
+	"#define MR_EMIT_PARAMS\n"
+	"#endif\n"
+	"#ifdef MR_FUSED\n"
+	"#define MR_SLOT(counter) atomic_inc(&mr_cursor[mr_group + get_group_id(0)])\n"
+	"#define MR_FITS(slot) ((slot) < mr_capacity)\n"
+	"#else\n"
+	"#define MR_SLOT(counter) atomic_inc(&(counter))\n"
+	"#define MR_FITS(slot) true\n"
+	"#endif\n"
+	"#define MR_EMIT(output, counter, keyval) do { \\\n"
+	"	uint mr_slot = MR_SLOT(counter); \\\n"
+	"	if(MR_FITS(mr_slot)) \\\n"
+	"		(output)[mr_slot] = (keyval); \\\n"
+	"	} while(0)\n"
+	"#ifdef MR_MAP_COMBINE\n"
+	"#if defined(MR_COMBINE_MIN)\n"
+	"#define MR_COMBINE(p, v) atomic_min(p, v)\n"
+	"#elif defined(MR_COMBINE_MAX)\n"
+	"#define MR_COMBINE(p, v) atomic_max(p, v)\n"
+	"#else\n"
+	"#define MR_COMBINE(p, v) atomic_add(p, v)\n"
+	"#endif\n"
+	"// Slot states: empty, key being written, key readable\n"
+	"#define MR_SLOT_EMPTY 0\n"
+	"#define MR_SLOT_BUSY 1\n"
+	"#define MR_SLOT_READY 2\n"
+	"// Folds the keyval at kv into the table, false if its key found no room\n"
+	"bool mr_combine_local(__local uint* state, __local uint* value, __local uchar* keys,\n"
+	"	const uchar* kv)\n"
+	"{\n"
+	"	uint h = 2166136261u;\n"
+	"	uint len = MR_KEY_SIZE;\n"
+	"	for(uint i = 0; i < MR_KEY_SIZE; i++)\n"
+	"	{\n"
+	"#ifdef MR_STRING_KEY\n"
+	"		if(kv[i] == 0)\n"
+	"		{\n"
+	"			len = i + 1;\n"
+	"			break;\n"
+	"		}\n"
+	"#endif\n"
+	"		h = (h ^ kv[i]) * 16777619u;\n"
+	"	}\n"
+	"#ifdef MR_COMBINE_COUNT\n"
+	"	uint v = 1;\n"
+	"#else\n"
+	"	uint v = kv[MR_KEY_SIZE] | (kv[MR_KEY_SIZE + 1] << 8) | (kv[MR_KEY_SIZE + 2] << 16) |\n"
+	"		((uint)kv[MR_KEY_SIZE + 3] << 24);\n"
+	"#endif\n"
+	"	for(uint probe = 0; probe < MR_COMBINE_PROBES; probe++)\n"
+	"	{\n"
+	"		uint j = (h + probe) & (MR_COMBINE_SLOTS - 1);\n"
+	"		__local uchar* key = keys + j * MR_KEY_SIZE;\n"
+	"		uint s = atomic_cmpxchg(&state[j], MR_SLOT_EMPTY, MR_SLOT_BUSY);\n"
+	"		if(s == MR_SLOT_EMPTY)\n"
+	"		{\n"
+	"			for(uint i = 0; i < MR_KEY_SIZE; i++)\n"
+	"				key[i] = (i < len) ? kv[i] : 0;\n"
+	"			MR_COMBINE(&value[j], v);\n"
+	"			mem_fence(CLK_LOCAL_MEM_FENCE);\n"
+	"			atomic_xchg(&state[j], MR_SLOT_READY);\n"
+	"			return true;\n"
+	"		}\n"
+	"		// A slot that is still being written is skipped, at worst the key\n"
+	"		// ends up in the table twice\n"
+	"		if(s == MR_SLOT_READY)\n"
+	"		{\n"
+	"			uint i = 0;\n"
+	"			while(i < len && key[i] == kv[i])\n"
+	"				i++;\n"
+	"			if(i == len)\n"
+	"			{\n"
+	"				MR_COMBINE(&value[j], v);\n"
+	"				return true;\n"
+	"			}\n"
+	"		}\n"
+	"	}\n"
+	"	return false;\n"
+	"}\n"
+	"#define MR_COMBINE_INIT() \\\n"
+	"	__local uint mr_state[MR_COMBINE_SLOTS]; \\\n"
+	"	__local uint mr_value[MR_COMBINE_SLOTS]; \\\n"
+	"	__local uchar mr_keys[MR_COMBINE_SLOTS * MR_KEY_SIZE]; \\\n"
+	"	for(uint mr_j = get_local_id(0); mr_j < MR_COMBINE_SLOTS; mr_j += get_local_size(0)) \\\n"
+	"	{ \\\n"
+	"		mr_state[mr_j] = MR_SLOT_EMPTY; \\\n"
+	"		mr_value[mr_j] = MR_IDENTITY; \\\n"
+	"	} \\\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE)\n"
+	"#define MR_COMBINE_EMIT(output, counter, keyval) do { \\\n"
+	"	if(!mr_combine_local(mr_state, mr_value, mr_keys, (const uchar*)&(keyval))) \\\n"
+	"		MR_EMIT(output, counter, keyval); \\\n"
+	"	} while(0)\n"
+	"// Keyvals are written bytewise, padding after the value is zeroed. Without\n"
+	"// fused_map the group's keyval count goes to its cursor\n"
+	"#ifdef MR_FUSED\n"
+	"#define MR_COMBINE_COUNT_OUT(counter)\n"
+	"#else\n"
+	"#define MR_COMBINE_COUNT_OUT(counter) \\\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE); \\\n"
+	"	if(get_local_id(0) == 0) \\\n"
+	"		mr_cursor[mr_group + get_group_id(0)] = (counter)\n"
+	"#endif\n"
+	"#define MR_COMBINE_FLUSH(output, counter) \\\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE); \\\n"
+	"	for(uint mr_j = get_local_id(0); mr_j < MR_COMBINE_SLOTS; mr_j += get_local_size(0)) \\\n"
+	"	{ \\\n"
+	"		if(mr_state[mr_j] != MR_SLOT_READY) \\\n"
+	"			continue; \\\n"
+	"		uint mr_slot = MR_SLOT(counter); \\\n"
+	"		if(!MR_FITS(mr_slot)) \\\n"
+	"			continue; \\\n"
+	"		__global uchar* mr_out = (__global uchar*)((output) + mr_slot); \\\n"
+	"		for(uint mr_i = 0; mr_i < MR_KEYVAL_SIZE; mr_i++) \\\n"
+	"			mr_out[mr_i] = (mr_i < MR_KEY_SIZE) ? mr_keys[mr_j * MR_KEY_SIZE + mr_i] : \\\n"
+	"				(mr_i < MR_KEY_SIZE + 4) ? (mr_value[mr_j] >> (8 * (mr_i - MR_KEY_SIZE))) & 0xff : 0; \\\n"
+	"	} \\\n"
+	"	MR_COMBINE_COUNT_OUT(counter)\n"
+	"#else\n"
+	"#define MR_COMBINE_INIT()\n"
+	"#define MR_COMBINE_EMIT(output, counter, keyval) MR_EMIT(output, counter, keyval)\n"
+	"#define MR_COMBINE_FLUSH(output, counter)\n"
+	"#endif\n"
+	"#ifdef MR_PACKED\n"
+	"#define MR_GROUP_PARAMS , __global const uint* mr_in_offset, __global const uint* mr_in_size, \\\n"
+	"	__global const uint* mr_out_offset\n"
+	"#define MR_GROUP_PROLOGUE(input, output, data_size) \\\n"
+	"	input += mr_in_offset[get_group_id(0)] / sizeof(*(input)); \\\n"
+	"	output += mr_out_offset[get_group_id(0)] / sizeof(*(output)); \\\n"
+	"	data_size = mr_in_size[get_group_id(0)]\n"
+	"#else\n"
+	"#define MR_GROUP_PARAMS\n"
+	"#define MR_GROUP_PROLOGUE(input, output, data_size)\n"
+	"#endif\n"
+	"#define MR_MAP_PARAMS MR_TASKS_MAP_PARAM MR_EMIT_PARAMS MR_GROUP_PARAMS\n"
+	"#define MR_REDUCE_PARAMS MR_TASKS_REDUCE_PARAM MR_GROUP_PARAMS\n"
+	"#line 1\n";
@@ -0,0 +1,100 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include "stddefines.h"
+#include "utils.h"
+#include "profile.h"
+#include "trace.h"
+
+//==========================================//
+//											//
+// Per-command profiling					//
+//											//
+//==========================================//
+
+// args->profiling, or CERBERUS_PROFILE set to anything but 0
+bool profile_enabled(map_reduce_args_t* args)
+{
+	const char* env = getenv("CERBERUS_PROFILE");
+
+	if(env != NULL && env[0] != '\0')
+		return strcmp(env, "0") != 0;
+	return args->profiling;
+}
+
+// Returns where the next command enqueued on queue has to put its event, or NULL
+// when the job isn't profiled. The pointer is only valid until the next call.
+cl_event* profile_event(mr_env_t* env, cl_command_queue queue, mr_command_t type, const char* name,
+	long group)
+{
+	mr_profile_event_t* pending;
+
+	if(!env->profiling && !env->tracing)
+		return NULL;
+	if(env->num_profile_pending == env->profile_capacity)
+	{
+		env->profile_capacity = (env->profile_capacity > 0) ? env->profile_capacity * 2 : 256;
+		env->profile_events = (cl_event*)realloc(env->profile_events,
+												 sizeof(cl_event) * env->profile_capacity);
+		env->profile_pending = (mr_profile_event_t*)realloc(env->profile_pending,
+															sizeof(mr_profile_event_t) * env->profile_capacity);
+		env->profile_host = (cl_ulong*)realloc(env->profile_host, sizeof(cl_ulong) * env->profile_capacity);
+	}
+	pending = &env->profile_pending[env->num_profile_pending];
+	memset(pending, 0, sizeof(mr_profile_event_t));
+	pending->type = type;
+	pending->name = name;
+	pending->group = group;
+	for(cl_uint i = 0; i < env->num_queues; i++)
+	{
+		if(env->queues[i] == queue)
+			pending->queue = i;
+	}
+	if(env->tracing)
+		env->profile_host[env->num_profile_pending] = trace_now();
+	return &env->profile_events[env->num_profile_pending++];
+}
+
+// Reads the timestamps of the job's commands into args->profile and releases their
+// events. Every queue of the job has to be finished.
+void profile_collect(mr_env_t* env)
+{
+	cl_int error;
+
+	if(env->num_profile_pending == 0)
+		return;
+	mr_profile_t other;
+	other.events = env->profile_pending;
+	other.num_events = env->num_profile_pending;
+	for(size_t i = 0; i < other.num_events; i++)
+	{
+		mr_profile_event_t* event = &other.events[i];
+		error = clGetEventProfilingInfo(env->profile_events[i], CL_PROFILING_COMMAND_QUEUED,
+										sizeof(cl_ulong), &event->queued, NULL);
+		error |= clGetEventProfilingInfo(env->profile_events[i], CL_PROFILING_COMMAND_SUBMIT,
+										 sizeof(cl_ulong), &event->submit, NULL);
+		error |= clGetEventProfilingInfo(env->profile_events[i], CL_PROFILING_COMMAND_START,
+										 sizeof(cl_ulong), &event->start, NULL);
+		error |= clGetEventProfilingInfo(env->profile_events[i], CL_PROFILING_COMMAND_END,
+										 sizeof(cl_ulong), &event->end, NULL);
+		CL_ASSERT(error);
+		clReleaseEvent(env->profile_events[i]);
+	}
+	if(env->tracing)
+		trace_commands(env, other.events, env->profile_host, other.num_events);
+	if(env->profiling)
+		profile_append(&env->args->profile, &other);
+	env->num_profile_pending = 0;
+}
+
+void profile_append(mr_profile_t* profile, const mr_profile_t* other)
+{
+	if(other->num_events == 0)
+		return;
+	profile->events = (mr_profile_event_t*)realloc(profile->events,
+		sizeof(mr_profile_event_t) * (profile->num_events + other->num_events));
+	memcpy(profile->events + profile->num_events, other->events, sizeof(mr_profile_event_t) * other->num_events);
+	profile->num_events += other->num_events;
+}
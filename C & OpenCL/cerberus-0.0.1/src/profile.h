@@ -0,0 +1,17 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_PROFILE_H_
+#define MAP_PROFILE_H_
+
+#include "map_reduce.h"
+
+bool profile_enabled(map_reduce_args_t* args);
+cl_event* profile_event(mr_env_t* env, cl_command_queue queue, mr_command_t type, const char* name,
+	long group);
+void profile_collect(mr_env_t* env);
+void profile_append(mr_profile_t* profile, const mr_profile_t* other);
+
+#endif
@@ -0,0 +1,240 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "stddefines.h"
+#include "utils.h"
+#include "program_cache.h"
+
+//==========================================//
+//											//
+// Compiled program caches					//
+//											//
+//==========================================//
+
+#define CACHE_MAGIC "CERBERUS"
+// Kernels a runtime keeps. Without runtime_tasks every task count is a new build,
+// so sweeps over them would otherwise grow the list without bound
+#define CACHE_ENTRIES 64
+
+// 64-bit FNV-1a, good enough to tell sources and build options apart
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t len)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Cache directory from the environment or the job arguments, NULL if disabled
+static const char* cache_dir(mr_env_t* env)
+{
+	const char* dir = getenv("CERBERUS_KERNEL_CACHE");
+	// Binaries are stored for a single device
+	if(env->runtime->num_devices > 1)
+		return NULL;
+	if(dir == NULL)
+		dir = env->args->kernel_cache_dir;
+	if(dir[0] == '\0')
+		return NULL;
+	return dir;
+}
+
+static void cache_path(char* path, size_t len, const char* dir, const char* name, uint64_t key)
+{
+	snprintf(path, len, "%s/%s-%016llx.bin", dir, name, (unsigned long long)key);
+}
+
+// Key over everything that affects the compiled binary
+uint64_t program_cache_key(mr_env_t* env, const char* name, const char** sources, const size_t* sizes,
+						   cl_uint count, const char* flags)
+{
+	uint64_t key = 0xcbf29ce484222325ULL;
+	mr_device_info_t* info = &env->runtime->info;
+
+	// One source can hold several kernels, each entry is a single kernel
+	key = hash_bytes(key, name, strlen(name) + 1);
+	for(cl_uint i = 0; i < count; i++)
+		key = hash_bytes(key, sources[i], sizes[i]);
+	key = hash_bytes(key, flags, strlen(flags) + 1);
+	key = hash_bytes(key, info->name, strlen(info->name) + 1);
+	key = hash_bytes(key, info->driver_version, strlen(info->driver_version) + 1);
+	return key;
+}
+
+// Tries to create the program from a cached binary, returns NULL on any miss
+cl_program program_cache_load(mr_env_t* env, const char* name, uint64_t key, const char* flags)
+{
+	const char* dir = cache_dir(env);
+	char path[MAX_FILENAME * 2 + 64];
+	char magic[sizeof(CACHE_MAGIC)];
+	uint64_t file_key;
+	size_t size;
+	unsigned char* binary;
+	cl_program program;
+	cl_int status;
+	cl_int error;
+	FILE* file;
+
+	if(dir == NULL)
+		return NULL;
+	cache_path(path, sizeof(path), dir, name, key);
+	file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+
+	// Header guards against truncated files and hash collisions in the name
+	if(fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 ||
+	   fread(&file_key, sizeof(file_key), 1, file) != 1 || file_key != key ||
+	   fread(&size, sizeof(size), 1, file) != 1 || size == 0)
+	{
+		fclose(file);
+		return NULL;
+	}
+	binary = (unsigned char*)malloc(size);
+	if(fread(binary, size, 1, file) != 1)
+	{
+		fclose(file);
+		free(binary);
+		return NULL;
+	}
+	fclose(file);
+
+	program = clCreateProgramWithBinary(env->device_context, 1, &env->device, &size,
+										(const unsigned char**)&binary, &status, &error);
+	free(binary);
+	if(error != CL_SUCCESS || status != CL_SUCCESS)
+		return NULL;
+	// Binaries still need a build call, but it doesn't invoke the compiler
+	error = clBuildProgram(program, 1, &env->device, flags, NULL, NULL);
+	if(error != CL_SUCCESS)
+	{
+		clReleaseProgram(program);
+		return NULL;
+	}
+	fprintf(stderr, "Kernel %s loaded from cache\n", name);
+	return program;
+}
+
+// Writes the device binary of a freshly built program to the cache directory
+void program_cache_store(mr_env_t* env, const char* name, uint64_t key, cl_program program)
+{
+	const char* dir = cache_dir(env);
+	char path[MAX_FILENAME * 2 + 64];
+	char tmp_path[MAX_FILENAME * 2 + 96];
+	size_t size;
+	unsigned char* binary;
+	cl_int error;
+	FILE* file;
+
+	if(dir == NULL)
+		return;
+	error = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL);
+	if(error != CL_SUCCESS || size == 0)
+		return;
+	binary = (unsigned char*)malloc(size);
+	error = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL);
+	if(error != CL_SUCCESS)
+	{
+		free(binary);
+		return;
+	}
+
+	mkdir(dir, 0755);
+	cache_path(path, sizeof(path), dir, name, key);
+	// Write to a private file first so concurrent jobs never see partial binaries
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+	file = fopen(tmp_path, "wb");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Cannot write kernel cache file %s\n", tmp_path);
+		free(binary);
+		return;
+	}
+	if(fwrite(CACHE_MAGIC, sizeof(CACHE_MAGIC), 1, file) != 1 ||
+	   fwrite(&key, sizeof(key), 1, file) != 1 ||
+	   fwrite(&size, sizeof(size), 1, file) != 1 ||
+	   fwrite(binary, size, 1, file) != 1)
+	{
+		fclose(file);
+		remove(tmp_path);
+		free(binary);
+		return;
+	}
+	fclose(file);
+	if(rename(tmp_path, path) != 0)
+		remove(tmp_path);
+	free(binary);
+}
+
+static void release_entry(mr_program_entry_t* entry)
+{
+	cl_int error;
+
+	error = clReleaseKernel(entry->kernel);
+	CL_ASSERT(error);
+	error = clReleaseProgram(entry->program);
+	CL_ASSERT(error);
+	free(entry);
+}
+
+// Looks the key up in the kernels built by this runtime and moves a hit to the front
+bool program_cache_find(mr_runtime_t* runtime, uint64_t key, cl_program* program, cl_kernel* kernel)
+{
+	for(mr_program_entry_t** link = &runtime->programs; *link != NULL; link = &(*link)->next)
+	{
+		mr_program_entry_t* entry = *link;
+		if(entry->key == key)
+		{
+			*link = entry->next;
+			entry->next = runtime->programs;
+			runtime->programs = entry;
+			*program = entry->program;
+			*kernel = entry->kernel;
+			return true;
+		}
+	}
+	return false;
+}
+
+// The runtime takes ownership of the program and kernel. Past CACHE_ENTRIES the
+// least recently used kernel is released, the current job's ones are all newer
+void program_cache_add(mr_runtime_t* runtime, uint64_t key, cl_program program, cl_kernel kernel)
+{
+	mr_program_entry_t* entry = (mr_program_entry_t*)malloc(sizeof(mr_program_entry_t));
+	entry->key = key;
+	entry->program = program;
+	entry->kernel = kernel;
+	entry->next = runtime->programs;
+	runtime->programs = entry;
+	if(++runtime->num_programs > CACHE_ENTRIES)
+	{
+		mr_program_entry_t** link = &runtime->programs;
+		while((*link)->next != NULL)
+			link = &(*link)->next;
+		release_entry(*link);
+		*link = NULL;
+		runtime->num_programs--;
+	}
+}
+
+void program_cache_clear(mr_runtime_t* runtime)
+{
+	mr_program_entry_t* entry = runtime->programs;
+
+	while(entry != NULL)
+	{
+		mr_program_entry_t* next = entry->next;
+		release_entry(entry);
+		entry = next;
+	}
+	runtime->programs = NULL;
+	runtime->num_programs = 0;
+}
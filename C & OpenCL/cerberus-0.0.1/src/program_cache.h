@@ -0,0 +1,19 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_PROGRAM_CACHE_H_
+#define MAP_PROGRAM_CACHE_H_
+
+#include "map_reduce.h"
+
+uint64_t program_cache_key(mr_env_t* env, const char* name, const char** sources, const size_t* sizes,
+	cl_uint count, const char* flags);
+cl_program program_cache_load(mr_env_t* env, const char* name, uint64_t key, const char* flags);
+void program_cache_store(mr_env_t* env, const char* name, uint64_t key, cl_program program);
+bool program_cache_find(mr_runtime_t* runtime, uint64_t key, cl_program* program, cl_kernel* kernel);
+void program_cache_add(mr_runtime_t* runtime, uint64_t key, cl_program program, cl_kernel kernel);
+void program_cache_clear(mr_runtime_t* runtime);
+
+#endif
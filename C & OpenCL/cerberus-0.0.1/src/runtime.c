@@ -0,0 +1,278 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include "stddefines.h"
+#include "utils.h"
+#include "runtime.h"
+#include "program_cache.h"
+#include "buffer_pool.h"
+#include "stats.h"
+
+//==========================================//
+//											//
+// Long-lived OpenCL state					//
+//											//
+//==========================================//
+
+// Queries the device properties used by the scheduler once, so jobs don't have to
+static void query_device_info(cl_device_id device, mr_device_info_t* info)
+{
+	cl_int error;
+
+	error = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(info->name), info->name, NULL);
+	error |= clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(info->driver_version),
+							 info->driver_version, NULL);
+	error |= clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(info->type), &info->type, NULL);
+	error |= clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(info->num_compute_units),
+							 &info->num_compute_units, NULL);
+	error |= clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(info->local_mem_size),
+							 &info->local_mem_size, NULL);
+	error |= clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(info->global_mem_size),
+							 &info->global_mem_size, NULL);
+	error |= clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(info->max_alloc_size),
+							 &info->max_alloc_size, NULL);
+	error |= clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(info->max_workitems),
+							 &info->max_workitems, NULL);
+	error |= clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(info->mem_base_align),
+							 &info->mem_base_align, NULL);
+	error |= clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(info->host_unified_memory),
+							 &info->host_unified_memory, NULL);
+	CL_ASSERT(error);
+	// Reported in bits, sub-buffer origins are in bytes
+	info->mem_base_align /= 8;
+
+	fprintf(stderr, "Device: %s (%s)\n", info->name, info->driver_version);
+	fprintf(stderr, "Max compute units: %u\n", info->num_compute_units);
+	fprintf(stderr, "Local mem size: %lu\n", (unsigned long)info->local_mem_size);
+	fprintf(stderr, "Global mem size: %lu\n", (unsigned long)info->global_mem_size);
+	fprintf(stderr, "Host unified memory: %s\n", info->host_unified_memory ? "yes" : "no");
+	fprintf(stderr, "Max workgroup size: %zu\n", info->max_workitems);
+}
+
+// Keeps the limits every device of a sharded context can meet
+static void merge_device_info(mr_device_info_t* info, const mr_device_info_t* other)
+{
+	info->num_compute_units += other->num_compute_units;
+	if(other->local_mem_size < info->local_mem_size)
+		info->local_mem_size = other->local_mem_size;
+	if(other->global_mem_size < info->global_mem_size)
+		info->global_mem_size = other->global_mem_size;
+	if(other->max_alloc_size < info->max_alloc_size)
+		info->max_alloc_size = other->max_alloc_size;
+	if(other->max_workitems < info->max_workitems)
+		info->max_workitems = other->max_workitems;
+	if(other->mem_base_align > info->mem_base_align)
+		info->mem_base_align = other->mem_base_align;
+	info->host_unified_memory = info->host_unified_memory && other->host_unified_memory;
+}
+
+// Sub-devices are reference counted, root devices ignore the release
+static void release_devices(const cl_device_id* devices, cl_uint count)
+{
+	for(cl_uint i = 0; i < count; i++)
+		clReleaseDevice(devices[i]);
+}
+
+// Creates one context over the devices of a platform and a command queue on the
+// first one, takes over sub-devices. They are released when it fails
+static mr_runtime_t* runtime_open(cl_platform_id platform, const cl_device_id* devices, cl_uint count)
+{
+	mr_runtime_t* runtime;
+	cl_int error;
+
+	runtime = (mr_runtime_t*)malloc(sizeof(mr_runtime_t));
+	if(runtime == NULL)
+	{
+		release_devices(devices, count);
+		return NULL;
+	}
+	memset(runtime, 0, sizeof(mr_runtime_t));
+	runtime->mem = stats_counters_create();
+	if(runtime->mem == NULL)
+	{
+		release_devices(devices, count);
+		free(runtime);
+		return NULL;
+	}
+	runtime->platform = platform;
+	runtime->device = devices[0];
+	runtime->num_devices = count;
+	memcpy(runtime->devices, devices, sizeof(cl_device_id) * count);
+	query_device_info(runtime->device, &runtime->info);
+	for(cl_uint i = 1; i < count; i++)
+	{
+		mr_device_info_t info;
+		query_device_info(devices[i], &info);
+		merge_device_info(&runtime->info, &info);
+	}
+
+	runtime->context = clCreateContext(NULL, count, runtime->devices, NULL, NULL, &error);
+	if(error)
+	{
+		fprintf(stderr, "Error creating context %d\n", error);
+		release_devices(devices, count);
+		stats_counters_release(runtime->mem);
+		free(runtime);
+		return NULL;
+	}
+	runtime->queue = clCreateCommandQueue(runtime->context, runtime->device, 0, &error);
+	if(error)
+	{
+		fprintf(stderr, "Error creating command queue %d\n", error);
+		clReleaseContext(runtime->context);
+		release_devices(devices, count);
+		stats_counters_release(runtime->mem);
+		free(runtime);
+		return NULL;
+	}
+	runtime->queues = (cl_command_queue*)malloc(sizeof(cl_command_queue));
+	runtime->queues[0] = runtime->queue;
+	runtime->num_queues = 1;
+
+	return runtime;
+}
+
+// Selects a device and creates the context and command queue for it
+mr_runtime_t* runtime_create(const mr_device_policy_t* policy)
+{
+	cl_platform_id platform;
+	cl_device_id device;
+	cl_int error;
+
+	error = oclSelectDevice(policy, &platform, &device);
+	if(error)
+	{
+		fprintf(stderr, "Error selecting OpenCL device %d\n", error);
+		return NULL;
+	}
+	return runtime_open(platform, &device, 1);
+}
+
+// Creates a runtime for each device that matches the policy, see oclListDevices().
+// Returns how many were written to runtimes.
+cl_uint runtime_create_all(const mr_device_policy_t* policy, cl_uint sub_devices, mr_runtime_t** runtimes,
+						   cl_uint max)
+{
+	cl_platform_id* platforms = (cl_platform_id*)malloc(sizeof(cl_platform_id) * max);
+	cl_device_id* devices = (cl_device_id*)malloc(sizeof(cl_device_id) * max);
+	cl_uint found = oclListDevices(policy, sub_devices, platforms, devices, max);
+	cl_uint count = 0;
+
+	for(cl_uint i = 0; i < found; i++)
+	{
+		runtimes[count] = runtime_open(platforms[i], &devices[i], 1);
+		if(runtimes[count] != NULL)
+			count++;
+	}
+	free(platforms);
+	free(devices);
+	return count;
+}
+
+// Creates one runtime over every device that matches the policy on the platform of
+// the first one, for sharding the workgroups of a job over them
+mr_runtime_t* runtime_create_sharded(const mr_device_policy_t* policy, cl_uint sub_devices)
+{
+	cl_platform_id platforms[MR_MAX_DEVICES];
+	cl_device_id devices[MR_MAX_DEVICES];
+	cl_uint found = oclListDevices(policy, sub_devices, platforms, devices, MR_MAX_DEVICES);
+	cl_uint count = 0;
+
+	if(found == 0)
+	{
+		fprintf(stderr, "No OpenCL device to shard over\n");
+		return NULL;
+	}
+	// A context can't span platforms
+	for(cl_uint i = 0; i < found; i++)
+	{
+		if(platforms[i] == platforms[0])
+			devices[count++] = devices[i];
+		else
+			clReleaseDevice(devices[i]);
+	}
+	fprintf(stderr, "Sharding over %u devices\n", count);
+	return runtime_open(platforms[0], devices, count);
+}
+
+void runtime_release(mr_runtime_t* runtime)
+{
+	cl_int error;
+
+	if(runtime == NULL)
+		return;
+	program_cache_clear(runtime);
+	pool_clear(runtime);
+	/* Release command queues and context last */
+	for(cl_uint i = 1; i < runtime->num_queues; i++)
+	{
+		error = clReleaseCommandQueue(runtime->queues[i]);
+		CL_ASSERT(error);
+	}
+	free(runtime->queues);
+	for(cl_uint i = 0; i < runtime->num_profiling_queues; i++)
+	{
+		error = clReleaseCommandQueue(runtime->profiling_queues[i]);
+		CL_ASSERT(error);
+	}
+	free(runtime->profiling_queues);
+	error = clReleaseCommandQueue(runtime->queue);
+	CL_ASSERT(error);
+	error = clReleaseContext(runtime->context);
+	CL_ASSERT(error);
+	release_devices(runtime->devices, runtime->num_devices);
+	// Destructor callbacks of buffers still alive hold their own reference
+	stats_counters_release(runtime->mem);
+	free(runtime);
+}
+
+// Grows a set of in-order queues to count, queue i on device i of the context
+static void grow_queues(mr_runtime_t* runtime, cl_command_queue** queues, cl_uint* num_queues,
+						cl_uint count, cl_command_queue_properties properties)
+{
+	cl_int error;
+
+	if(count <= *num_queues)
+		return;
+	*queues = (cl_command_queue*)realloc(*queues, sizeof(cl_command_queue) * count);
+	for(cl_uint i = *num_queues; i < count; i++)
+	{
+		(*queues)[i] = clCreateCommandQueue(runtime->context, runtime->devices[i % runtime->num_devices],
+											properties, &error);
+		CL_ASSERT(error);
+	}
+	*num_queues = count;
+}
+
+// Makes sure the runtime has at least count in-order queues, queue i on device i of
+// the context, and returns them. The first one is always the main queue.
+cl_command_queue* runtime_queues(mr_runtime_t* runtime, cl_uint count)
+{
+	grow_queues(runtime, &runtime->queues, &runtime->num_queues, count, 0);
+	return runtime->queues;
+}
+
+// Same as runtime_queues() for a separate set of queues with profiling enabled,
+// so jobs that don't profile don't pay for it
+cl_command_queue* runtime_profiling_queues(mr_runtime_t* runtime, cl_uint count)
+{
+	grow_queues(runtime, &runtime->profiling_queues, &runtime->num_profiling_queues, count,
+				CL_QUEUE_PROFILING_ENABLE);
+	return runtime->profiling_queues;
+}
+
+// Checks whether a job with the given policy can run on an existing runtime
+bool runtime_matches(mr_runtime_t* runtime, const mr_device_policy_t* policy)
+{
+	cl_platform_id platform;
+	cl_device_id device;
+
+	// The default policy is what the runtime was created with
+	if(policy->type == 0 && policy->platform[0] == '\0' && policy->device[0] == '\0')
+		return true;
+	if(oclSelectDevice(policy, &platform, &device) != CL_SUCCESS)
+		return false;
+	return device == runtime->device;
+}
@@ -0,0 +1,20 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_RUNTIME_H_
+#define MAP_RUNTIME_H_
+
+#include "map_reduce.h"
+
+mr_runtime_t* runtime_create(const mr_device_policy_t* policy);
+cl_uint runtime_create_all(const mr_device_policy_t* policy, cl_uint sub_devices, mr_runtime_t** runtimes,
+	cl_uint max);
+void runtime_release(mr_runtime_t* runtime);
+mr_runtime_t* runtime_create_sharded(const mr_device_policy_t* policy, cl_uint sub_devices);
+cl_command_queue* runtime_queues(mr_runtime_t* runtime, cl_uint count);
+cl_command_queue* runtime_profiling_queues(mr_runtime_t* runtime, cl_uint count);
+bool runtime_matches(mr_runtime_t* runtime, const mr_device_policy_t* policy);
+
+#endif
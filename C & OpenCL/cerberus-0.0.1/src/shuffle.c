@@ -0,0 +1,228 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include "stddefines.h"
+#include "utils.h"
+#include "builtins.h"
+#include "shuffle.h"
+#include "buffer_pool.h"
+#include "profile.h"
+
+//==========================================//
+//											//
+// Device-side sort-by-key shuffle			//
+//											//
+//==========================================//
+
+// Workgroup size of the sort kernels and records handled by each workgroup
+#define SORT_ITEMS 256
+#define SORT_TILE (SORT_ITEMS * 16)
+
+// Copies every map output into one buffer, returns it and the number of keyvals
+cl_mem gather_keyvals(mr_env_t* env, size_t* num_keyvals)
+{
+	cl_int error;
+	size_t keyval_size = env->args->keyval_size;
+	size_t num = 0;
+	size_t offset = 0;
+
+	for(size_t i = 0; i < env->num_workgroups; i++)
+		num += env->map_array_size[i];
+	cl_mem keyvals = pool_acquire(env->runtime, CL_MEM_READ_WRITE,
+								  (num > 0) ? num * keyval_size : keyval_size);
+	for(size_t i = 0; i < env->num_workgroups; i++)
+	{
+		if(env->map_array_size[i] > 0)
+		{
+			error = clEnqueueCopyBuffer(env->device_queue, env->map_array[i], keyvals, 0, offset,
+										env->map_array_size[i] * keyval_size, 0, NULL,
+										profile_event(env, env->device_queue, MR_CMD_COPY, "gather", i));
+			CL_ASSERT(error);
+		}
+		offset += env->map_array_size[i] * keyval_size;
+	}
+	clFinish(env->device_queue);
+	for(size_t i = 0; i < env->num_workgroups; i++)
+		pool_release(env->runtime, env->map_array[i]);
+
+	*num_keyvals = num;
+	return keyvals;
+}
+
+// Radix sorts num keyvals, returns the buffer holding the result (one of the two)
+static cl_mem sort_keyvals(mr_env_t* env, cl_mem keyvals, cl_mem temp, size_t num)
+{
+	cl_int error;
+	char flags[256];
+	cl_program program;
+	cl_kernel histogram;
+	cl_kernel scan;
+	cl_kernel scatter;
+	bool int_keys = (env->args->shuffle == MR_SHUFFLE_INT);
+	// Byte keys default to the whole keyval
+	size_t key_size = (env->args->key_size > 0) ? env->args->key_size : env->args->keyval_size;
+	cl_uint passes = int_keys ? 4 : key_size;
+	cl_uint count = num;
+	cl_uint tiles = (num + SORT_TILE - 1) / SORT_TILE;
+	cl_uint num_bins = 256 * tiles;
+	size_t items = SORT_ITEMS;
+	size_t global = tiles * items;
+
+	snprintf(flags, sizeof(flags), "-D MR_KEYVAL_SIZE=%zu -D MR_KEY_SIZE=%zu -D MR_SORT_ITEMS=%d "
+			 "-D MR_SORT_TILE=%d %s", env->args->keyval_size, key_size, SORT_ITEMS,
+			 SORT_TILE, int_keys ? "-D MR_SORT_INT" : "");
+	create_kernel_from_source(env, "mr_sort_histogram", sort_source, strlen(sort_source), &program,
+							  &histogram, flags);
+	create_kernel_from_source(env, "mr_sort_scan", sort_source, strlen(sort_source), &program,
+							  &scan, flags);
+	create_kernel_from_source(env, "mr_sort_scatter", sort_source, strlen(sort_source), &program,
+							  &scatter, flags);
+
+	cl_mem hist = pool_acquire(env->runtime, CL_MEM_READ_WRITE, sizeof(cl_uint) * num_bins);
+	for(cl_uint pass = 0; pass < passes; pass++)
+	{
+		error = clSetKernelArg(histogram, 0, sizeof(keyvals), (void*)&keyvals);
+		error |= clSetKernelArg(histogram, 1, sizeof(hist), (void*)&hist);
+		error |= clSetKernelArg(histogram, 2, sizeof(count), (void*)&count);
+		error |= clSetKernelArg(histogram, 3, sizeof(pass), (void*)&pass);
+		error |= clSetKernelArg(scan, 0, sizeof(hist), (void*)&hist);
+		error |= clSetKernelArg(scan, 1, sizeof(num_bins), (void*)&num_bins);
+		error |= clSetKernelArg(scatter, 0, sizeof(keyvals), (void*)&keyvals);
+		error |= clSetKernelArg(scatter, 1, sizeof(temp), (void*)&temp);
+		error |= clSetKernelArg(scatter, 2, sizeof(hist), (void*)&hist);
+		error |= clSetKernelArg(scatter, 3, sizeof(count), (void*)&count);
+		error |= clSetKernelArg(scatter, 4, sizeof(pass), (void*)&pass);
+		CL_ASSERT(error);
+
+		error = clEnqueueNDRangeKernel(env->device_queue, histogram, 1, NULL, &global, &items, 0,
+									   NULL,
+									   profile_event(env, env->device_queue, MR_CMD_KERNEL, "sort_histogram", -1));
+		error |= clEnqueueNDRangeKernel(env->device_queue, scan, 1, NULL, &items, &items, 0, NULL,
+			profile_event(env, env->device_queue, MR_CMD_KERNEL, "sort_scan", -1));
+		error |= clEnqueueNDRangeKernel(env->device_queue, scatter, 1, NULL, &global, &items, 0,
+										NULL,
+										profile_event(env, env->device_queue, MR_CMD_KERNEL, "sort_scatter", -1));
+		CL_ASSERT(error);
+
+		// The output of this pass is the input of the next one
+		cl_mem swap = keyvals;
+		keyvals = temp;
+		temp = swap;
+	}
+	clFinish(env->device_queue);
+	pool_release(env->runtime, hist);
+	return keyvals;
+}
+
+// Records read back per step when looking for a key change
+#define BOUNDARY_WINDOW 64
+
+// Returns the first record at or after cut whose key differs from the one of record
+// cut - 1, or num when the key runs to the end of the sorted keyvals
+static size_t key_boundary(mr_env_t* env, cl_mem keyvals, size_t num, size_t cut, size_t key_size,
+						   int group)
+{
+	cl_int error;
+	size_t keyval_size = env->args->keyval_size;
+
+	if(cut == 0 || cut >= num)
+		return (cut < num) ? cut : num;
+	char* window = (char*)malloc(BOUNDARY_WINDOW * keyval_size);
+	char* key = (char*)malloc(key_size);
+	size_t first = cut - 1;
+	size_t boundary = num;
+	while(first < num && boundary == num)
+	{
+		size_t count = (num - first < BOUNDARY_WINDOW) ? num - first : BOUNDARY_WINDOW;
+		error = clEnqueueReadBuffer(env->device_queue, keyvals, CL_TRUE, first * keyval_size,
+									count * keyval_size, window, 0, NULL,
+									profile_event(env, env->device_queue, MR_CMD_READ, "shuffle_boundary", group));
+		CL_ASSERT(error);
+		env->stats.bytes_downloaded += count * keyval_size;
+		size_t j = 0;
+		if(first == cut - 1)
+		{
+			memcpy(key, window, key_size);
+			j = 1;
+		}
+		for(; j < count; j++)
+		{
+			if(memcmp(window + j * keyval_size, key, key_size) != 0)
+			{
+				boundary = first + j;
+				break;
+			}
+		}
+		first += count;
+	}
+	free(key);
+	free(window);
+	return boundary;
+}
+
+// Replaces the partitioner when args->shuffle is set. Sorts all map output by key
+// on the device and hands contiguous, sorted slices to the reduce workgroups. Every
+// cut is moved forward to the next key change, so each key lands in exactly one slice.
+void sort_partition(mr_env_t* env)
+{
+	cl_int error;
+	size_t keyval_size = env->args->keyval_size;
+	size_t align = env->runtime->info.mem_base_align;
+	// Integer keys are the first 4 bytes, byte keys default to the whole keyval
+	size_t key_size = (env->args->shuffle == MR_SHUFFLE_INT) ? sizeof(cl_int) :
+		(env->args->key_size > 0) ? env->args->key_size : keyval_size;
+	size_t num;
+
+	cl_mem keyvals = gather_keyvals(env, &num);
+	if(num > 1)
+	{
+		cl_mem temp = pool_acquire(env->runtime, CL_MEM_READ_WRITE, num * keyval_size);
+		cl_mem sorted = sort_keyvals(env, keyvals, temp, num);
+		pool_release(env->runtime, (sorted == keyvals) ? temp : keyvals);
+		keyvals = sorted;
+	}
+
+	// Slice length in records, rounded so slices not moved by a key can be sub-buffers
+	size_t step = lcm(align, keyval_size) / keyval_size;
+	size_t per_group = div_round_up(num, env->num_reduce_workgroups);
+	per_group = (per_group + step - 1) / step * step;
+	env->num_reduce_workgroups = (num > 0) ? div_round_up(num, per_group) : 1;
+	size_t first = 0;
+	for(size_t i = 0; i < env->num_reduce_workgroups; i++)
+	{
+		size_t cut = (i + 1) * per_group;
+		size_t last = (i + 1 < env->num_reduce_workgroups) ?
+			key_boundary(env, keyvals, num, (cut > first) ? cut : first, key_size, i) : num;
+		if(last == first)
+		{
+			// A long key swallowed the whole slice
+			env->merged_map_array[i] = pool_acquire(env->runtime, CL_MEM_READ_WRITE, keyval_size);
+		}
+		else if((first * keyval_size) % align == 0)
+		{
+			cl_buffer_region region;
+			region.origin = first * keyval_size;
+			region.size = (last - first) * keyval_size;
+			env->merged_map_array[i] = clCreateSubBuffer(keyvals, 0, CL_BUFFER_CREATE_TYPE_REGION,
+														 &region, &error);
+			CL_ASSERT(error);
+		}
+		else
+		{
+			// The origin a key moved the cut to is misaligned, so the slice needs its own copy
+			env->merged_map_array[i] = pool_acquire(env->runtime, CL_MEM_READ_WRITE,
+													(last - first) * keyval_size);
+			error = clEnqueueCopyBuffer(env->device_queue, keyvals, env->merged_map_array[i],
+										first * keyval_size, 0, (last - first) * keyval_size, 0, NULL,
+										profile_event(env, env->device_queue, MR_CMD_COPY, "shuffle_slice", i));
+			CL_ASSERT(error);
+		}
+		env->reduce_data_size[i] = (last - first) * keyval_size;
+		first = last;
+	}
+	clFinish(env->device_queue);
+	// The sub-buffer slices live in the sorted buffer, env_fini() hands it back after them
+	env->sorted = keyvals;
+}
@@ -0,0 +1,15 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_SHUFFLE_H_
+#define MAP_SHUFFLE_H_
+
+#include "map_reduce.h"
+
+// Copies every map output into one buffer and releases the per-group ones
+cl_mem gather_keyvals(mr_env_t* env, size_t* num_keyvals);
+void sort_partition(mr_env_t* env);
+
+#endif
@@ -0,0 +1,210 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <pthread.h>
+#include <string.h>
+#include "stddefines.h"
+#include "utils.h"
+#include "stats.h"
+#include "trace.h"
+
+//==========================================//
+//											//
+// Per-job counters							//
+//											//
+//==========================================//
+
+static const char* phase_names[MR_NUM_PHASES] = {
+	"init", "splitter", "map input buffers", "map count", "map output buffers", "map",
+	"map phase", "partition", "reduce count", "reduce", "reduce phase", "combine", "shuffle",
+	"read back", "finalize", "merger"
+};
+
+// Guards args->stats, which co-executed devices share, and the memory counters of
+// every runtime, which OpenCL updates from its own threads
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char* map_reduce_phase_name(mr_phase_t phase)
+{
+	return (phase < MR_NUM_PHASES) ? phase_names[phase] : "unknown";
+}
+
+// Drops the counters of the previous job and starts on args
+void stats_begin(map_reduce_args_t* args)
+{
+	mr_stats_t* stats = args->stats;
+
+	if(stats == NULL)
+		return;
+	free(stats->map_tuples);
+	free(stats->reduce_tuples);
+	memset(stats, 0, sizeof(mr_stats_t));
+	stats->input_bytes = args->data_size;
+}
+
+// Adds a phase to the job's stats and trace
+void stats_phase(map_reduce_args_t* args, mr_phase_t phase, const struct timeval* begin,
+	const struct timeval* end)
+{
+	if(args->stats != NULL)
+	{
+		long us = (end->tv_sec - begin->tv_sec) * 1000000L + (end->tv_usec - begin->tv_usec);
+		pthread_mutex_lock(&stats_lock);
+		args->stats->phase_us[phase] += us;
+		pthread_mutex_unlock(&stats_lock);
+	}
+	trace_host(args, phase_names[phase], begin, end);
+}
+
+// Drops a reference to the counters, the last one frees them. Call with stats_lock held
+static void counters_unref(mr_mem_counters_t* mem)
+{
+	if(--mem->refs == 0)
+		free(mem);
+}
+
+// May run on an OpenCL thread after the runtime was released, so it only touches
+// the counters the buffer holds a reference to
+static void CL_CALLBACK buffer_released(cl_mem mem, void* user_data)
+{
+	mr_mem_counters_t* counters = (mr_mem_counters_t*)user_data;
+	size_t size = 0;
+
+	clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size), &size, NULL);
+	pthread_mutex_lock(&stats_lock);
+	counters->live -= size;
+	counters_unref(counters);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+// Memory counters of a new runtime, with the runtime's reference
+mr_mem_counters_t* stats_counters_create(void)
+{
+	mr_mem_counters_t* mem = (mr_mem_counters_t*)calloc(1, sizeof(mr_mem_counters_t));
+	if(mem != NULL)
+		mem->refs = 1;
+	return mem;
+}
+
+// Drops the runtime's reference, buffers not destroyed yet keep the counters alive
+void stats_counters_release(mr_mem_counters_t* mem)
+{
+	if(mem == NULL)
+		return;
+	pthread_mutex_lock(&stats_lock);
+	counters_unref(mem);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+// Counts a buffer just created in the runtime's context until it is released.
+// Buffers on host memory the application owns don't count.
+void stats_buffer(mr_runtime_t* runtime, cl_mem mem)
+{
+	cl_int error;
+	cl_mem_flags flags;
+	size_t size;
+	mr_mem_counters_t* counters = runtime->mem;
+
+	error = clGetMemObjectInfo(mem, CL_MEM_FLAGS, sizeof(flags), &flags, NULL);
+	error |= clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size), &size, NULL);
+	CL_ASSERT(error);
+	if(flags & CL_MEM_USE_HOST_PTR)
+		return;
+	pthread_mutex_lock(&stats_lock);
+	counters->created += size;
+	counters->live += size;
+	if(counters->live > counters->peak)
+		counters->peak = counters->live;
+	counters->refs++;
+	pthread_mutex_unlock(&stats_lock);
+	error = clSetMemObjectDestructorCallback(mem, buffer_released, counters);
+	CL_ASSERT(error);
+}
+
+// Starts the memory counters of the job, its runtime runs nothing else meanwhile
+void stats_start(mr_env_t* env)
+{
+	pthread_mutex_lock(&stats_lock);
+	env->runtime->mem->peak = env->runtime->mem->live;
+	env->mem_created = env->runtime->mem->created;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static size_t* append_counts(size_t* array, size_t num, const size_t* other, size_t num_other)
+{
+	if(num_other == 0)
+		return array;
+	array = (size_t*)realloc(array, sizeof(size_t) * (num + num_other));
+	memcpy(array + num, other, sizeof(size_t) * num_other);
+	return array;
+}
+
+// Records the keyvals of every map workgroup, once the map phase is done. The
+// native partitioner takes the emitters apart, so its map has to call this.
+void stats_map_tuples(mr_env_t* env)
+{
+	mr_stats_t* own = &env->stats;
+
+	if(env->args->stats == NULL || own->map_tuples != NULL)
+		return;
+	own->num_map_groups = env->num_workgroups;
+	own->map_tuples = (size_t*)malloc(sizeof(size_t) * own->num_map_groups);
+	for(size_t i = 0; i < own->num_map_groups; i++)
+	{
+		own->map_tuples[i] = (env->native_map_out != NULL) ? env->native_map_out[i].count :
+			env->map_array_size[i];
+	}
+}
+
+// Adds the counters of a finished job, or of one of its rounds or devices, to
+// args->stats
+void stats_collect(mr_env_t* env)
+{
+	mr_stats_t* stats = env->args->stats;
+	mr_stats_t* own = &env->stats;
+
+	if(stats == NULL)
+		return;
+	stats_map_tuples(env);
+	// Without a reduce function the native backend has no reduce groups
+	if(env->native_map_out == NULL || env->native_reduce_out != NULL)
+	{
+		own->num_reduce_groups = env->num_reduce_workgroups;
+		own->reduce_tuples = (size_t*)malloc(sizeof(size_t) * own->num_reduce_groups);
+		for(size_t i = 0; i < own->num_reduce_groups; i++)
+		{
+			own->reduce_tuples[i] = (env->native_reduce_out != NULL) ?
+				env->native_reduce_out[i].count : env->reduce_array_size[i];
+		}
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	if(env->runtime != NULL)
+	{
+		own->buffer_bytes = env->runtime->mem->created - env->mem_created;
+		own->peak_device_bytes = env->runtime->mem->peak;
+	}
+	stats->bytes_uploaded += own->bytes_uploaded;
+	stats->bytes_downloaded += own->bytes_downloaded;
+	stats->map_tuples = append_counts(stats->map_tuples, stats->num_map_groups, own->map_tuples,
+									  own->num_map_groups);
+	stats->num_map_groups += own->num_map_groups;
+	stats->reduce_tuples = append_counts(stats->reduce_tuples, stats->num_reduce_groups,
+										 own->reduce_tuples, own->num_reduce_groups);
+	stats->num_reduce_groups += own->num_reduce_groups;
+	stats->buffer_bytes += own->buffer_bytes;
+	if(own->peak_device_bytes > stats->peak_device_bytes)
+		stats->peak_device_bytes = own->peak_device_bytes;
+	stats->kernels_built += own->kernels_built;
+	stats->kernels_loaded += own->kernels_loaded;
+	stats->kernels_reused += own->kernels_reused;
+	stats->build_us += own->build_us;
+	if(own->kernel_workitems > 0 &&
+	   (stats->kernel_workitems == 0 || own->kernel_workitems < stats->kernel_workitems))
+		stats->kernel_workitems = own->kernel_workitems;
+	pthread_mutex_unlock(&stats_lock);
+	free(own->map_tuples);
+	free(own->reduce_tuples);
+}
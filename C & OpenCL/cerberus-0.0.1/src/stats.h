@@ -0,0 +1,22 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_STATS_H_
+#define MAP_STATS_H_
+
+#include <sys/time.h>
+#include "map_reduce.h"
+
+void stats_begin(map_reduce_args_t* args);
+void stats_phase(map_reduce_args_t* args, mr_phase_t phase, const struct timeval* begin,
+	const struct timeval* end);
+mr_mem_counters_t* stats_counters_create(void);
+void stats_counters_release(mr_mem_counters_t* mem);
+void stats_buffer(mr_runtime_t* runtime, cl_mem mem);
+void stats_start(mr_env_t* env);
+void stats_map_tuples(mr_env_t* env);
+void stats_collect(mr_env_t* env);
+
+#endif
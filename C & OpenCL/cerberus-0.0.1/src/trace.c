@@ -0,0 +1,230 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include "stddefines.h"
+#include "utils.h"
+#include "trace.h"
+
+//==========================================//
+//											//
+// Chrome trace export						//
+//											//
+//==========================================//
+
+// Host threads and runtimes that get a track of their own
+#define TRACE_MAX_THREADS 64
+#define TRACE_MAX_RUNTIMES 64
+
+static const char* command_names[] = {"write", "kernel", "copy", "read"};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* trace_out = NULL;
+static char* trace_path = NULL;
+static bool trace_first;
+static cl_ulong trace_epoch;
+static pthread_t threads[TRACE_MAX_THREADS];
+static size_t num_threads = 0;
+// Device tracks, one process per runtime and a thread per queue
+static const mr_runtime_t* runtimes[TRACE_MAX_RUNTIMES];
+static cl_uint named_queues[TRACE_MAX_RUNTIMES];
+static size_t num_runtimes = 0;
+
+// args->trace_file, overridden by CERBERUS_TRACE
+static const char* trace_file(map_reduce_args_t* args)
+{
+	const char* env = getenv("CERBERUS_TRACE");
+
+	if(env != NULL)
+		return (env[0] != '\0') ? env : NULL;
+	return args->trace_file;
+}
+
+bool trace_enabled(map_reduce_args_t* args)
+{
+	return trace_file(args) != NULL;
+}
+
+cl_ulong trace_now()
+{
+	struct timeval now;
+
+	get_time(&now);
+	return (cl_ulong)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+// Writes one event, the caller holds trace_lock
+static void write_event(const char* format, ...)
+{
+	va_list list;
+
+	fputs(trace_first ? "\n" : ",\n", trace_out);
+	trace_first = false;
+	va_start(list, format);
+	vfprintf(trace_out, format, list);
+	va_end(list);
+}
+
+// Writes a JSON string without the characters that would need escaping
+static void write_string(const char* value)
+{
+	fputc('"', trace_out);
+	for(const char* c = value; *c != '\0'; c++)
+	{
+		if(*c != '"' && *c != '\\' && (unsigned char)*c >= ' ')
+			fputc(*c, trace_out);
+	}
+	fputc('"', trace_out);
+}
+
+// Ends the JSON array and closes the file, the caller holds trace_lock
+static void close_locked()
+{
+	if(trace_out == NULL)
+		return;
+	fputs("\n]\n", trace_out);
+	fclose(trace_out);
+	free(trace_path);
+	trace_out = NULL;
+	trace_path = NULL;
+}
+
+// Opens the trace of args, a different path closes the current one. Times in a
+// new trace count from since. The caller holds trace_lock.
+static bool trace_open(map_reduce_args_t* args, cl_ulong since)
+{
+	const char* path = trace_file(args);
+
+	if(trace_out != NULL && strcmp(path, trace_path) == 0)
+		return true;
+	close_locked();
+	trace_out = fopen(path, "w");
+	if(trace_out == NULL)
+	{
+		fprintf(stderr, "Can't write trace %s\n", path);
+		return false;
+	}
+	trace_path = malloc(strlen(path) + 1);
+	strcpy(trace_path, path);
+	trace_first = true;
+	trace_epoch = since;
+	num_threads = 0;
+	num_runtimes = 0;
+	fputs("[", trace_out);
+	write_event("{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"host\"}}");
+	return true;
+}
+
+// Track of the calling thread, named on first use
+static size_t thread_track()
+{
+	pthread_t self = pthread_self();
+
+	for(size_t i = 0; i < num_threads; i++)
+	{
+		if(pthread_equal(threads[i], self))
+			return i;
+	}
+	if(num_threads == TRACE_MAX_THREADS)
+		return num_threads - 1;
+	threads[num_threads] = self;
+	write_event("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %zu, "
+				"\"args\": {\"name\": \"thread %zu\"}}", num_threads, num_threads);
+	return num_threads++;
+}
+
+// Process of the runtime's device tracks, named on first use along with its queues
+static size_t runtime_track(const mr_runtime_t* runtime, cl_uint num_queues)
+{
+	size_t i = 0;
+
+	while(i < num_runtimes && runtimes[i] != runtime)
+		i++;
+	if(i == num_runtimes)
+	{
+		if(num_runtimes == TRACE_MAX_RUNTIMES)
+			i = num_runtimes - 1;
+		else
+		{
+			runtimes[i] = runtime;
+			named_queues[i] = 0;
+			num_runtimes++;
+			write_event("{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %zu, \"args\": {\"name\": ",
+						i + 1);
+			write_string(runtime->info.name);
+			fputs("}}", trace_out);
+		}
+	}
+	for(cl_uint q = named_queues[i]; q < num_queues; q++)
+	{
+		write_event("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %zu, \"tid\": %u, "
+					"\"args\": {\"name\": \"queue %u\"}}", i + 1, q, q);
+	}
+	if(num_queues > named_queues[i])
+		named_queues[i] = num_queues;
+	return i + 1;
+}
+
+void trace_host(map_reduce_args_t* args, const char* name, const struct timeval* begin,
+	const struct timeval* end)
+{
+	if(!trace_enabled(args))
+		return;
+	pthread_mutex_lock(&trace_lock);
+	cl_ulong first = (cl_ulong)begin->tv_sec * 1000000 + begin->tv_usec;
+	cl_ulong last = (cl_ulong)end->tv_sec * 1000000 + end->tv_usec;
+	if(trace_open(args, first))
+	{
+		size_t tid = thread_track();
+		write_event("{\"name\": \"%s\", \"cat\": \"host\", \"ph\": \"X\", \"pid\": 0, \"tid\": %zu, "
+					"\"ts\": %lld, \"dur\": %llu}", name, tid, (long long)first - (long long)trace_epoch,
+					(unsigned long long)(last - first));
+		fflush(trace_out);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// Device counters have their own origin. Every command was enqueued right after
+// profile_event() took its host time, so the smallest distance between the two
+// is the offset of the device clock.
+void trace_commands(mr_env_t* env, const mr_profile_event_t* events, const cl_ulong* host, size_t num)
+{
+	if(num == 0)
+		return;
+	long long offset = (long long)(events[0].queued / 1000) - (long long)host[0];
+	for(size_t i = 1; i < num; i++)
+	{
+		long long distance = (long long)(events[i].queued / 1000) - (long long)host[i];
+		if(distance < offset)
+			offset = distance;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if(trace_open(env->args, host[0]))
+	{
+		size_t pid = runtime_track(env->runtime, env->num_queues);
+		for(size_t i = 0; i < num; i++)
+		{
+			const mr_profile_event_t* event = &events[i];
+			long long ts = (long long)(event->start / 1000) - offset - (long long)trace_epoch;
+			write_event("{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": %zu, \"tid\": %u, "
+						"\"ts\": %lld, \"dur\": %.3f, \"args\": {\"group\": %ld, \"queued_us\": %.3f}}",
+						event->name, command_names[event->type], pid, event->queue, ts,
+						(event->end - event->start) / 1000.0, event->group,
+						(event->start - event->queued) / 1000.0);
+		}
+		fflush(trace_out);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_close()
+{
+	pthread_mutex_lock(&trace_lock);
+	close_locked();
+	pthread_mutex_unlock(&trace_lock);
+}
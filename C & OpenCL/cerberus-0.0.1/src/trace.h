@@ -0,0 +1,19 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_TRACE_H_
+#define MAP_TRACE_H_
+
+#include <sys/time.h>
+#include "map_reduce.h"
+
+bool trace_enabled(map_reduce_args_t* args);
+cl_ulong trace_now();
+void trace_host(map_reduce_args_t* args, const char* name, const struct timeval* begin,
+	const struct timeval* end);
+void trace_commands(mr_env_t* env, const mr_profile_event_t* events, const cl_ulong* host, size_t num);
+void trace_close();
+
+#endif
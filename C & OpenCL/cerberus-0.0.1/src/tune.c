@@ -0,0 +1,446 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <unistd.h>
+#include <string.h>
+#include "stddefines.h"
+#include "utils.h"
+#include "stats.h"
+#include "profile.h"
+#include "tune.h"
+
+#define VERBOSE
+
+//==========================================//
+//											//
+// Workgroup parameter autotuning			//
+//											//
+//==========================================//
+
+#define TUNE_HEADER "# Cerberus tuning database\n" \
+	"# device\tdriver\tdevices\tmap\treduce\tlog2 bytes\tworkgroups\tworkitems\ttasks per reduce\tus\n"
+#define TUNE_FIELDS 10
+// Candidates of the search: workitems from TUNE_MIN_ITEMS up in powers of two,
+// workgroups from one per compute unit up to TUNE_MAX_GROUPS per compute unit and
+// tasks_per_reduce from 1 up to TUNE_MAX_TASKS
+#define TUNE_MIN_ITEMS 16
+#define TUNE_MAX_GROUPS 16
+#define TUNE_MAX_TASKS 16
+#define TUNE_MAX_CANDIDATES 32
+
+enum { TUNE_GROUPS, TUNE_ITEMS, TUNE_TASKS, TUNE_PARAMS };
+
+// Best configuration of a job, which matches on everything before params
+typedef struct
+{
+	char device[256];
+	char driver[128];
+	cl_uint num_devices;
+	char map[MAX_FILENAME];
+	char reduce[MAX_FILENAME];
+	int bucket;					// Input size, floor(log2(data_size))
+	size_t params[TUNE_PARAMS];	// num_workgroups, num_workitems, tasks_per_reduce
+	long us;					// Time of the run that found it, builds left out
+} tune_entry_t;
+
+// One run of the job during the search
+typedef struct
+{
+	long us;
+	void* keyvals;
+	size_t num_keyvals;
+	mr_stats_t stats;
+	mr_profile_t profile;
+} tune_trial_t;
+
+// Entries of the database read last, or found by this process when there is none.
+// run_stages() calls come one at a time, so they need no lock.
+static tune_entry_t* entries = NULL;
+static size_t num_entries = 0;
+static char loaded_db[MAX_FILENAME * 2] = "";
+
+// args->tuning_db, overridden by CERBERUS_TUNING_DB. NULL when there is none.
+static const char* tuning_db(map_reduce_args_t* args)
+{
+	const char* db = getenv("CERBERUS_TUNING_DB");
+
+	if(db == NULL)
+		db = args->tuning_db;
+	return (db[0] != '\0') ? db : NULL;
+}
+
+// args->autotune, or CERBERUS_AUTOTUNE set to anything but 0
+static bool autotune(map_reduce_args_t* args)
+{
+	const char* env = getenv("CERBERUS_AUTOTUNE");
+
+	if(env != NULL)
+		return strcmp(env, "0") != 0;
+	return args->autotune;
+}
+
+bool tune_enabled(map_reduce_args_t* args)
+{
+	return autotune(args) || tuning_db(args) != NULL;
+}
+
+// Copies a name into a field of the database, which can't hold tabs or line ends
+static void copy_name(char* field, size_t len, const char* name)
+{
+	size_t i;
+
+	for(i = 0; i + 1 < len && name[i] != '\0'; i++)
+		field[i] = (name[i] == '\t' || name[i] == '\n' || name[i] == '\r') ? ' ' : name[i];
+	field[i] = '\0';
+}
+
+static void entry_key(tune_entry_t* entry, map_reduce_args_t* args, mr_runtime_t* runtime)
+{
+	memset(entry, 0, sizeof(tune_entry_t));
+	copy_name(entry->device, sizeof(entry->device), runtime->info.name);
+	copy_name(entry->driver, sizeof(entry->driver), runtime->info.driver_version);
+	entry->num_devices = runtime->num_devices;
+	copy_name(entry->map, sizeof(entry->map), args->map);
+	copy_name(entry->reduce, sizeof(entry->reduce), args->reduce);
+	for(size_t size = args->data_size; size > 1; size >>= 1)
+		entry->bucket++;
+}
+
+static bool same_key(const tune_entry_t* a, const tune_entry_t* b)
+{
+	return strcmp(a->device, b->device) == 0 && strcmp(a->driver, b->driver) == 0 &&
+		a->num_devices == b->num_devices && strcmp(a->map, b->map) == 0 &&
+		strcmp(a->reduce, b->reduce) == 0 && a->bucket == b->bucket;
+}
+
+static tune_entry_t* find_entry(const tune_entry_t* key)
+{
+	for(size_t i = 0; i < num_entries; i++)
+	{
+		if(same_key(&entries[i], key))
+			return &entries[i];
+	}
+	return NULL;
+}
+
+// Adds the entry, or replaces the one with the same key
+static void store_entry(const tune_entry_t* entry)
+{
+	tune_entry_t* found = find_entry(entry);
+
+	if(found == NULL)
+	{
+		entries = (tune_entry_t*)realloc(entries, sizeof(tune_entry_t) * (num_entries + 1));
+		found = &entries[num_entries++];
+	}
+	*found = *entry;
+}
+
+// Next tab separated field of the line, NULL past the last one
+static char* next_field(char** line)
+{
+	char* field = *line;
+	char* tab;
+
+	if(field == NULL)
+		return NULL;
+	tab = strchr(field, '\t');
+	if(tab != NULL)
+	{
+		*tab = '\0';
+		*line = tab + 1;
+	}
+	else
+		*line = NULL;
+	return field;
+}
+
+static bool parse_entry(char* line, tune_entry_t* entry)
+{
+	char* fields[TUNE_FIELDS];
+
+	for(int i = 0; i < TUNE_FIELDS; i++)
+	{
+		fields[i] = next_field(&line);
+		if(fields[i] == NULL)
+			return false;
+	}
+	memset(entry, 0, sizeof(tune_entry_t));
+	copy_name(entry->device, sizeof(entry->device), fields[0]);
+	copy_name(entry->driver, sizeof(entry->driver), fields[1]);
+	entry->num_devices = strtoul(fields[2], NULL, 10);
+	copy_name(entry->map, sizeof(entry->map), fields[3]);
+	// Jobs without a reduce kernel are written as -
+	copy_name(entry->reduce, sizeof(entry->reduce), strcmp(fields[4], "-") == 0 ? "" : fields[4]);
+	entry->bucket = atoi(fields[5]);
+	for(int p = 0; p < TUNE_PARAMS; p++)
+	{
+		entry->params[p] = strtoull(fields[6 + p], NULL, 10);
+		if(entry->params[p] == 0)
+			return false;
+	}
+	entry->us = atol(fields[9]);
+	return true;
+}
+
+// Replaces the entries with the ones of the database, a missing file has none
+static void load_db(const char* path)
+{
+	char line[1024];
+	tune_entry_t entry;
+	FILE* file;
+
+	num_entries = 0;
+	copy_name(loaded_db, sizeof(loaded_db), path);
+	file = fopen(path, "r");
+	if(file == NULL)
+		return;
+	while(fgets(line, sizeof(line), file) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if(line[0] != '#' && parse_entry(line, &entry))
+			store_entry(&entry);
+	}
+	fclose(file);
+}
+
+// Adds the entry to the database. It is read again first to keep what other
+// processes stored meanwhile, then replaced in one go like the kernel cache.
+static void save_db(const char* path, const tune_entry_t* entry)
+{
+	char tmp_path[MAX_FILENAME * 2 + 32];
+	FILE* file;
+
+	load_db(path);
+	store_entry(entry);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+	file = fopen(tmp_path, "w");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Cannot write tuning database %s\n", tmp_path);
+		return;
+	}
+	fputs(TUNE_HEADER, file);
+	for(size_t i = 0; i < num_entries; i++)
+	{
+		const tune_entry_t* e = &entries[i];
+		fprintf(file, "%s\t%s\t%u\t%s\t%s\t%d\t%zu\t%zu\t%zu\t%ld\n", e->device, e->driver,
+				e->num_devices, e->map, (e->reduce[0] != '\0') ? e->reduce : "-", e->bucket,
+				e->params[TUNE_GROUPS], e->params[TUNE_ITEMS], e->params[TUNE_TASKS], e->us);
+	}
+	if(fclose(file) != 0 || rename(tmp_path, path) != 0)
+		remove(tmp_path);
+}
+
+static void set_params(map_reduce_args_t* args, const size_t* params)
+{
+	args->num_workgroups = params[TUNE_GROUPS];
+	args->num_workitems = params[TUNE_ITEMS];
+	args->tasks_per_reduce = params[TUNE_TASKS];
+}
+
+static void free_trial(tune_trial_t* trial)
+{
+	free(trial->keyvals);
+	free(trial->stats.map_tuples);
+	free(trial->stats.reduce_tuples);
+	free(trial->profile.events);
+}
+
+// Runs the job with params on a copy of args, whose splitter uses up data_size,
+// into the trial's own keyvals, stats and profile. A custom splitter gets its
+// task_data rewound first. Returns false if the job failed.
+static bool run_trial(map_reduce_args_t* args, mr_runtime_t* runtime, tune_job_t run,
+	const size_t* params, tune_trial_t* trial)
+{
+	map_reduce_args_t trial_args = *args;
+	struct timeval begin;
+	struct timeval end;
+	int ret;
+
+	memset(trial, 0, sizeof(tune_trial_t));
+	// Each trial runs the splitter again
+	if(args->splitter_rewind != NULL)
+		args->splitter_rewind(args->task_data);
+	set_params(&trial_args, params);
+	trial_args.stats = &trial->stats;
+	memset(&trial_args.profile, 0, sizeof(mr_profile_t));
+	stats_begin(&trial_args);
+	get_time(&begin);
+	ret = run(&trial_args, runtime, &trial->keyvals, &trial->num_keyvals);
+	get_time(&end);
+	trial->profile = trial_args.profile;
+	if(ret < 0)
+	{
+		free_trial(trial);
+		return false;
+	}
+	// A configuration builds its kernels once, later jobs reuse them
+	trial->us = (end.tv_sec - begin.tv_sec) * 1000000L + (end.tv_usec - begin.tv_usec) -
+		trial->stats.build_us;
+#ifdef VERBOSE
+	fprintf(stderr, "Autotune trial: %zu workgroups, %zu workitems, %zu tasks per reduce: %ld us\n",
+			params[TUNE_GROUPS], params[TUNE_ITEMS], params[TUNE_TASKS], trial->us);
+#endif
+	return true;
+}
+
+// Values of the parameter worth trying. Workitems stay within the smallest
+// CL_KERNEL_WORK_GROUP_SIZE of the job's kernels and workgroups get a unit at least.
+static size_t candidates(int param, map_reduce_args_t* args, mr_runtime_t* runtime, size_t max_items,
+	size_t* values)
+{
+	size_t compute_units = runtime->info.num_compute_units * runtime->num_devices;
+	size_t units = (args->unit_size > 0) ? args->data_size / args->unit_size : args->data_size;
+	size_t num = 0;
+
+	switch(param)
+	{
+	case TUNE_ITEMS:
+		for(size_t items = TUNE_MIN_ITEMS; items <= max_items; items *= 2)
+			values[num++] = items;
+		if(num == 0 || values[num - 1] != max_items)
+			values[num++] = max_items;
+		break;
+	case TUNE_GROUPS:
+		for(size_t factor = 1; factor <= TUNE_MAX_GROUPS; factor *= 2)
+		{
+			if(compute_units * factor <= units)
+				values[num++] = compute_units * factor;
+		}
+		if(num == 0)
+			values[num++] = (units > 0) ? units : 1;
+		break;
+	case TUNE_TASKS:
+		// Only the reduce kernels use it
+		if(args->reduce[0] == '\0' || args->combine != MR_COMBINE_NONE)
+			break;
+		for(size_t tasks = 1; tasks <= TUNE_MAX_TASKS; tasks *= 2)
+			values[num++] = tasks;
+		break;
+	}
+	return num;
+}
+
+// Coordinate descent from the job's own configuration: workitems first, as they
+// bound tasks_per_reduce, then workgroups, then tasks_per_reduce. Every candidate
+// runs the whole job once and the fastest run's keyvals, stats and profile are kept.
+static int search(map_reduce_args_t* args, mr_runtime_t* runtime, tune_job_t run, tune_entry_t* key,
+	void** keyvals, size_t* num_keyvals)
+{
+	static const int order[TUNE_PARAMS] = {TUNE_ITEMS, TUNE_GROUPS, TUNE_TASKS};
+	size_t params[TUNE_PARAMS];
+	size_t values[TUNE_MAX_CANDIDATES];
+	size_t max_items;
+	tune_trial_t best;
+	tune_trial_t trial;
+
+	// Later trials of a splitter that used up task_data would run on no input and
+	// look fast, so those jobs run once, untuned
+	if(args->splitter != NULL && args->splitter_rewind == NULL)
+	{
+		fprintf(stderr, "Not autotuning %s, its splitter has no splitter_rewind\n", args->map);
+		return run(args, runtime, keyvals, num_keyvals);
+	}
+	// The same defaults as env_init()
+	params[TUNE_GROUPS] = (args->num_workgroups > 0) ? args->num_workgroups :
+		runtime->info.num_compute_units;
+	params[TUNE_ITEMS] = (args->num_workitems > 0) ? args->num_workitems : runtime->info.max_workitems;
+	params[TUNE_TASKS] = (args->tasks_per_reduce > 0) ? args->tasks_per_reduce : 2;
+	if(args->reduce[0] == '\0')
+		params[TUNE_TASKS] = 1;
+	if(!run_trial(args, runtime, run, params, &best))
+		return -1;
+	max_items = runtime->info.max_workitems;
+	if(best.stats.kernel_workitems > 0 && best.stats.kernel_workitems < max_items)
+		max_items = best.stats.kernel_workitems;
+
+	for(int i = 0; i < TUNE_PARAMS; i++)
+	{
+		int param = order[i];
+		size_t num = candidates(param, args, runtime, max_items, values);
+		for(size_t c = 0; c < num; c++)
+		{
+			size_t next[TUNE_PARAMS];
+			if(values[c] == params[param])
+				continue;
+			memcpy(next, params, sizeof(next));
+			next[param] = values[c];
+			// Every reduce workitem needs a task
+			if(next[TUNE_TASKS] > next[TUNE_ITEMS])
+				continue;
+			if(!run_trial(args, runtime, run, next, &trial))
+				continue;
+			if(trial.us < best.us)
+			{
+				free_trial(&best);
+				best = trial;
+				memcpy(params, next, sizeof(params));
+			}
+			else
+				free_trial(&trial);
+		}
+	}
+
+	memcpy(key->params, params, sizeof(params));
+	key->us = best.us;
+	if(tuning_db(args) != NULL)
+		save_db(tuning_db(args), key);
+	else
+		store_entry(key);
+	fprintf(stderr, "Autotuned %s on %s: %zu workgroups, %zu workitems, %zu tasks per reduce\n",
+			args->map, key->device, params[TUNE_GROUPS], params[TUNE_ITEMS], params[TUNE_TASKS]);
+
+	// The fastest run stands for the job
+	if(best.num_keyvals > 0)
+	{
+		*keyvals = realloc(*keyvals, args->keyval_size * (*num_keyvals + best.num_keyvals));
+		memcpy((char*)*keyvals + args->keyval_size * *num_keyvals, best.keyvals,
+			   args->keyval_size * best.num_keyvals);
+		*num_keyvals += best.num_keyvals;
+	}
+	free(best.keyvals);
+	profile_append(&args->profile, &best.profile);
+	free(best.profile.events);
+	if(args->stats != NULL)
+	{
+		free(args->stats->map_tuples);
+		free(args->stats->reduce_tuples);
+		*args->stats = best.stats;
+	}
+	else
+	{
+		free(best.stats.map_tuples);
+		free(best.stats.reduce_tuples);
+	}
+	return 0;
+}
+
+// Runs the job with the configuration stored for its kernels, device and input
+// size. Without one, autotuning searches for it and other jobs run as they are.
+int tune_run(map_reduce_args_t* args, mr_runtime_t* runtime, tune_job_t run, void** keyvals,
+	size_t* num_keyvals)
+{
+	const char* db = tuning_db(args);
+	tune_entry_t key;
+	tune_entry_t* entry;
+
+	entry_key(&key, args, runtime);
+	if(db != NULL && strcmp(db, loaded_db) != 0)
+		load_db(db);
+	entry = find_entry(&key);
+	if(entry != NULL)
+	{
+		map_reduce_args_t tuned = *args;
+		int ret;
+		set_params(&tuned, entry->params);
+		ret = run(&tuned, runtime, keyvals, num_keyvals);
+		args->profile = tuned.profile;
+		return ret;
+	}
+	if(!autotune(args))
+		return run(args, runtime, keyvals, num_keyvals);
+	return search(args, runtime, run, &key, keyvals, num_keyvals);
+}
@@ -0,0 +1,19 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#ifndef MAP_TUNE_H_
+#define MAP_TUNE_H_
+
+#include "map_reduce.h"
+
+// Runs a job on a runtime and appends its keyvals, run_job() or run_rounds()
+typedef int (*tune_job_t)(map_reduce_args_t* args, mr_runtime_t* runtime, void** keyvals,
+	size_t* num_keyvals);
+
+bool tune_enabled(map_reduce_args_t* args);
+int tune_run(map_reduce_args_t* args, mr_runtime_t* runtime, tune_job_t run, void** keyvals,
+	size_t* num_keyvals);
+
+#endif
@@ -3,8 +3,11 @@
 	targeting GPU computing.
 */
 
+#include <strings.h>
 #include "stddefines.h"
 #include "utils.h"
+#include "program_cache.h"
+#include "stats.h"
 
 //==========================================//
 //											//
@@ -20,6 +23,23 @@ unsigned int div_round_up(unsigned int x, unsigned int y)
 	return((x + y - 1) / y);
 }
 
+// Least common multiple, used to align buffer offsets
+size_t lcm(size_t a, size_t b)
+{
+	size_t x = a;
+	size_t y = b;
+
+	if(a == 0 || b == 0)
+		return (a > b) ? a : b;
+	while(y != 0)
+	{
+		size_t t = x % y;
+		x = y;
+		y = t;
+	}
+	return a / x * b;
+}
+
 char* get_kernel_name(const char* path)
 {
 	int len = strlen(path);
@@ -53,31 +73,78 @@ char* get_kernel_name(const char* path)
 void create_kernel(mr_env_t* env, const char* path, cl_program* program, cl_kernel* kernel, 
 				   const char* flags)
 {
-	// Build kernel	cl_int error;
-	const char* name = get_kernel_name(path);
+	char* name = get_kernel_name(path);
 	size_t src_size = 0;
-	const char *source = oclLoadProgSource(path, &src_size);
+	char *source = oclLoadProgSource(path, &src_size);
+
+	create_kernel_from_source(env, name, source, src_size, program, kernel, flags);
+	free(source);
+	free(name);
+}
+
+// The kernel's CL_KERNEL_WORK_GROUP_SIZE, which also lowers the job's smallest one
+static size_t kernel_workitems(mr_env_t* env, cl_kernel kernel)
+{
+	size_t size;
+	cl_int error = clGetKernelWorkGroupInfo(kernel, env->device, CL_KERNEL_WORK_GROUP_SIZE,
+											sizeof(size_t), &size, NULL);
+	CL_ASSERT(error);
+	if(env->stats.kernel_workitems == 0 || size < env->stats.kernel_workitems)
+		env->stats.kernel_workitems = size;
+	return size;
+}
+
+void create_kernel_from_source(mr_env_t* env, const char* name, const char* source, size_t src_size,
+							   cl_program* program, cl_kernel* kernel, const char* flags)
+{
+	// Every kernel is compiled with the runtime preamble in front of it
+	const char* sources[2] = { kernel_preamble, source };
+	size_t sizes[2] = { strlen(kernel_preamble), src_size };
 	cl_int error;
-	*program = clCreateProgramWithSource(env->device_context, 1, &source, &src_size, &error);
-	if(error) 
+	struct timeval begin;
+	struct timeval end;
+
+	// Kernels built earlier in this process are reused as they are
+	uint64_t key = program_cache_key(env, name, sources, sizes, 2, flags);
+	if(program_cache_find(env->runtime, key, program, kernel))
 	{
-		fprintf(stderr, "Error creating %s program: %d", name, error);
-		exit(error);
+		env->stats.kernels_reused++;
+		kernel_workitems(env, *kernel);
+		return;
 	}
 
-	// Builds the program
-	error = clBuildProgram(*program, 1, &env->device, flags, NULL, NULL);
-	if(error) 
+	// Then try the compiled binary cache
+	get_time(&begin);
+	*program = program_cache_load(env, name, key, flags);
+	if(*program != NULL)
+		env->stats.kernels_loaded++;
+	else
 	{
-		fprintf(stderr, "Error building %s program: %d\n", name, error);
-		size_t len;
-		char *buffer;
-		clGetProgramBuildInfo(*program, env->device, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
-		buffer = malloc(len);
-		clGetProgramBuildInfo(*program, env->device, CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
-		printf("%s\n", buffer);
-		exit(error);
+		*program = clCreateProgramWithSource(env->device_context, 2, sources, sizes, &error);
+		if(error) 
+		{
+			fprintf(stderr, "Error creating %s program: %d", name, error);
+			exit(error);
+		}
+
+		// Builds the program for every device of the context
+		error = clBuildProgram(*program, env->runtime->num_devices, env->runtime->devices, flags, NULL, NULL);
+		if(error) 
+		{
+			fprintf(stderr, "Error building %s program: %d\n", name, error);
+			size_t len;
+			char *buffer;
+			clGetProgramBuildInfo(*program, env->device, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+			buffer = malloc(len);
+			clGetProgramBuildInfo(*program, env->device, CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
+			printf("%s\n", buffer);
+			exit(error);
+		}
+		program_cache_store(env, name, key, *program);
+		env->stats.kernels_built++;
 	}
+	get_time(&end);
+	env->stats.build_us += (end.tv_sec - begin.tv_sec) * 1000000L + (end.tv_usec - begin.tv_usec);
 
 	// Extracting the kernel
 	*kernel = clCreateKernel(*program, name, &error);
@@ -104,77 +171,207 @@ void create_kernel(mr_env_t* env, const char* path, cl_program* program, cl_kern
 		//logWriter << build_log << endl;
 		free(build_log);
 	}
-	size_t ret;
-	error = clGetKernelWorkGroupInfo(*kernel, env->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t),
-									 &ret, NULL);
-	CL_ASSERT(error);
+	size_t ret = kernel_workitems(env, *kernel);
 	fprintf(stderr, "Kernel %s specific maximum workgroup size %zu\n", name, ret);
 	if(ret < env->num_workitems)
 		fprintf(stderr, "Error - too many map workitems\n");
 	if(ret < env->num_reduce_workitems)
 		fprintf(stderr, "Error - too many reduce workitems\n");
+
+	program_cache_add(env->runtime, key, *program, *kernel);
 }
 
 
-// Those functions are taken from util.cpp in NVIDIA GPGPU SDK
-cl_int oclGetPlatformID(cl_platform_id* clSelectedPlatformID)
+// Parses a CERBERUS_DEVICE_TYPE value, returns 0 for unknown strings
+static cl_device_type parse_device_type(const char* str)
+{
+	if(strcasecmp(str, "gpu") == 0)
+		return CL_DEVICE_TYPE_GPU;
+	if(strcasecmp(str, "cpu") == 0)
+		return CL_DEVICE_TYPE_CPU;
+	if(strcasecmp(str, "accelerator") == 0)
+		return CL_DEVICE_TYPE_ACCELERATOR;
+	if(strcasecmp(str, "all") == 0)
+		return CL_DEVICE_TYPE_ALL;
+	return 0;
+}
+
+// Looks for the first device of a given type whose platform and device names
+// contain the requested substrings
+static cl_int find_device(cl_device_type type, const char* platform_name, const char* device_name,
+						  cl_platform_id* platform, cl_device_id* device)
 {
 	char chBuffer[1024];
-	cl_uint num_platforms; 
-	cl_platform_id* clPlatformIDs;
+	cl_uint num_platforms;
+	cl_platform_id* platforms;
 	cl_int ciErrNum;
 
-	// Get OpenCL platform count
 	ciErrNum = clGetPlatformIDs(0, NULL, &num_platforms);
-	if(ciErrNum != CL_SUCCESS)
-	{
-		//shrLog(LOGBOTH, 0, " Error %i in clGetPlatformIDs Call !!!\n\n", ciErrNum);
-		return -1000;
-	}
-	else 
+	if(ciErrNum != CL_SUCCESS || num_platforms == 0)
+		return CL_DEVICE_NOT_FOUND;
+	platforms = (cl_platform_id*)malloc(num_platforms * sizeof(cl_platform_id));
+	clGetPlatformIDs(num_platforms, platforms, NULL);
+
+	ciErrNum = CL_DEVICE_NOT_FOUND;
+	for(cl_uint i = 0; i < num_platforms && ciErrNum != CL_SUCCESS; i++)
 	{
-		if(num_platforms == 0)
+		if(platform_name[0] != '\0')
 		{
-			//shrLog(LOGBOTH, 0, "No OpenCL platform found!\n\n");
-			return -2000;
+			if(clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, sizeof(chBuffer), chBuffer, NULL) != 
+			   CL_SUCCESS || strstr(chBuffer, platform_name) == NULL)
+				continue;
 		}
-		else 
+
+		cl_uint num_devices;
+		if(clGetDeviceIDs(platforms[i], type, 0, NULL, &num_devices) != CL_SUCCESS || num_devices == 0)
+			continue;
+		cl_device_id* devices = (cl_device_id*)malloc(num_devices * sizeof(cl_device_id));
+		clGetDeviceIDs(platforms[i], type, num_devices, devices, NULL);
+		for(cl_uint j = 0; j < num_devices; j++)
 		{
-			// if there's a platform or more, make space for ID's
-			if((clPlatformIDs = (cl_platform_id*)malloc(num_platforms * sizeof(cl_platform_id))) == NULL)
+			if(device_name[0] != '\0')
 			{
-				//shrLog(LOGBOTH, 0, "Failed to allocate memory for cl_platform ID's!\n\n");
-				return -3000;
+				if(clGetDeviceInfo(devices[j], CL_DEVICE_NAME, sizeof(chBuffer), chBuffer, NULL) != 
+				   CL_SUCCESS || strstr(chBuffer, device_name) == NULL)
+					continue;
 			}
+			*platform = platforms[i];
+			*device = devices[j];
+			ciErrNum = CL_SUCCESS;
+			break;
+		}
+		free(devices);
+	}
+
+	free(platforms);
+	return ciErrNum;
+}
+
+// Applies the CERBERUS_DEVICE_TYPE, CERBERUS_PLATFORM and CERBERUS_DEVICE overrides to a policy
+static void policy_overrides(const mr_device_policy_t* policy, cl_device_type* type,
+							 const char** platform_name, const char** device_name)
+{
+	const char* env;
+
+	*type = policy->type;
+	*platform_name = policy->platform;
+	*device_name = policy->device;
+	if((env = getenv("CERBERUS_DEVICE_TYPE")) != NULL && env[0] != '\0')
+	{
+		*type = parse_device_type(env);
+		if(*type == 0 && strcasecmp(env, "default") != 0)
+			fprintf(stderr, "Unknown CERBERUS_DEVICE_TYPE %s, using default\n", env);
+	}
+	if((env = getenv("CERBERUS_PLATFORM")) != NULL)
+		*platform_name = env;
+	if((env = getenv("CERBERUS_DEVICE")) != NULL)
+		*device_name = env;
+}
+
+// Picks a platform and device according to the policy and environment overrides.
+// With no type requested GPUs are preferred, then CPUs, then anything else.
+cl_int oclSelectDevice(const mr_device_policy_t* policy, cl_platform_id* platform, cl_device_id* device)
+{
+	cl_device_type type;
+	const char* platform_name;
+	const char* device_name;
+
+	policy_overrides(policy, &type, &platform_name, &device_name);
+	if(type != 0)
+		return find_device(type, platform_name, device_name, platform, device);
+
+	// Default policy, fall back through the device types
+	if(find_device(CL_DEVICE_TYPE_GPU, platform_name, device_name, platform, device) == CL_SUCCESS)
+		return CL_SUCCESS;
+	if(find_device(CL_DEVICE_TYPE_CPU, platform_name, device_name, platform, device) == CL_SUCCESS)
+	{
+		fprintf(stderr, "No GPU found, falling back to CPU device\n");
+		return CL_SUCCESS;
+	}
+	return find_device(CL_DEVICE_TYPE_ALL, platform_name, device_name, platform, device);
+}
+
+// Splits a CPU device into count sub-devices of equal compute units. Returns how
+// many were written to sub_devices, 0 if the device can't be partitioned that way.
+static cl_uint split_device(cl_device_id device, cl_uint count, cl_device_id* sub_devices)
+{
+	cl_uint units;
+	cl_uint num = 0;
+
+	if(clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL) != CL_SUCCESS ||
+	   units < count)
+		return 0;
+	cl_device_partition_property props[] = {CL_DEVICE_PARTITION_EQUALLY, units / count, 0};
+	if(clCreateSubDevices(device, props, count, sub_devices, &num) != CL_SUCCESS)
+		return 0;
+	return num;
+}
 
-			// get platform info for each platform and trap the NVIDIA platform if found
-			ciErrNum = clGetPlatformIDs(num_platforms, clPlatformIDs, NULL);
-			for(cl_uint i = 0; i < num_platforms; ++i)
+// Lists up to max devices that match the policy on every platform, where no type means
+// any. With sub_devices > 1 each CPU device is replaced by that many sub-devices,
+// which stand in for separate devices on machines that only have a CPU.
+cl_uint oclListDevices(const mr_device_policy_t* policy, cl_uint sub_devices, cl_platform_id* platforms,
+					   cl_device_id* devices, cl_uint max)
+{
+	char chBuffer[1024];
+	cl_device_type type;
+	const char* platform_name;
+	const char* device_name;
+	cl_uint num_platforms;
+	cl_uint count = 0;
+
+	policy_overrides(policy, &type, &platform_name, &device_name);
+	if(type == 0)
+		type = CL_DEVICE_TYPE_ALL;
+	if(clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0)
+		return 0;
+	cl_platform_id* all_platforms = (cl_platform_id*)malloc(num_platforms * sizeof(cl_platform_id));
+	clGetPlatformIDs(num_platforms, all_platforms, NULL);
+
+	for(cl_uint i = 0; i < num_platforms && count < max; i++)
+	{
+		if(platform_name[0] != '\0')
+		{
+			if(clGetPlatformInfo(all_platforms[i], CL_PLATFORM_NAME, sizeof(chBuffer), chBuffer, NULL) !=
+			   CL_SUCCESS || strstr(chBuffer, platform_name) == NULL)
+				continue;
+		}
+
+		cl_uint num_devices;
+		if(clGetDeviceIDs(all_platforms[i], type, 0, NULL, &num_devices) != CL_SUCCESS || num_devices == 0)
+			continue;
+		cl_device_id* found = (cl_device_id*)malloc(num_devices * sizeof(cl_device_id));
+		clGetDeviceIDs(all_platforms[i], type, num_devices, found, NULL);
+		for(cl_uint j = 0; j < num_devices && count < max; j++)
+		{
+			cl_device_type device_type;
+			if(device_name[0] != '\0')
 			{
-				ciErrNum = clGetPlatformInfo(clPlatformIDs[i], CL_PLATFORM_NAME, 1024, &chBuffer, NULL);
-				if(ciErrNum == CL_SUCCESS)
-				{
-					if(strstr(chBuffer, "NVIDIA") != NULL)
-					{
-						*clSelectedPlatformID = clPlatformIDs[i];
-						break;
-					}
-				}
+				if(clGetDeviceInfo(found[j], CL_DEVICE_NAME, sizeof(chBuffer), chBuffer, NULL) !=
+				   CL_SUCCESS || strstr(chBuffer, device_name) == NULL)
+					continue;
 			}
-
-			// default to zeroeth platform if NVIDIA not found
-			if(*clSelectedPlatformID == NULL)
+			clGetDeviceInfo(found[j], CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+			cl_uint split = 0;
+			if(sub_devices > 1 && (device_type & CL_DEVICE_TYPE_CPU) && count + sub_devices <= max)
+				split = split_device(found[j], sub_devices, &devices[count]);
+			if(split == 0)
 			{
-				*clSelectedPlatformID = clPlatformIDs[0];
+				devices[count] = found[j];
+				split = 1;
 			}
-
-			free(clPlatformIDs);
+			for(cl_uint k = 0; k < split; k++)
+				platforms[count + k] = all_platforms[i];
+			count += split;
 		}
+		free(found);
 	}
 
-	return CL_SUCCESS;
+	free(all_platforms);
+	return count;
 }
 
+// Taken from util.cpp in NVIDIA GPGPU SDK
 char* oclLoadProgSource(const char* cFilename, size_t* szFinalLength)
 {
 	// locals 
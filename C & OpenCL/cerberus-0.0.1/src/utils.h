@@ -10,10 +10,17 @@
 #include "string.h"
 
 unsigned int div_round_up(unsigned int x, unsigned int y);
+size_t lcm(size_t a, size_t b);
 void create_kernel(mr_env_t* env, const char* path, cl_program* program, cl_kernel* kernel,
 	const char* flags);
+void create_kernel_from_source(mr_env_t* env, const char* name, const char* source, size_t src_size,
+	cl_program* program, cl_kernel* kernel, const char* flags);
 char* get_kernel_name(const char* path);
-cl_int oclGetPlatformID(cl_platform_id* clSelectedPlatformID);
+cl_int oclSelectDevice(const mr_device_policy_t* policy, cl_platform_id* platform, cl_device_id* device);
+cl_uint oclListDevices(const mr_device_policy_t* policy, cl_uint sub_devices, cl_platform_id* platforms,
+	cl_device_id* devices, cl_uint max);
 char* oclLoadProgSource(const char* cFilename, size_t* szFinalLength);
 
+extern const char* kernel_preamble;
+
 #endif
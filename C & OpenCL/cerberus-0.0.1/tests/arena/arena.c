@@ -0,0 +1,135 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "map_reduce.h"
+#include "stddefines.h"
+
+// Map tasks per work-item
+#define UNITS_PER_ITEM 16
+// Must match arena_reduce.cl, key k is emitted k % 3 times
+#define NUM_KEYS 16
+
+typedef struct
+{
+	cl_int key;
+	cl_uint value;
+} keyval_t;
+
+static cl_uint expected[NUM_KEYS];
+static bool failed = false;
+
+// Adds up the counts of every reduce group, whose ranges must hold the output of
+// their map workgroups exactly once
+void arena_merger(merger_dat_t* data)
+{
+	keyval_t* keyvals = (keyval_t*)data->keyvals;
+	size_t length = data->size;
+	cl_uint* sum = (cl_uint*)calloc(NUM_KEYS, sizeof(cl_uint));
+
+	for(size_t i = 0; i < length; i++)
+	{
+		cl_int key = keyvals[i].key;
+		if(key < 0 || key >= NUM_KEYS)
+		{
+			fprintf(stderr, "Arena: unexpected key %d\n", key);
+			failed = true;
+			continue;
+		}
+		sum[key] += keyvals[i].value;
+	}
+	for(size_t i = 0; i < NUM_KEYS; i++)
+	{
+		if(sum[i] != expected[i])
+		{
+			fprintf(stderr, "Arena: key %zu counted %u times, expected %u\n", i, sum[i], expected[i]);
+			failed = true;
+		}
+	}
+
+	free(keyvals);
+
+	data->output = sum;
+	data->output_size = NUM_KEYS;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct timeval starttime,endtime;
+	size_t num_workitems = 64;
+	// Odd, so the last reduce group gets a single map workgroup
+	size_t num_workgroups = 5;
+
+	// Obtain custom work size
+	if (argc > 2)
+    {
+		num_workitems = atoi(argv[1]);
+		num_workgroups = atoi(argv[2]);
+	}
+
+    printf("Arena: Running...\n");
+
+	// Workgroups emit different numbers of keyvals, so the ranges have uneven lengths
+	size_t num_keys = num_workgroups * num_workitems * UNITS_PER_ITEM;
+	cl_int* keys = (cl_int*)malloc(sizeof(cl_int) * num_keys);
+	CHECK_ERROR (keys == NULL);
+	for(size_t i = 0; i < NUM_KEYS; i++)
+		expected[i] = 0;
+	for(size_t i = 0; i < num_keys; i++)
+	{
+		size_t group = i * num_workgroups / num_keys;
+		cl_int key = (i * (group + 1)) % NUM_KEYS;
+		keys[i] = key;
+		expected[key] += key % 3;
+	}
+
+    CHECK_ERROR (map_reduce_init ());
+
+	size_t res_len;
+
+    // Setup scheduler args
+    map_reduce_args_t map_reduce_args;
+    memset(&map_reduce_args, 0, sizeof(map_reduce_args_t));
+    map_reduce_args.task_data = keys;
+	strcpy(map_reduce_args.map, "arena_map.cl");
+	strcpy(map_reduce_args.map_count, "arena_map_count.cl");
+	strcpy(map_reduce_args.reduce, "arena_reduce.cl");
+	strcpy(map_reduce_args.reduce_count, "arena_reduce_count.cl");
+	map_reduce_args.merger = &arena_merger;
+	map_reduce_args.single_launch = true;
+	map_reduce_args.arena_partition = true;
+	map_reduce_args.tasks_per_reduce = 2;
+	map_reduce_args.num_workgroups = num_workgroups;
+	map_reduce_args.num_workitems = num_workitems;
+    map_reduce_args.splitter = NULL;
+    map_reduce_args.unit_size = sizeof(cl_int);
+    map_reduce_args.keyval_size = sizeof(keyval_t);
+    map_reduce_args.partition = NULL;
+    map_reduce_args.result_len = &res_len;
+    map_reduce_args.data_size = num_keys * sizeof(cl_int);
+
+    printf("Arena: Calling MapReduce Scheduler\n");
+
+    gettimeofday(&starttime,0);
+    CHECK_ERROR (map_reduce (&map_reduce_args) < 0);
+    CHECK_ERROR (map_reduce_finalize ());
+    gettimeofday(&endtime,0);
+
+    free(map_reduce_args.result);
+    free(keys);
+    if (failed)
+    {
+        printf("Arena: FAILED\n");
+        return 1;
+    }
+    printf("Arena: Completed %ld ms\n",time_diff (&endtime, &starttime));
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+// Map
+
+// Key k is emitted k % 3 times
+#define COPIES(key) ((key) % 3)
+
+typedef struct
+{
+	int key;
+	uint value;
+} keyval_t;
+
+__kernel void arena_map( __global const int* input, __global keyval_t* output,
+							uint data_size MR_MAP_PARAMS)
+{
+	MR_GROUP_PROLOGUE(input, output, data_size);
+	uint idx = get_local_id(0);
+	uint last_index = data_size / sizeof(int);
+	__local uint counter;
+	keyval_t temp;
+
+	if(idx == 0)
+	{
+		counter = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(uint task_count = 0; task_count < TASKS_PER_MAP; task_count++)
+	{
+		uint curr_idx = idx + get_local_size(0) * task_count;
+		if (curr_idx >= last_index)
+			break;
+
+		temp.key = input[curr_idx];
+		temp.value = 1;
+		for(int i = 0; i < COPIES(temp.key); i++)
+			MR_EMIT(output, counter, temp);
+	}
+}
@@ -0,0 +1,35 @@
+// Map count
+
+// Key k is emitted k % 3 times
+#define COPIES(key) ((key) % 3)
+
+__kernel void arena_map_count( __global const int* input, __global uint* output,
+								uint data_size MR_MAP_PARAMS)
+{
+	MR_GROUP_PROLOGUE(input, output, data_size);
+	uint idx = get_local_id(0);
+	uint last_index = data_size / sizeof(int);
+	__local uint counter;
+
+	if(idx == 0)
+	{
+		counter = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(uint task_count = 0; task_count < TASKS_PER_MAP; task_count++)
+	{
+		uint curr_idx = idx + get_local_size(0) * task_count;
+		if (curr_idx >= last_index)
+			break;
+
+		atomic_add(&counter, COPIES(input[curr_idx]));
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (idx == 0)
+	{
+		*output = counter;
+	}
+}
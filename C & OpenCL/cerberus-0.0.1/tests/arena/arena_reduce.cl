@@ -0,0 +1,41 @@
+// Reduce
+
+#define NUM_KEYS 16
+
+typedef struct
+{
+	int key;
+	uint value;
+} keyval_t;
+
+// Counts every key of the reduce group's range, which holds the output of several
+// map workgroups back to back
+__kernel void arena_reduce( __global const keyval_t* input, __global keyval_t* output,
+							uint data_size MR_REDUCE_PARAMS)
+{
+	MR_GROUP_PROLOGUE(input, output, data_size);
+	uint idx = get_local_id(0);
+	uint last_index = data_size / sizeof(keyval_t);
+	__local uint sums[NUM_KEYS];
+
+	for(uint i = idx; i < NUM_KEYS; i += get_local_size(0))
+		sums[i] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(uint i = idx; i < last_index; i += get_local_size(0))
+	{
+		// Unknown keys are left out, the merger finds them missing
+		int key = input[i].key;
+		if (key >= 0 && key < NUM_KEYS)
+			atomic_add(&sums[key], input[i].value);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for(uint i = idx; i < NUM_KEYS; i += get_local_size(0))
+	{
+		keyval_t temp;
+		temp.key = i;
+		temp.value = sums[i];
+		output[i] = temp;
+	}
+}
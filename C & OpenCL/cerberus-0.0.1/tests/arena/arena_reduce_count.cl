@@ -0,0 +1,19 @@
+// Reduce count
+
+#define NUM_KEYS 16
+
+typedef struct
+{
+	int key;
+	uint value;
+} keyval_t;
+
+__kernel void arena_reduce_count( __global const keyval_t* input, __global uint* output,
+									uint data_size MR_REDUCE_PARAMS)
+{
+	MR_GROUP_PROLOGUE(input, output, data_size);
+
+	// One keyval per key, whatever the range holds
+	if (get_local_id(0) == 0)
+		*output = NUM_KEYS;
+}
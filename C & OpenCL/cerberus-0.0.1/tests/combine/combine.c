@@ -0,0 +1,150 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "map_reduce.h"
+#include "stddefines.h"
+
+// Map tasks per work-item
+#define UNITS_PER_ITEM 16
+// More keys than fit in the combiner's local tables
+#define NUM_KEYS 512
+
+typedef struct
+{
+	cl_int key;
+	cl_uint value;
+} keyval_t;
+
+// Combiner of the job being run and its expected value per key
+static mr_combine_t op;
+static cl_uint expected[NUM_KEYS];
+static bool failed = false;
+
+// Checks that every key was combined into exactly one keyval holding the expected value
+void combine_merger(merger_dat_t* data)
+{
+	keyval_t* keyvals = (keyval_t*)data->keyvals;
+	size_t length = data->size;
+	cl_uint* seen = (cl_uint*)calloc(NUM_KEYS, sizeof(cl_uint));
+	cl_uint* value = (cl_uint*)calloc(NUM_KEYS, sizeof(cl_uint));
+
+	for(size_t i = 0; i < length; i++)
+	{
+		cl_int key = keyvals[i].key;
+		if(key < 0 || key >= NUM_KEYS)
+		{
+			fprintf(stderr, "Combine: unexpected key %d\n", key);
+			failed = true;
+			continue;
+		}
+		seen[key]++;
+		value[key] = keyvals[i].value;
+	}
+	// Values are at least 1, keys expected to be 0 are not in the input
+	for(size_t i = 0; i < NUM_KEYS; i++)
+	{
+		cl_uint times = (expected[i] > 0) ? 1 : 0;
+		if(seen[i] != times || value[i] != expected[i])
+		{
+			fprintf(stderr, "Combine: key %zu left %u times as %u, expected %u times as %u (op %d)\n",
+					i, seen[i], value[i], times, expected[i], op);
+			failed = true;
+		}
+	}
+
+	free(seen);
+	free(keyvals);
+
+	data->output = value;
+	data->output_size = NUM_KEYS;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct timeval starttime,endtime;
+	size_t num_workitems = 64;
+	size_t num_workgroups = 4;
+	const mr_combine_t ops[] = { MR_COMBINE_SUM, MR_COMBINE_MAX };
+
+	// Obtain custom work size
+	if (argc > 2)
+    {
+		num_workitems = atoi(argv[1]);
+		num_workgroups = atoi(argv[2]);
+	}
+
+    printf("Combine: Running...\n");
+
+	size_t num_units = num_workgroups * num_workitems * UNITS_PER_ITEM;
+	keyval_t* units = (keyval_t*)malloc(sizeof(keyval_t) * num_units);
+	CHECK_ERROR (units == NULL);
+	for(size_t i = 0; i < num_units; i++)
+	{
+		units[i].key = (i * 7919) % NUM_KEYS;
+		units[i].value = (i * 31) % 97 + 1;
+	}
+
+    CHECK_ERROR (map_reduce_init ());
+
+	size_t res_len;
+
+    // Setup scheduler args
+    map_reduce_args_t map_reduce_args;
+    memset(&map_reduce_args, 0, sizeof(map_reduce_args_t));
+    map_reduce_args.task_data = units;
+	strcpy(map_reduce_args.map, "combine_map.cl");
+	map_reduce_args.merger = &combine_merger;
+	map_reduce_args.num_output_per_map_task = 1;
+	map_reduce_args.num_workgroups = num_workgroups;
+	map_reduce_args.num_workitems = num_workitems;
+    map_reduce_args.splitter = NULL;
+    map_reduce_args.unit_size = sizeof(keyval_t);
+    map_reduce_args.keyval_size = sizeof(keyval_t);
+    map_reduce_args.key_size = sizeof(cl_int);
+    map_reduce_args.partition = NULL;
+    map_reduce_args.result_len = &res_len;
+
+    printf("Combine: Calling MapReduce Scheduler\n");
+
+    gettimeofday(&starttime,0);
+	for(size_t j = 0; j < sizeof(ops) / sizeof(ops[0]); j++)
+	{
+		op = ops[j];
+		for(size_t i = 0; i < NUM_KEYS; i++)
+			expected[i] = 0;
+		for(size_t i = 0; i < num_units; i++)
+		{
+			cl_uint* value = &expected[units[i].key];
+			if (op == MR_COMBINE_SUM)
+				*value += units[i].value;
+			else if (units[i].value > *value)
+				*value = units[i].value;
+		}
+
+		map_reduce_args.combine = op;
+		// The splitter uses up data_size
+		map_reduce_args.data_size = num_units * sizeof(keyval_t);
+		CHECK_ERROR (map_reduce (&map_reduce_args) < 0);
+		free(map_reduce_args.result);
+	}
+    CHECK_ERROR (map_reduce_finalize ());
+    gettimeofday(&endtime,0);
+
+    free(units);
+    if (failed)
+    {
+        printf("Combine: FAILED\n");
+        return 1;
+    }
+    printf("Combine: Completed %ld ms\n",time_diff (&endtime, &starttime));
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+// Map
+
+typedef struct
+{
+	int key;
+	uint value;
+} keyval_t;
+
+// The input already is keyvals, each one is emitted as it is
+__kernel void combine_map( __global const keyval_t* input, __global keyval_t* output,
+							uint data_size MR_MAP_PARAMS)
+{
+	MR_GROUP_PROLOGUE(input, output, data_size);
+	uint idx = get_local_id(0);
+	uint last_index = data_size / sizeof(keyval_t);
+
+	for(uint task_count = 0; task_count < TASKS_PER_MAP; task_count++)
+	{
+		uint curr_idx = idx + get_local_size(0) * task_count;
+		if (curr_idx >= last_index)
+			break;
+
+		output[curr_idx] = input[curr_idx];
+	}
+}
@@ -0,0 +1,130 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "map_reduce.h"
+#include "stddefines.h"
+
+// Map tasks per work-item
+#define UNITS_PER_ITEM 16
+// Key k > 0 is emitted k times per unit, key 0 once
+#define NUM_KEYS 4
+
+typedef struct
+{
+	cl_int key;
+	cl_uint value;
+} keyval_t;
+
+static cl_uint expected[NUM_KEYS];
+static bool failed = false;
+
+// Checks that no keyval was dropped by the workgroups that ran out of room
+void fm_merger(merger_dat_t* data)
+{
+	keyval_t* keyvals = (keyval_t*)data->keyvals;
+	size_t length = data->size;
+	cl_uint* sum = (cl_uint*)calloc(NUM_KEYS, sizeof(cl_uint));
+
+	for(size_t i = 0; i < length; i++)
+	{
+		cl_int key = keyvals[i].key;
+		if(key < 0 || key >= NUM_KEYS)
+		{
+			fprintf(stderr, "Fused map: unexpected key %d\n", key);
+			failed = true;
+			continue;
+		}
+		sum[key] += keyvals[i].value;
+	}
+	for(size_t i = 0; i < NUM_KEYS; i++)
+	{
+		if(sum[i] != expected[i])
+		{
+			fprintf(stderr, "Fused map: key %zu emitted %u times, expected %u\n", i, sum[i],
+					expected[i]);
+			failed = true;
+		}
+	}
+
+	free(keyvals);
+
+	data->output = sum;
+	data->output_size = NUM_KEYS;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct timeval starttime,endtime;
+	size_t num_workitems = 64;
+	size_t num_workgroups = 4;
+
+	// Obtain custom work size
+	if (argc > 2)
+    {
+		num_workitems = atoi(argv[1]);
+		num_workgroups = atoi(argv[2]);
+	}
+
+    printf("Fused map: Running...\n");
+
+	// The first half of the input emits one keyval per unit and fits, the workgroups
+	// of the second half emit two or three and have to be re-run
+	size_t num_keys = num_workgroups * num_workitems * UNITS_PER_ITEM;
+	cl_int* keys = (cl_int*)malloc(sizeof(cl_int) * num_keys);
+	CHECK_ERROR (keys == NULL);
+	for(size_t i = 0; i < NUM_KEYS; i++)
+		expected[i] = 0;
+	for(size_t i = 0; i < num_keys; i++)
+	{
+		cl_int key = (i < num_keys / 2) ? 0 : 2 + i % (NUM_KEYS - 2);
+		keys[i] = key;
+		expected[key] += (key > 0) ? key : 1;
+	}
+
+    CHECK_ERROR (map_reduce_init ());
+
+	size_t res_len;
+
+    // Setup scheduler args
+    map_reduce_args_t map_reduce_args;
+    memset(&map_reduce_args, 0, sizeof(map_reduce_args_t));
+    map_reduce_args.task_data = keys;
+	strcpy(map_reduce_args.map, "fm_map.cl");
+	map_reduce_args.merger = &fm_merger;
+	map_reduce_args.fused_map = true;
+	map_reduce_args.fused_outputs_per_task = 1;
+	map_reduce_args.num_workgroups = num_workgroups;
+	map_reduce_args.num_workitems = num_workitems;
+    map_reduce_args.splitter = NULL;
+    map_reduce_args.unit_size = sizeof(cl_int);
+    map_reduce_args.keyval_size = sizeof(keyval_t);
+    map_reduce_args.partition = NULL;
+    map_reduce_args.result_len = &res_len;
+    map_reduce_args.data_size = num_keys * sizeof(cl_int);
+
+    printf("Fused map: Calling MapReduce Scheduler\n");
+
+    gettimeofday(&starttime,0);
+    CHECK_ERROR (map_reduce (&map_reduce_args) < 0);
+    CHECK_ERROR (map_reduce_finalize ());
+    gettimeofday(&endtime,0);
+
+    free(map_reduce_args.result);
+    free(keys);
+    if (failed)
+    {
+        printf("Fused map: FAILED\n");
+        return 1;
+    }
+    printf("Fused map: Completed %ld ms\n",time_diff (&endtime, &starttime));
+
+    return 0;
+}
@@ -15,13 +15,33 @@ typedef struct
 	uchar b;
 } rgb_t;
 
-__kernel void hist_map( __global const rgb_t* input, __global keyval_t* output, uint data_size)
+// Most pixels share their colour values with others in the workgroup, so with
+// map_combine the pairs are combined locally before going to global memory.
+// Otherwise every task writes its three pairs to fixed slots
+#ifdef MR_MAP_COMBINE
+#define HIST_EMIT(output, counter, current, keyval) MR_COMBINE_EMIT(output, counter, keyval)
+#else
+#define HIST_EMIT(output, counter, current, keyval) (output)[current] = (keyval)
+#endif
+
+__kernel void hist_map( __global const rgb_t* input, __global keyval_t* output, uint data_size MR_MAP_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	uint last_index = ROUND_UP(data_size, sizeof(rgb_t));
 	keyval_t temp;
 	rgb_t curr;
 	uint curr_idx;
+#ifdef MR_MAP_COMBINE
+	__local uint counter;
+
+	if(idx == 0)
+	{
+		counter = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+	MR_COMBINE_INIT();
 
 	for(uint task_count = 0; task_count < TASKS_PER_MAP; task_count++)
 	{		
@@ -37,17 +57,17 @@ __kernel void hist_map( __global const rgb_t* input, __global keyval_t* output,
 		temp.key = curr.r;
 		temp.value = 1;
 		current = idx + get_local_size(0) * (0 + 3 * task_count);
-		output[current] = temp;
+		HIST_EMIT(output, counter, current, temp);
 		
 		temp.key = curr.g+256;
 		temp.value = 1;
 		current = idx + get_local_size(0) * (1 + 3 * task_count);
-		output[current] = temp;
+		HIST_EMIT(output, counter, current, temp);
 					
 		temp.key = curr.b+512;
 		temp.value = 1;
 		current = idx + get_local_size(0) * (2 + 3 * task_count);
-		output[current] = temp;
+		HIST_EMIT(output, counter, current, temp);
 	}
-
+	MR_COMBINE_FLUSH(output, counter);
 }
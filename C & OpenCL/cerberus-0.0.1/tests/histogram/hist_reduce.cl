@@ -8,8 +8,9 @@ typedef struct
 } keyval_t;
 
 
-__kernel void hist_reduce( __global const keyval_t* input, __global keyval_t* output, uint data_size)
+__kernel void hist_reduce( __global const keyval_t* input, __global keyval_t* output, uint data_size MR_REDUCE_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	__local uint hist_vals[768];
 
@@ -37,7 +38,8 @@ __kernel void hist_reduce( __global const keyval_t* input, __global keyval_t* ou
 		int key = input[curr_idx].key;
 		if (key < 768)
 		{
-			atomic_inc(&hist_vals[key]);
+			// Add the value, map_combine leaves partial counts
+			atomic_add(&hist_vals[key], input[curr_idx].value);
 		}
 	}		
 
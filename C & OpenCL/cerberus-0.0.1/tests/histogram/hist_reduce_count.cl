@@ -7,8 +7,9 @@ typedef struct
 } keyval_t;
 
 __kernel void hist_reduce_count( __global keyval_t* input, __global uint* output, 
-				uint data_size)
+				uint data_size MR_REDUCE_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 
 	if (idx == 0)
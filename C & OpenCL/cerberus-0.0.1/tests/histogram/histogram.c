@@ -55,6 +55,31 @@ typedef struct
 	cl_uint value;
 } keyval_t;
 
+// Host version of hist_map.cl for the native backend, counts locally and
+// emits one keyval per colour value seen
+void hist_native_map(const void* input, size_t size, const void* aux, mr_emitter_t* out)
+{
+	const unsigned char* pixels = (const unsigned char*)input;
+	cl_uint counts[768];
+	keyval_t temp;
+	
+	memset(counts, 0, sizeof(counts));
+	for(size_t i = 0; i + 3 <= size; i += 3)
+	{
+		counts[pixels[i]]++;
+		counts[pixels[i + 1] + 256]++;
+		counts[pixels[i + 2] + 512]++;
+	}
+	for(int i = 0; i < 768; i++)
+	{
+		if (counts[i] == 0)
+			continue;
+		temp.key = i;
+		temp.value = counts[i];
+		mr_emit(out, &temp);
+	}
+}
+
 void histogram_merger(merger_dat_t* data)
 {
 	keyval_t* keyvals = (keyval_t*)data->keyvals;
@@ -145,6 +170,9 @@ int main(int argc, char *argv[])
 
     CHECK_ERROR (map_reduce_init ());
 
+	// Size of result
+	size_t res_len;
+
     // Setup map reduce args
     map_reduce_args_t map_reduce_args;
     memset(&map_reduce_args, 0, sizeof(map_reduce_args_t));
@@ -169,6 +197,14 @@ int main(int argc, char *argv[])
     map_reduce_args.data_size = imgdata_bytes;
     map_reduce_args.keyval_size = sizeof(keyval_t);
 	map_reduce_args.partition = NULL; 
+	map_reduce_args.zero_copy = env_flag("CERBERUS_ZERO_COPY");
+	map_reduce_args.result_len = &res_len;
+	if (env_flag("CERBERUS_COMBINE"))
+		map_reduce_args.combine = MR_COMBINE_SUM;
+	if (env_flag("CERBERUS_MAP_COMBINE"))
+		map_reduce_args.map_combine = MR_COMBINE_SUM;
+	map_reduce_args.key_size = sizeof(cl_int);
+	map_reduce_args.native_map = &hist_native_map;
 
     fprintf(stderr, "Histogram: Calling MapReduce OpenCL Runtime\n");
 
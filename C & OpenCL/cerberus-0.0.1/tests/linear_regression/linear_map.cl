@@ -17,8 +17,9 @@ typedef struct
 } keyval_t;
 
 __kernel void linear_map( __global const char2* input, __global keyval_t* output,
-							uint data_size)
+							uint data_size MR_MAP_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 
 	uint last_index = ROUND_UP(data_size, sizeof(char2));
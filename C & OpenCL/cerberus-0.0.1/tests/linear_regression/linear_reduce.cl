@@ -9,8 +9,9 @@ typedef struct
 } keyval_t;
 
 __kernel void linear_reduce( __global const keyval_t* input, __global keyval_t* output,
-			uint data_size)
+			uint data_size MR_REDUCE_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	
 	uint last_index = ROUND_UP(data_size, sizeof(keyval_t));
@@ -9,8 +9,9 @@ typedef struct
 
 
 __kernel void linear_reduce_count(__global const keyval_t* input, __global uint* output,
-							uint data_size)
+							uint data_size MR_REDUCE_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	// Output counter. Controls writes to the shared global array.
 	// Add barrier so counter is always initialized by all threads
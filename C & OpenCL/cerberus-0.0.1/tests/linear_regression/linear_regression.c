@@ -164,6 +164,7 @@ int main(int argc, char *argv[]) {
     map_reduce_args.unit_size = sizeof(cl_int2);
     map_reduce_args.keyval_size = sizeof(keyval_t);
     map_reduce_args.partition = NULL; 
+    map_reduce_args.zero_copy = env_flag("CERBERUS_ZERO_COPY");
     map_reduce_args.result_len = &res_len;
     map_reduce_args.data_size = finfo.st_size - (finfo.st_size % map_reduce_args.unit_size);
 	
@@ -0,0 +1,137 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "map_reduce.h"
+#include "stddefines.h"
+
+// Map tasks per work-item
+#define UNITS_PER_ITEM 16
+// Few enough keys for every workgroup's table to hold them all
+#define NUM_KEYS 16
+
+typedef struct
+{
+	cl_int key;
+	cl_uint value;
+} keyval_t;
+
+static size_t num_workgroups = 4;
+static cl_uint expected[NUM_KEYS];
+static bool failed = false;
+
+// Checks that the partial counts of every key add up and that each workgroup
+// emitted no more than its table holds
+void mc_merger(merger_dat_t* data)
+{
+	keyval_t* keyvals = (keyval_t*)data->keyvals;
+	size_t length = data->size;
+	cl_uint* sum = (cl_uint*)calloc(NUM_KEYS, sizeof(cl_uint));
+
+	for(size_t i = 0; i < length; i++)
+	{
+		cl_int key = keyvals[i].key;
+		if(key < 0 || key >= NUM_KEYS)
+		{
+			fprintf(stderr, "Map combine: unexpected key %d\n", key);
+			failed = true;
+			continue;
+		}
+		sum[key] += keyvals[i].value;
+	}
+	for(size_t i = 0; i < NUM_KEYS; i++)
+	{
+		if(sum[i] != expected[i])
+		{
+			fprintf(stderr, "Map combine: key %zu counted %u times, expected %u\n", i, sum[i],
+					expected[i]);
+			failed = true;
+		}
+	}
+	// A key being inserted by two workitems at once can take two slots
+	if(length > num_workgroups * NUM_KEYS * 2)
+	{
+		fprintf(stderr, "Map combine: %zu keyvals from %zu workgroups, the keys were not combined\n",
+				length, num_workgroups);
+		failed = true;
+	}
+
+	free(keyvals);
+
+	data->output = sum;
+	data->output_size = NUM_KEYS;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct timeval starttime,endtime;
+	size_t num_workitems = 64;
+
+	// Obtain custom work size
+	if (argc > 2)
+    {
+		num_workitems = atoi(argv[1]);
+		num_workgroups = atoi(argv[2]);
+	}
+
+    printf("Map combine: Running...\n");
+
+	size_t num_units = num_workgroups * num_workitems * UNITS_PER_ITEM;
+	cl_int* keys = (cl_int*)malloc(sizeof(cl_int) * num_units);
+	CHECK_ERROR (keys == NULL);
+	for(size_t i = 0; i < NUM_KEYS; i++)
+		expected[i] = 0;
+	for(size_t i = 0; i < num_units; i++)
+	{
+		cl_int key = (i * 7919) % NUM_KEYS;
+		keys[i] = key;
+		expected[key]++;
+	}
+
+    CHECK_ERROR (map_reduce_init ());
+
+	size_t res_len;
+
+    // Setup scheduler args
+    map_reduce_args_t map_reduce_args;
+    memset(&map_reduce_args, 0, sizeof(map_reduce_args_t));
+    map_reduce_args.task_data = keys;
+	strcpy(map_reduce_args.map, "mc_map.cl");
+	map_reduce_args.merger = &mc_merger;
+	map_reduce_args.num_output_per_map_task = 1;
+	map_reduce_args.num_workgroups = num_workgroups;
+	map_reduce_args.num_workitems = num_workitems;
+    map_reduce_args.splitter = NULL;
+    map_reduce_args.unit_size = sizeof(cl_int);
+    map_reduce_args.keyval_size = sizeof(keyval_t);
+    map_reduce_args.key_size = sizeof(cl_int);
+    map_reduce_args.map_combine = MR_COMBINE_SUM;
+    map_reduce_args.partition = NULL;
+    map_reduce_args.result_len = &res_len;
+    map_reduce_args.data_size = num_units * sizeof(cl_int);
+
+    printf("Map combine: Calling MapReduce Scheduler\n");
+
+    gettimeofday(&starttime,0);
+    CHECK_ERROR (map_reduce (&map_reduce_args) < 0);
+    CHECK_ERROR (map_reduce_finalize ());
+    gettimeofday(&endtime,0);
+
+    free(map_reduce_args.result);
+    free(keys);
+    if (failed)
+    {
+        printf("Map combine: FAILED\n");
+        return 1;
+    }
+    printf("Map combine: Completed %ld ms\n",time_diff (&endtime, &starttime));
+
+    return 0;
+}
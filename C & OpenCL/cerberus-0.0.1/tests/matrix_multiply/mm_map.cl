@@ -15,8 +15,9 @@ typedef struct
 } keyval_t;
 
 __kernel void mm_map( __global const input_t* input, __global keyval_t* output, uint data_size, 
-					__global const int* matrix)		
+					__global const int* matrix MR_MAP_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 
 	uint last_index = ROUND_UP(data_size, sizeof(input_t));
@@ -0,0 +1,174 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "map_reduce.h"
+#include "stddefines.h"
+
+#define NUM_KEYS 16
+// Units with key 0 spin this long, they fill the first thread's share of the runs
+#define HEAVY_ROUNDS 20000
+
+typedef struct
+{
+	cl_int key;
+	cl_uint value;
+} keyval_t;
+
+static cl_uint expected[NUM_KEYS];
+static bool failed = false;
+
+// Emits every key with a count of 1
+void native_test_map(const void* input, size_t size, const void* aux, mr_emitter_t* out)
+{
+	const cl_int* keys = (const cl_int*)input;
+	keyval_t temp;
+
+	for(size_t i = 0; i < size / sizeof(cl_int); i++)
+	{
+		if(keys[i] == 0)
+		{
+			volatile cl_uint spin = 0;
+			for(cl_uint r = 0; r < HEAVY_ROUNDS; r++)
+				spin += r;
+		}
+		temp.key = keys[i];
+		temp.value = 1;
+		mr_emit(out, &temp);
+	}
+}
+
+// Sums the counts of each key in the reduce group, unknown keys go on to the merger
+void native_test_reduce(const void* keyvals, size_t num_keyvals, mr_emitter_t* out)
+{
+	const keyval_t* input = (const keyval_t*)keyvals;
+	cl_uint sum[NUM_KEYS];
+	keyval_t temp;
+
+	memset(sum, 0, sizeof(sum));
+	for(size_t i = 0; i < num_keyvals; i++)
+	{
+		if(input[i].key < 0 || input[i].key >= NUM_KEYS)
+			mr_emit(out, &input[i]);
+		else
+			sum[input[i].key] += input[i].value;
+	}
+	for(int i = 0; i < NUM_KEYS; i++)
+	{
+		if(sum[i] == 0)
+			continue;
+		temp.key = i;
+		temp.value = sum[i];
+		mr_emit(out, &temp);
+	}
+}
+
+// Checks that no unit was lost or mapped twice, every reduce group holds part of the counts
+void native_merger(merger_dat_t* data)
+{
+	keyval_t* keyvals = (keyval_t*)data->keyvals;
+	size_t length = data->size;
+	cl_uint* sum = (cl_uint*)calloc(NUM_KEYS, sizeof(cl_uint));
+
+	for(size_t i = 0; i < length; i++)
+	{
+		cl_int key = keyvals[i].key;
+		if(key < 0 || key >= NUM_KEYS)
+		{
+			fprintf(stderr, "Native: unexpected key %d\n", key);
+			failed = true;
+			continue;
+		}
+		sum[key] += keyvals[i].value;
+	}
+	for(size_t i = 0; i < NUM_KEYS; i++)
+	{
+		if(sum[i] != expected[i])
+		{
+			fprintf(stderr, "Native: key %zu counted %u times, expected %u\n", i, sum[i], expected[i]);
+			failed = true;
+		}
+	}
+
+	free(keyvals);
+
+	data->output = sum;
+	data->output_size = NUM_KEYS;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct timeval starttime,endtime;
+	size_t num_threads = 4;
+	// Units per native map call, small so there are runs to steal
+	size_t grain = 4;
+	size_t num_keys = 4096;
+
+	// Obtain custom thread count and grain
+	if (argc > 2)
+    {
+		num_threads = atoi(argv[1]);
+		grain = atoi(argv[2]);
+	}
+
+    printf("Native: Running...\n");
+
+	// The heavy keys come first, so the other threads have to steal them
+	cl_int* keys = (cl_int*)malloc(sizeof(cl_int) * num_keys);
+	CHECK_ERROR (keys == NULL);
+	for(size_t i = 0; i < NUM_KEYS; i++)
+		expected[i] = 0;
+	for(size_t i = 0; i < num_keys; i++)
+	{
+		cl_int key = (i < num_keys / 4) ? 0 : 1 + i % (NUM_KEYS - 1);
+		keys[i] = key;
+		expected[key]++;
+	}
+
+	// No map_reduce_init(), the native backend needs no OpenCL device
+
+	size_t res_len;
+
+    // Setup scheduler args
+    map_reduce_args_t map_reduce_args;
+    memset(&map_reduce_args, 0, sizeof(map_reduce_args_t));
+    map_reduce_args.task_data = keys;
+	map_reduce_args.merger = &native_merger;
+	map_reduce_args.backend = MR_BACKEND_NATIVE;
+	map_reduce_args.native_map = &native_test_map;
+	map_reduce_args.native_reduce = &native_test_reduce;
+	map_reduce_args.num_threads = num_threads;
+	map_reduce_args.native_grain = grain;
+	map_reduce_args.num_workgroups = num_threads;
+    map_reduce_args.splitter = NULL;
+    map_reduce_args.unit_size = sizeof(cl_int);
+    map_reduce_args.keyval_size = sizeof(keyval_t);
+    map_reduce_args.partition = NULL;
+    map_reduce_args.result_len = &res_len;
+    map_reduce_args.data_size = num_keys * sizeof(cl_int);
+
+    printf("Native: Calling MapReduce Scheduler\n");
+
+    gettimeofday(&starttime,0);
+    CHECK_ERROR (map_reduce (&map_reduce_args) < 0);
+    CHECK_ERROR (map_reduce_finalize ());
+    gettimeofday(&endtime,0);
+
+    free(map_reduce_args.result);
+    free(keys);
+    if (failed)
+    {
+        printf("Native: FAILED\n");
+        return 1;
+    }
+    printf("Native: Completed %ld ms\n",time_diff (&endtime, &starttime));
+
+    return 0;
+}
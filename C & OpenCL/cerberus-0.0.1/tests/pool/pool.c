@@ -0,0 +1,142 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "map_reduce.h"
+#include "stddefines.h"
+
+// Map tasks per work-item
+#define UNITS_PER_ITEM 16
+#define NUM_KEYS 16
+// The same job runs this many times on the runtime of map_reduce_init()
+#define NUM_RUNS 3
+
+typedef struct
+{
+	cl_int key;
+	cl_uint value;
+} keyval_t;
+
+static cl_uint expected[NUM_KEYS];
+static bool failed = false;
+
+// Checks that every key was mapped as many times as it appears in the input
+void pool_merger(merger_dat_t* data)
+{
+	keyval_t* keyvals = (keyval_t*)data->keyvals;
+	size_t length = data->size;
+	cl_uint* sum = (cl_uint*)calloc(NUM_KEYS, sizeof(cl_uint));
+
+	for(size_t i = 0; i < length; i++)
+	{
+		cl_int key = keyvals[i].key;
+		if(key < 0 || key >= NUM_KEYS)
+		{
+			fprintf(stderr, "Pool: unexpected key %d\n", key);
+			failed = true;
+			continue;
+		}
+		sum[key] += keyvals[i].value;
+	}
+	for(size_t i = 0; i < NUM_KEYS; i++)
+	{
+		if(sum[i] != expected[i])
+		{
+			fprintf(stderr, "Pool: key %zu counted %u times, expected %u\n", i, sum[i], expected[i]);
+			failed = true;
+		}
+	}
+
+	free(keyvals);
+
+	data->output = sum;
+	data->output_size = NUM_KEYS;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct timeval starttime,endtime;
+	size_t num_workitems = 64;
+	size_t num_workgroups = 4;
+	mr_pool_stats_t first;
+	mr_pool_stats_t last;
+
+	// Obtain custom work size
+	if (argc > 2)
+    {
+		num_workitems = atoi(argv[1]);
+		num_workgroups = atoi(argv[2]);
+	}
+
+    printf("Pool: Running...\n");
+
+	size_t num_keys = num_workgroups * num_workitems * UNITS_PER_ITEM;
+	cl_int* keys = (cl_int*)malloc(sizeof(cl_int) * num_keys);
+	CHECK_ERROR (keys == NULL);
+	for(size_t i = 0; i < NUM_KEYS; i++)
+		expected[i] = 0;
+	for(size_t i = 0; i < num_keys; i++)
+	{
+		cl_int key = (i * 7919) % NUM_KEYS;
+		keys[i] = key;
+		expected[key]++;
+	}
+
+    CHECK_ERROR (map_reduce_init ());
+
+	size_t res_len;
+
+    // Setup scheduler args
+    map_reduce_args_t map_reduce_args;
+    memset(&map_reduce_args, 0, sizeof(map_reduce_args_t));
+    map_reduce_args.task_data = keys;
+	strcpy(map_reduce_args.map, "pool_map.cl");
+	map_reduce_args.merger = &pool_merger;
+	map_reduce_args.num_output_per_map_task = 1;
+	map_reduce_args.num_workgroups = num_workgroups;
+	map_reduce_args.num_workitems = num_workitems;
+    map_reduce_args.splitter = NULL;
+    map_reduce_args.unit_size = sizeof(cl_int);
+    map_reduce_args.keyval_size = sizeof(keyval_t);
+    map_reduce_args.partition = NULL;
+    map_reduce_args.result_len = &res_len;
+
+    printf("Pool: Calling MapReduce Scheduler %d times\n", NUM_RUNS);
+
+    gettimeofday(&starttime,0);
+	for(int run = 0; run < NUM_RUNS; run++)
+	{
+		// The splitter uses up data_size
+		map_reduce_args.data_size = num_keys * sizeof(cl_int);
+		CHECK_ERROR (map_reduce (&map_reduce_args) < 0);
+		free(map_reduce_args.result);
+		CHECK_ERROR (map_reduce_pool_stats (run == 0 ? &first : &last) < 0);
+	}
+    gettimeofday(&endtime,0);
+
+	// Every buffer of the first run is back in the pool, the later runs create none
+	if (last.hits <= first.hits || last.misses != first.misses)
+	{
+		fprintf(stderr, "Pool: %zu hits and %zu misses after the first run, %zu and %zu after "
+				"the last\n", first.hits, first.misses, last.hits, last.misses);
+		failed = true;
+	}
+    CHECK_ERROR (map_reduce_finalize ());
+
+    free(keys);
+    if (failed)
+    {
+        printf("Pool: FAILED\n");
+        return 1;
+    }
+    printf("Pool: Completed %ld ms\n",time_diff (&endtime, &starttime));
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+// Map
+
+typedef struct
+{
+	int key;
+	uint value;
+} keyval_t;
+
+__kernel void pool_map( __global const int* input, __global keyval_t* output,
+							uint data_size MR_MAP_PARAMS)
+{
+	MR_GROUP_PROLOGUE(input, output, data_size);
+	uint idx = get_local_id(0);
+	uint last_index = data_size / sizeof(int);
+	keyval_t temp;
+
+	for(uint task_count = 0; task_count < TASKS_PER_MAP; task_count++)
+	{
+		uint curr_idx = idx + get_local_size(0) * task_count;
+		if (curr_idx >= last_index)
+			break;
+
+		temp.key = input[curr_idx];
+		temp.value = 1;
+		output[curr_idx] = temp;
+	}
+}
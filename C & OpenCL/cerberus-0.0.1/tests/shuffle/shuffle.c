@@ -0,0 +1,135 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "map_reduce.h"
+#include "stddefines.h"
+
+// Map tasks per work-item, sized so the map output has no holes
+#define UNITS_PER_ITEM 16
+// Key 0 takes the first half of the sorted keys, 1 to NUM_KEYS - 1 share the rest
+#define NUM_KEYS 4
+
+typedef struct
+{
+	cl_int key;
+	cl_uint value;
+} keyval_t;
+
+static cl_uint expected[NUM_KEYS];
+static bool failed = false;
+
+// Checks that every key was reduced exactly once and to its full count
+void shuffle_merger(merger_dat_t* data)
+{
+	keyval_t* keyvals = (keyval_t*)data->keyvals;
+	size_t length = data->size;
+	cl_uint* seen = (cl_uint*)calloc(NUM_KEYS, sizeof(cl_uint));
+	cl_uint* sum = (cl_uint*)calloc(NUM_KEYS, sizeof(cl_uint));
+
+	for(size_t i = 0; i < length; i++)
+	{
+		cl_int key = keyvals[i].key;
+		if(key < 0 || key >= NUM_KEYS)
+		{
+			fprintf(stderr, "Shuffle: unexpected key %d\n", key);
+			failed = true;
+			continue;
+		}
+		seen[key]++;
+		sum[key] += keyvals[i].value;
+	}
+	for(size_t i = 0; i < NUM_KEYS; i++)
+	{
+		if(seen[i] != 1 || sum[i] != expected[i])
+		{
+			fprintf(stderr, "Shuffle: key %zu reduced %u times to %u, expected once to %u\n",
+					i, seen[i], sum[i], expected[i]);
+			failed = true;
+		}
+	}
+
+	free(seen);
+	free(keyvals);
+
+	data->output = sum;
+	data->output_size = NUM_KEYS;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct timeval starttime,endtime;
+	size_t num_workitems = 64;
+	size_t num_workgroups = 4;
+
+	// Obtain custom work size
+	if (argc > 2)
+    {
+		num_workitems = atoi(argv[1]);
+		num_workgroups = atoi(argv[2]);
+	}
+
+    printf("Shuffle: Running...\n");
+
+	// The cuts of the default slices fall inside the runs of equal keys
+	size_t num_keys = num_workgroups * num_workitems * UNITS_PER_ITEM;
+	cl_int* keys = (cl_int*)malloc(sizeof(cl_int) * num_keys);
+	CHECK_ERROR (keys == NULL);
+	for(size_t i = 0; i < NUM_KEYS; i++)
+		expected[i] = 0;
+	for(size_t i = 0; i < num_keys; i++)
+	{
+		// Scatter the keys so the sort has work to do
+		size_t j = (i * 7919) % num_keys;
+		cl_int key = (j < num_keys / 2) ? 0 : 1 + j % (NUM_KEYS - 1);
+		keys[i] = key;
+		expected[key]++;
+	}
+
+    CHECK_ERROR (map_reduce_init ());
+
+	size_t res_len;
+
+    // Setup scheduler args
+    map_reduce_args_t map_reduce_args;
+    memset(&map_reduce_args, 0, sizeof(map_reduce_args_t));
+    map_reduce_args.task_data = keys;
+	strcpy(map_reduce_args.map, "shuffle_map.cl");
+	strcpy(map_reduce_args.reduce, "shuffle_reduce.cl");
+	strcpy(map_reduce_args.reduce_count, "shuffle_reduce_count.cl");
+	map_reduce_args.merger = &shuffle_merger;
+	map_reduce_args.num_output_per_map_task = 1;
+	map_reduce_args.num_workgroups = num_workgroups;
+	map_reduce_args.num_workitems = num_workitems;
+    map_reduce_args.splitter = NULL;
+    map_reduce_args.unit_size = sizeof(cl_int);
+    map_reduce_args.keyval_size = sizeof(keyval_t);
+    map_reduce_args.partition = NULL;
+    map_reduce_args.shuffle = MR_SHUFFLE_INT;
+    map_reduce_args.result_len = &res_len;
+    map_reduce_args.data_size = num_keys * sizeof(cl_int);
+
+    printf("Shuffle: Calling MapReduce Scheduler\n");
+
+    gettimeofday(&starttime,0);
+    CHECK_ERROR (map_reduce (&map_reduce_args) < 0);
+    CHECK_ERROR (map_reduce_finalize ());
+    gettimeofday(&endtime,0);
+
+    free(keys);
+    if (failed)
+    {
+        printf("Shuffle: FAILED\n");
+        return 1;
+    }
+    printf("Shuffle: Completed %ld ms\n",time_diff (&endtime, &starttime));
+
+    return 0;
+}
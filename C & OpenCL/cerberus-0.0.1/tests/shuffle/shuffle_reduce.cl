@@ -0,0 +1,35 @@
+// Reduce
+
+typedef struct
+{
+	int key;
+	uint value;
+} keyval_t;
+
+// The slice is sorted, so one work-item walks it and emits a count per key
+__kernel void shuffle_reduce( __global const keyval_t* input, __global keyval_t* output,
+			uint data_size MR_REDUCE_PARAMS)
+{
+	MR_GROUP_PROLOGUE(input, output, data_size);
+	uint last_index = data_size / sizeof(keyval_t);
+
+	if (get_local_id(0) != 0 || last_index == 0)
+		return;
+
+	uint current = 0;
+	keyval_t temp = input[0];
+	for(uint i = 1; i < last_index; i++)
+	{
+		// Emit the old key when it changes
+		if (input[i].key != temp.key)
+		{
+			output[current++] = temp;
+			temp = input[i];
+		}
+		else
+		{
+			temp.value += input[i].value;
+		}
+	}
+	output[current] = temp;
+}
@@ -0,0 +1,25 @@
+
+typedef struct
+{
+	int key;
+	uint value;
+} keyval_t;
+
+__kernel void shuffle_reduce_count( __global const keyval_t* input, __global uint* output,
+				uint data_size MR_REDUCE_PARAMS)
+{
+	MR_GROUP_PROLOGUE(input, output, data_size);
+	uint last_index = data_size / sizeof(keyval_t);
+
+	// Only the first thread walks the slice and counts the distinct keys
+	if (get_local_id(0) != 0)
+		return;
+
+	uint counter = (last_index > 0) ? 1 : 0;
+	for(uint i = 1; i < last_index; i++)
+	{
+		if (input[i].key != input[i - 1].key)
+			counter++;
+	}
+	*output = counter;
+}
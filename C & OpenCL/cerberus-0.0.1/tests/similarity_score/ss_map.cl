@@ -7,8 +7,9 @@ typedef struct
 } keyval_t;
 
 __kernel void ss_map(__global const int2* input, __global keyval_t* output, uint data_size, 
-						__global const float4* matrix)
+						__global const float4* matrix MR_MAP_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	uint last_index = ROUND_UP(data_size, sizeof(int2));
 	int2 curr;
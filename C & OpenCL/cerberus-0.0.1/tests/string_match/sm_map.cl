@@ -54,8 +54,9 @@ int strcmp(__constant const char* s1, const char* s2, const uint len)
 	return ret;
 }
 
-__kernel void sm_map( __global const input_t* input, __global keyval_t* output, uint data_size)
+__kernel void sm_map( __global const input_t* input, __global keyval_t* output, uint data_size MR_MAP_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	__local uint counter;
 		
@@ -99,38 +100,33 @@ __kernel void sm_map( __global const input_t* input, __global keyval_t* output,
 					if (is_letter(curr_ltr) == 0)
 					{
 						uint len = &buffer.x[i] - curr_start;
-						uint current;
 						
 						if(!strcmp(WORD1, curr_start, len))
 						{
 							temp.key = 0;									
 							temp.value = 1;
-							current = atomic_inc(&counter);
-							output[current] = temp;
+							MR_EMIT(output, counter, temp);
 						}
 							
 						if(!strcmp(WORD2, curr_start, len))
 						{		
 							temp.key = 1;									
 							temp.value = 1;
-							uint current = atomic_inc(&counter);
-							output[current] = temp;
+							MR_EMIT(output, counter, temp);
 						}
 							
 						if(!strcmp(WORD3, curr_start, len))
 						{		
 							temp.key = 2;									
 							temp.value = 1;
-							current = atomic_inc(&counter);
-							output[current] = temp;
+							MR_EMIT(output, counter, temp);
 						}
 							
 						if(!strcmp(WORD4, curr_start, len))
 						{		
 							temp.key = 3;									
 							temp.value = 1;
-							current = atomic_inc(&counter);
-							output[current] = temp;
+							MR_EMIT(output, counter, temp);
 						}
 
 						state = NOT_IN_WORD;
@@ -152,38 +148,33 @@ __kernel void sm_map( __global const input_t* input, __global keyval_t* output,
 		if (state == IN_WORD)
 		{		
 			uint len = &buffer.x[i] - curr_start;
-			uint current;
 			
 			if(!strcmp(WORD1, curr_start, len))
 			{
 				temp.key = 0;									
 				temp.value = 1;
-				current = atomic_inc(&counter);
-				output[current] = temp;
+				MR_EMIT(output, counter, temp);
 			}
 				
 			if(!strcmp(WORD2, curr_start, len))
 			{		
 				temp.key = 1;									
 				temp.value = 1;
-				uint current = atomic_inc(&counter);
-				output[current] = temp;
+				MR_EMIT(output, counter, temp);
 			}
 				
 			if(!strcmp(WORD3, curr_start, len))
 			{		
 				temp.key = 2;									
 				temp.value = 1;
-				current = atomic_inc(&counter);
-				output[current] = temp;
+				MR_EMIT(output, counter, temp);
 			}
 				
 			if(!strcmp(WORD4, curr_start, len))
 			{		
 				temp.key = 3;									
 				temp.value = 1;
-				current = atomic_inc(&counter);
-				output[current] = temp;
+				MR_EMIT(output, counter, temp);
 			}
 		}
 	}
@@ -56,8 +56,9 @@ int strcmp(__constant const char* s1, const char* s2, const uint len)
 }
 
 
-__kernel void sm_map_count( __global const input_t* input, __global uint* output, uint data_size)
+__kernel void sm_map_count( __global const input_t* input, __global uint* output, uint data_size MR_MAP_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	__local uint counter;
 		
@@ -89,7 +90,7 @@ __kernel void sm_map_count( __global const input_t* input, __global uint* output
 		
 		// Check for NULL input
 		if (buffer.x[0] == '\0')
-			return;
+			break;
 				
 		for (i = 0; i < LINE_LENGTH; i++)
 		{					
@@ -140,6 +140,21 @@ void sm_splitter (void* input)
 	}
 }
 
+// The splitter only reads task_data, so there is nothing to restore
+void sm_rewind (void* data)
+{
+}
+
+// Ends out-of-core rounds between words
+size_t sm_boundary(const void* data, size_t len)
+{
+	const cl_char* text = (const cl_char*)data;
+	
+	while (len > 0 && is_letter(text[len - 1]))
+		len--;
+	return len;
+}
+
 void sm_merger(merger_dat_t* data)
 {
 	keyval_t* keyvals = (keyval_t*)data->keyvals;
@@ -221,6 +236,11 @@ int main(int argc, char *argv[])
 	strcpy(map_reduce_args.map_count, "sm_map_count.cl");
 	map_reduce_args.merger = &sm_merger;
     map_reduce_args.splitter = &sm_splitter;
+    map_reduce_args.splitter_rewind = &sm_rewind;
+    map_reduce_args.out_of_core = env_flag("CERBERUS_OUT_OF_CORE");
+    map_reduce_args.round_boundary = &sm_boundary;
+    map_reduce_args.fused_map = env_flag("CERBERUS_FUSED_MAP");
+    map_reduce_args.fused_outputs_per_task = 2;
 	if (num_workgroups > 0)
 		map_reduce_args.num_workgroups = num_workgroups;
 	else
@@ -234,6 +254,7 @@ int main(int argc, char *argv[])
     map_reduce_args.unit_size = sizeof(input_t);
     map_reduce_args.keyval_size = sizeof(keyval_t);
     map_reduce_args.partition = NULL; 
+    map_reduce_args.zero_copy = env_flag("CERBERUS_ZERO_COPY");
     map_reduce_args.result_len = &res_len;
     map_reduce_args.data_size = finfo.st_size;
 
@@ -0,0 +1,162 @@
+/*  Karol Pogonowski - Master of Informatics Dissertation
+	This is an OpenCL MapReduce library written in C/OpenCL and primarily
+	targeting GPU computing.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "map_reduce.h"
+#include "stddefines.h"
+
+#define NUM_JOBS 4
+// Keys of each job, job j uses keys j * NUM_KEYS to (j + 1) * NUM_KEYS - 1
+#define NUM_KEYS 8
+#define ALL_KEYS (NUM_JOBS * NUM_KEYS)
+
+typedef struct
+{
+	cl_int key;
+	cl_uint value;
+} keyval_t;
+
+static cl_uint expected[ALL_KEYS];
+static bool failed = false;
+
+// Emits every key with a count of 1
+void submit_map(const void* input, size_t size, const void* aux, mr_emitter_t* out)
+{
+	const cl_int* keys = (const cl_int*)input;
+	keyval_t temp;
+
+	for(size_t i = 0; i < size / sizeof(cl_int); i++)
+	{
+		temp.key = keys[i];
+		temp.value = 1;
+		mr_emit(out, &temp);
+	}
+}
+
+// Counts the keys of one job, main() checks them once the job is waited for
+void submit_merger(merger_dat_t* data)
+{
+	keyval_t* keyvals = (keyval_t*)data->keyvals;
+	size_t length = data->size;
+	cl_uint* sum = (cl_uint*)calloc(ALL_KEYS, sizeof(cl_uint));
+
+	for(size_t i = 0; i < length; i++)
+	{
+		cl_int key = keyvals[i].key;
+		if(key < 0 || key >= ALL_KEYS)
+		{
+			fprintf(stderr, "Submit: unexpected key %d\n", key);
+			failed = true;
+			continue;
+		}
+		sum[key] += keyvals[i].value;
+	}
+
+	free(keyvals);
+
+	data->output = sum;
+	data->output_size = ALL_KEYS;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct timeval starttime,endtime;
+	// Units of the first job, the others get more
+	size_t units = 1024;
+	struct timespec pause = { 0, 1000000 };
+	mr_job_t* jobs[NUM_JOBS];
+	cl_int* keys[NUM_JOBS];
+	size_t res_len[NUM_JOBS];
+	map_reduce_args_t map_reduce_args[NUM_JOBS];
+
+    printf("Submit: Running...\n");
+
+	// Every job has its own keys and a different input size
+	for(size_t i = 0; i < ALL_KEYS; i++)
+		expected[i] = 0;
+	for(size_t j = 0; j < NUM_JOBS; j++)
+	{
+		size_t num_keys = units * (j + 1);
+		keys[j] = (cl_int*)malloc(sizeof(cl_int) * num_keys);
+		CHECK_ERROR (keys[j] == NULL);
+		for(size_t i = 0; i < num_keys; i++)
+		{
+			cl_int key = j * NUM_KEYS + (i * 7) % NUM_KEYS;
+			keys[j][i] = key;
+			expected[key]++;
+		}
+
+		// Setup scheduler args, on the native backend so no device is needed
+		memset(&map_reduce_args[j], 0, sizeof(map_reduce_args_t));
+		map_reduce_args[j].task_data = keys[j];
+		map_reduce_args[j].merger = &submit_merger;
+		map_reduce_args[j].backend = MR_BACKEND_NATIVE;
+		map_reduce_args[j].native_map = &submit_map;
+		map_reduce_args[j].num_threads = 2;
+		map_reduce_args[j].splitter = NULL;
+		map_reduce_args[j].unit_size = sizeof(cl_int);
+		map_reduce_args[j].keyval_size = sizeof(keyval_t);
+		map_reduce_args[j].partition = NULL;
+		map_reduce_args[j].result_len = &res_len[j];
+		map_reduce_args[j].data_size = num_keys * sizeof(cl_int);
+	}
+
+    printf("Submit: Submitting %d jobs\n", NUM_JOBS);
+
+    gettimeofday(&starttime,0);
+	for(size_t j = 0; j < NUM_JOBS; j++)
+	{
+		jobs[j] = map_reduce_submit(&map_reduce_args[j]);
+		CHECK_ERROR (jobs[j] == NULL);
+	}
+	// Jobs complete in submission order, once the last one is done all of them are
+	while (!map_reduce_poll(jobs[NUM_JOBS - 1]))
+		nanosleep(&pause, NULL);
+	for(size_t j = 0; j < NUM_JOBS; j++)
+	{
+		if (!map_reduce_poll(jobs[j]))
+		{
+			fprintf(stderr, "Submit: job %zu still running after job %d\n", j, NUM_JOBS - 1);
+			failed = true;
+		}
+	}
+	for(size_t j = 0; j < NUM_JOBS; j++)
+	{
+		CHECK_ERROR (map_reduce_wait(jobs[j]) < 0);
+		// Only the job's own keys, all of them
+		cl_uint* sum = (cl_uint*)map_reduce_args[j].result;
+		for(size_t i = 0; i < ALL_KEYS; i++)
+		{
+			cl_uint want = (i / NUM_KEYS == j) ? expected[i] : 0;
+			if (sum[i] != want)
+			{
+				fprintf(stderr, "Submit: job %zu counted key %zu %u times, expected %u\n", j, i,
+						sum[i], want);
+				failed = true;
+			}
+		}
+		free(sum);
+		free(keys[j]);
+	}
+    CHECK_ERROR (map_reduce_finalize ());
+    gettimeofday(&endtime,0);
+
+    if (failed)
+    {
+        printf("Submit: FAILED\n");
+        return 1;
+    }
+    printf("Submit: Completed %ld ms\n",time_diff (&endtime, &starttime));
+
+    return 0;
+}
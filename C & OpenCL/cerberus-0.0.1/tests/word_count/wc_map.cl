@@ -53,8 +53,9 @@ char to_upper(char curr_ltr)
 	return curr_ltr;
 }
 
-__kernel void wc_map( __global const input_t* input, __global keyval_t* output, uint data_size)
+__kernel void wc_map( __global const input_t* input, __global keyval_t* output, uint data_size MR_MAP_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	__local uint counter;
 	
@@ -64,6 +65,7 @@ __kernel void wc_map( __global const input_t* input, __global keyval_t* output,
 	}
 
 	barrier(CLK_LOCAL_MEM_FENCE);
+	MR_COMBINE_INIT();
 
 	uint last_index = ROUND_UP(data_size, sizeof(input_t) * TASKS_PER_MAP);
 	
@@ -83,9 +85,9 @@ __kernel void wc_map( __global const input_t* input, __global keyval_t* output,
 						
 			curr_start = &buffer.x;
 			
-			// Check for NULL input
+			// Check for NULL input, every workitem has to reach the flush
 			if (buffer.x[0] == '\0')
-				return;
+				break;
 					
 			for (i = 0; i < LINE_LENGTH; i++)
 			{					
@@ -99,11 +101,9 @@ __kernel void wc_map( __global const input_t* input, __global keyval_t* output,
 						if ((curr_ltr < 'A' || curr_ltr > 'Z') && curr_ltr != '\'')
 						{
 							temp.value = 1;
-							// Emit
-							// Update the output array counter
-							uint current = atomic_inc(&counter);
 							strcpy(&temp.key, curr_start, &buffer.x[i] - curr_start + 1);
-							output[current] = temp;
+							// Emit
+							MR_COMBINE_EMIT(output, counter, temp);
 							state = NOT_IN_WORD;
 						}
 						break;
@@ -131,10 +131,11 @@ __kernel void wc_map( __global const input_t* input, __global keyval_t* output,
 				temp.key[&buffer.x[i] - curr_start] = '\0';
 				temp.value = 1;
 				
-				uint current = atomic_inc(&counter);				
-				output[current] = temp;
+				// Emit
+				MR_COMBINE_EMIT(output, counter, temp);
 			}
 		}
 	}
+	MR_COMBINE_FLUSH(output, counter);
 }  
 
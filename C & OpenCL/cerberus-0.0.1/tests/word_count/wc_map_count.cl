@@ -28,8 +28,9 @@ char to_upper(char curr_ltr)
 	return curr_ltr;
 }
 
-__kernel void wc_map_count( __global const input_t* input, __global uint* output, uint data_size)
+__kernel void wc_map_count( __global const input_t* input, __global uint* output, uint data_size MR_MAP_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	// Output counter. Controls writes to the shared global array.
 	// Add barrier so counter is always initialized by all threads
@@ -59,7 +60,7 @@ __kernel void wc_map_count( __global const input_t* input, __global uint* output
 									
 			// Check for NULL input
 			if (buffer.x[0] == '\0')
-				return;
+				break;
 					
 			for (i = 0; i < LINE_LENGTH; i++)
 			{					
@@ -37,8 +37,9 @@ void gstrcpy(char *out, const __global char *in)
 }
 
 __kernel void wc_reduce( __global const keyval_t* input, __global keyval_t* output,
-			uint data_size)
+			uint data_size MR_REDUCE_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	__local uint counter;
 	
@@ -23,8 +23,9 @@ int strcmp(__global const char *s1, __global const char *s2)
 }
 
 
-__kernel void wc_reduce_count( __global const keyval_t* input, __global uint* output,uint data_size)
+__kernel void wc_reduce_count( __global const keyval_t* input, __global uint* output,uint data_size MR_REDUCE_PARAMS)
 {
+	MR_GROUP_PROLOGUE(input, output, data_size);
 	uint idx = get_local_id(0);
 	__local uint counter;
 	
@@ -145,6 +145,11 @@ void word_count_splitter (void* input)
 		env->splitter_data[i].length = (sizeof(input_t) * tasks_per_map * env->num_workitems);
 	}
 }
+
+// The splitter only reads task_data, so there is nothing to restore
+void word_count_rewind (void* data)
+{
+}
 	
 void word_count_partition (void* input)
 {
@@ -192,6 +197,52 @@ void word_count_partition (void* input)
 	
 }
 
+// Host version of wc_map.cl for the native backend
+void word_count_native_map(const void* input, size_t size, const void* aux, mr_emitter_t* out)
+{
+	const input_t* lines = (const input_t*)input;
+	keyval_t temp;
+	
+	for(size_t j = 0; j < size / sizeof(input_t); j++)
+	{
+		const char* line = (const char*)lines[j].x;
+		// Check for NULL input
+		if (line[0] == '\0')
+			break;
+		
+		int i = 0;
+		while (i < LINE_LENGTH && line[i] != '\0')
+		{
+			if (!is_letter(line[i]))
+			{
+				i++;
+				continue;
+			}
+			// Copy the word in uppercase, cut to fit the key
+			int len = 0;
+			memset(temp.key, 0, WORD_LENGTH);
+			while (i < LINE_LENGTH && (is_letter(line[i]) || line[i] == '\''))
+			{
+				if (len < WORD_LENGTH - 1)
+					temp.key[len++] = toupper(line[i]);
+				i++;
+			}
+			temp.value = 1;
+			mr_emit(out, &temp);
+		}
+	}
+}
+
+// Ends out-of-core rounds between words
+size_t word_count_boundary(const void* data, size_t len)
+{
+	const char* text = (const char*)data;
+	
+	while (len > 0 && is_letter(text[len - 1]))
+		len--;
+	return len;
+}
+
 void word_count_merger(merger_dat_t* data)
 {
 	keyval_t* keyvals = (keyval_t*)data->keyvals;
@@ -201,8 +252,13 @@ void word_count_merger(merger_dat_t* data)
 	cl_uint curr_idx = 0;
 	cl_uint counter = 0;
 	
-	// First, we need to sort the data
-	qsort(keyvals, length, sizeof(keyval_t), wc_cmp);
+	// First, we need to sort the data. The combiner leaves one keyval per word
+	// and round, in no particular order
+	size_t sorted = 1;
+	while (sorted < length && wc_cmp(&keyvals[sorted - 1], &keyvals[sorted]) <= 0)
+		sorted++;
+	if (sorted < length)
+		qsort(keyvals, length, sizeof(keyval_t), wc_cmp);
 	
 	// Now, we can peform an in-place reduction
 	for(size_t i = 0; i < length; i++)
@@ -297,7 +353,21 @@ int main(int argc, char *argv[])
 	//strcpy(map_reduce_args.reduce_count, "wc_reduce_count.cl");
 	map_reduce_args.merger = &word_count_merger;
     map_reduce_args.splitter = &word_count_splitter;
+    map_reduce_args.splitter_rewind = &word_count_rewind;
     map_reduce_args.partition = &word_count_partition;
+    if (env_flag("CERBERUS_SHUFFLE"))
+        map_reduce_args.shuffle = MR_SHUFFLE_BYTES;
+    if (env_flag("CERBERUS_COMBINE"))
+        map_reduce_args.combine = MR_COMBINE_SUM;
+    if (env_flag("CERBERUS_MAP_COMBINE"))
+        map_reduce_args.map_combine = MR_COMBINE_SUM;
+    map_reduce_args.string_keys = true;
+    map_reduce_args.key_size = WORD_LENGTH;
+    map_reduce_args.native_map = &word_count_native_map;
+    map_reduce_args.out_of_core = env_flag("CERBERUS_OUT_OF_CORE");
+    map_reduce_args.round_boundary = &word_count_boundary;
+    map_reduce_args.fused_map = env_flag("CERBERUS_FUSED_MAP");
+    map_reduce_args.fused_outputs_per_task = 16;
 	map_reduce_args.tasks_per_reduce = 1;
 	if (num_workgroups > 0)
 		map_reduce_args.num_workgroups = num_workgroups;
@@ -311,6 +381,7 @@ int main(int argc, char *argv[])
 		
     map_reduce_args.unit_size = sizeof(input_t);
     map_reduce_args.keyval_size = sizeof(keyval_t);
+    map_reduce_args.zero_copy = env_flag("CERBERUS_ZERO_COPY");
     map_reduce_args.result_len = &res_len;
     map_reduce_args.data_size = finfo.st_size;
 